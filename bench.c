@@ -0,0 +1,748 @@
+//
+// file-name: bench.c
+//
+// flags to compile: -std=c99 -O2 -Wall -Wextra
+// (together with trie.c, trie6.c, lctrie.c, sarray.c, entry.c,
+// loader.c and cache.c; link with -lm)
+//
+// description: bench.c is the benchmark suite of the trie. It runs on
+// synthetic geo-IP tables of the sizes given with -n, from thousands
+// to tens of millions of ranges, or on a CSV file in the place_ip
+// format, and measures for each:
+//   - ibt_insert throughput, ibt_destroy time and ibt_build_bulk time,
+//     and ibt_build_parallel time on a thread per core
+//   - a feed of upserts and deletes, the memory and slack of the trie
+//     it leaves, and ibt_compact time
+//   - ibt_search latency percentiles (p50, p99, p999) for uniformly
+//     drawn keys and for skewed keys that favour a few hot ranges
+//   - ibt_search against ibt_search_batch, with and without a direct
+//     table of DIRECT_BITS bits in front of the engine
+//   - the same lookups with the bitwise trie (IBT_BINARY) and the
+//     sorted-array engine (IBT_SORTED) in place of the LC index
+//   - a hot-key cache of CACHE_SLOTS entries in front of ibt_search,
+//     keyed on the address and on its /24, for the skewed keys
+//   - a range scan over every entry, and longest prefix matches over
+//     ranges stored as CIDR prefixes
+//   - an IPv6 trie of as many synthetic ranges
+//   - the peak resident set size so far
+// Each result is printed as "metric value unit", or with -j as one
+// JSON object per line, so runs can be compared across changes.
+//
+// usage: bench [-j] [-n ranges[,ranges...]] [-q queries] [file.csv]
+//
+////////////////////////////////////////////////////////////////////
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "entry.h"
+#include "trie.h"
+#include "trie6.h"
+#include "loader.h"
+#include "cache.h"
+
+/// a trie engine to measure and the name of its metrics
+struct EngineName_s {
+    Engine engine;
+    const char *name;
+};
+#define USAGE "usage: bench [-j] [-n ranges[,ranges...]] [-q queries] " \
+    "[file.csv]\n"
+
+/// default number of synthetic ranges
+#define DEFAULT_RANGES 1000000
+
+/// default number of lookups per measurement
+#define DEFAULT_QUERIES 4000000
+
+/// most dataset sizes one run takes
+#define MAX_DATASETS 16
+
+/// key bits of the direct table measured
+#define DIRECT_BITS 20
+
+/// entries of the hot-key cache measured
+#define CACHE_SLOTS 4096
+
+/// most ranges stored as prefixes; unaligned ranges take a couple of
+/// dozen prefixes each
+#define PREFIX_RANGES 100000
+
+/// Where results go, and what they are about.
+
+struct Report_s {
+    int json;                ///< one JSON object per line, not text
+    const char *dataset;     ///< "synthetic" or the CSV file
+    size_t ranges;           ///< the size of the dataset
+};
+
+///
+/// Reads a monotonic clock.
+///
+/// @return the current time in seconds
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+///
+/// Produces pseudo-random 32 bit values (xorshift), so runs are
+/// repeatable and independent of the C library's rand().
+///
+/// @param state the generator state, must not be zero
+/// @return the next value
+
+ikey_t next_random(ikey_t *state) {
+    ikey_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+///
+/// Prints one result.
+///
+/// @param r where the result goes
+/// @param metric what was measured
+/// @param value the measurement
+/// @param unit the unit of value
+
+void report(const struct Report_s *r, const char *metric, double value,
+    const char *unit) {
+    if(!r->json) {
+        printf("%-22s %14.6g %s\n", metric, value, unit);
+        return;
+    }
+    printf("{\"dataset\": \"");
+    for(const char *p = r->dataset; *p != '\0'; p++) {
+        if(*p == '"' || *p == '\\') {
+            putchar('\\');
+        }
+        putchar(*p);
+    }
+    printf("\", \"ranges\": %zu, \"metric\": \"%s\", \"value\": %.6g, "
+        "\"unit\": \"%s\"}\n", r->ranges, metric, value, unit);
+}
+
+///
+/// Reports the most memory the process has held in RAM so far.
+///
+/// @param r where the result goes
+
+void report_rss(const struct Report_s *r) {
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) == 0) {
+        report(r, "peak_rss", (double) usage.ru_maxrss, "KiB");
+    }
+}
+
+///
+/// Makes up count disjoint ranges spread over the address space,
+/// in random order.
+///
+/// @param count the number of ranges
+/// @return the array of ranges, or NULL if memory ran out
+
+Entry synthesize(size_t count) {
+    ikey_t state = 2463534242u;
+    ikey_t step = (ikey_t) (4294967295u / count);
+    Entry entries = (Entry) malloc(sizeof(struct Entry_s) * count);
+    if(entries == NULL) {
+        return NULL;
+    }
+
+    // range i starts in the first half of its step and ends before the
+    // next step, where range i + 1 may start
+    for(size_t i = 0; i < count; i++) {
+        entries[i].key = (ikey_t) i * step +
+            next_random(&state) % (step / 2 + 1);
+        entries[i].key_to = entries[i].key +
+            next_random(&state) % ((step + 1) / 2);
+        entries[i].loc = 0;
+    }
+    for(size_t i = count - 1; i > 0; i--) {
+        size_t j = next_random(&state) % (i + 1);
+        struct Entry_s tmp = entries[i];
+        entries[i] = entries[j];
+        entries[j] = tmp;
+    }
+    return entries;
+}
+
+///
+/// Makes up count IPv6 ranges inside 2000::/3, clustered the way
+/// allocations are: a few thousand /32 blocks, each with networks
+/// of its own.
+///
+/// @param count the number of ranges
+/// @return the array of ranges, or NULL if memory ran out
+
+Entry6 synthesize6(size_t count) {
+    ikey_t state = 1013904223u;
+    Entry6 entries = (Entry6) malloc(sizeof(struct Entry6_s) * count);
+    if(entries == NULL) {
+        return NULL;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        ip6_t block = 0x2000 | (next_random(&state) & 0xFFF);
+        ip6_t network = next_random(&state);
+        entries[i].key = (block << 112) | (network << 64) |
+            ((ip6_t) next_random(&state) << 32);
+        entries[i].key_to = entries[i].key + 0xFFFFFFFFu;
+        entries[i].loc = 0;
+    }
+    return entries;
+}
+
+///
+/// Draws keys from inside the ranges, the r-th most popular range
+/// about 1/r as often as the most popular one: a Zipf law with
+/// exponent 1, sampled as the rank e^(u ln count) for a uniform u. The
+/// ranks are scattered over the table by a multiplicative hash, so the
+/// hot ranges are not neighbours.
+///
+/// @param entries the ranges
+/// @param count the number of ranges
+/// @param keys receives the keys
+/// @param n the number of keys
+/// @param state the generator state
+
+void skewed_keys(const struct Entry_s *entries, size_t count, ikey_t *keys,
+    size_t n, ikey_t *state) {
+    double scale = log((double) count);
+    for(size_t i = 0; i < n; i++) {
+        double u = (double) next_random(state) / 4294967296.0;
+        size_t rank = (size_t) exp(u * scale) - 1;
+        const struct Entry_s *e = &entries[(rank * 2654435761u) % count];
+        ikey_t width = e->key_to - e->key;
+        keys[i] = e->key + (width == 4294967295u ? next_random(state) :
+            next_random(state) % (width + 1));
+    }
+}
+
+///
+/// Orders two sizes, for qsort.
+///
+/// @param a the first size
+/// @param b the second size
+/// @return negative, zero or positive as a is less, equal or greater
+
+int compare_size(const void *a, const void *b) {
+    size_t x = *(const size_t*) a;
+    size_t y = *(const size_t*) b;
+    return (x > y) - (x < y);
+}
+
+///
+/// Orders two latencies, for qsort.
+///
+/// @param a the first latency
+/// @param b the second latency
+/// @return negative, zero or positive as a is less, equal or greater
+
+int compare_latency(const void *a, const void *b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+///
+/// Finds what reading the clock costs, to take it off single timings.
+///
+/// @return the least time between two reads, in seconds
+
+double clock_overhead(void) {
+    double least = 1.0;
+    for(int i = 0; i < 10000; i++) {
+        double start = now();
+        double took = now() - start;
+        least = (took < least) ? took : least;
+    }
+    return least;
+}
+
+///
+/// Times every lookup on its own and reports the median and the tail.
+///
+/// @param r where the results go
+/// @param name the key distribution, part of the metric names
+/// @param trie the trie to search
+/// @param keys the keys to find
+/// @param n the number of keys
+/// @return 1 on success, 0 if memory ran out
+
+int latency(const struct Report_s *r, const char *name, Trie trie,
+    const ikey_t *keys, size_t n) {
+    static const struct {
+        const char *suffix;
+        double at;
+    } points[] = { { "p50", 0.5 }, { "p99", 0.99 }, { "p999", 0.999 } };
+    double *took = (double*) malloc(sizeof(double) * n);
+    if(took == NULL) {
+        return 0;
+    }
+
+    double overhead = clock_overhead();
+    size_t hits = 0;
+    for(size_t i = 0; i < n; i++) {
+        double start = now();
+        hits += (ibt_search(trie, keys[i]) != NULL);
+        took[i] = now() - start - overhead;
+    }
+    qsort(took, n, sizeof(double), compare_latency);
+
+    char metric[64];
+    for(size_t p = 0; p < sizeof(points) / sizeof(points[0]); p++) {
+        double ns = took[(size_t) (points[p].at * (double) (n - 1))] * 1e9;
+        snprintf(metric, sizeof(metric), "search_%s_%s", name,
+            points[p].suffix);
+        report(r, metric, ns > 0.0 ? ns : 0.0, "ns");
+    }
+    snprintf(metric, sizeof(metric), "search_%s_hits", name);
+    report(r, metric, (double) hits / (double) n, "ratio");
+    free(took);
+    return 1;
+}
+
+///
+/// Searches keys through a hot-key cache, one at a time and in
+/// batches, and reports the time per lookup and the hit ratio.
+///
+/// @param r where the results go
+/// @param name the bucket of the cache, part of the metric names
+/// @param trie the trie to search
+/// @param bits the key bits a bucket of the cache spans
+/// @param keys the keys to find
+/// @param expect what ibt_search returns for each key
+/// @param out receives the entries found
+/// @param n the number of keys
+/// @return 1 if the cache found what ibt_search did, 0 if not or
+/// memory ran out
+
+int bench_cache(const struct Report_s *r, const char *name, Trie trie,
+    unsigned int bits, const ikey_t *keys, const Entry *expect, Entry *out,
+    size_t n) {
+    char metric[64];
+    Cache cache = cache_create(trie, CACHE_SLOTS, bits);
+    if(cache == NULL) {
+        return 0;
+    }
+
+    double start = now();
+    for(size_t i = 0; i < n; i++) {
+        out[i] = cache_search(cache, keys[i]);
+    }
+    snprintf(metric, sizeof(metric), "search_cached_%s", name);
+    report(r, metric, (now() - start) * 1e9 / n, "ns");
+    int ok = memcmp(expect, out, sizeof(Entry) * n) == 0;
+
+    size_t hits, misses;
+    cache_counts(cache, &hits, &misses);
+    snprintf(metric, sizeof(metric), "cache_%s_hits", name);
+    report(r, metric, (double) hits / (double) (hits + misses), "ratio");
+
+    start = now();
+    cache_search_batch(cache, keys, out, n);
+    snprintf(metric, sizeof(metric), "search_cached_%s_batch", name);
+    report(r, metric, (now() - start) * 1e9 / n, "ns");
+    ok = ok && memcmp(expect, out, sizeof(Entry) * n) == 0;
+    cache_destroy(cache);
+    return ok;
+}
+
+///
+/// Checks that two tries gave the same answers, comparing the ranges
+/// found since the entries themselves belong to different tries.
+///
+/// @param a the answers of one trie
+/// @param b the answers of the other
+/// @param n the number of answers
+/// @return 1 if they agree, 0 if not
+
+int same_answers(const Entry *a, const Entry *b, size_t n) {
+    for(size_t i = 0; i < n; i++) {
+        if((a[i] == NULL) != (b[i] == NULL) ||
+            (a[i] != NULL && a[i]->key != b[i]->key)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+///
+/// Builds a trie searched with another engine and times its lookups,
+/// one at a time and in batches.
+///
+/// @param r where the results go
+/// @param engine the engine and the prefix of its metric names
+/// @param entries the ranges
+/// @param count the number of ranges
+/// @param keys the keys to find
+/// @param expect what the default engine found for each key
+/// @param out receives the entries found
+/// @param n the number of keys
+/// @return 1 if the engine found what the default one did, 0 if not or
+/// memory ran out
+
+int bench_engine(const struct Report_s *r, const struct EngineName_s *engine,
+    const struct Entry_s *entries, size_t count, const ikey_t *keys,
+    const Entry *expect, Entry *out, size_t n) {
+    char metric[64];
+    Trie trie = ibt_create_engine(engine->engine);
+    if(trie == NULL || !ibt_build_bulk(trie, entries, count)) {
+        if(trie != NULL) {
+            ibt_destroy(trie);
+        }
+        return 0;
+    }
+
+    double start = now();
+    ibt_search(trie, 0);
+    snprintf(metric, sizeof(metric), "%s_index", engine->name);
+    report(r, metric, now() - start, "s");
+    snprintf(metric, sizeof(metric), "%s_height", engine->name);
+    report(r, metric, (double) ibt_engine_height(trie), "nodes");
+
+    start = now();
+    for(size_t i = 0; i < n; i++) {
+        out[i] = ibt_search(trie, keys[i]);
+    }
+    snprintf(metric, sizeof(metric), "%s_search", engine->name);
+    report(r, metric, (now() - start) * 1e9 / n, "ns");
+    int ok = same_answers(expect, out, n);
+
+    start = now();
+    ibt_search_batch(trie, keys, out, n);
+    snprintf(metric, sizeof(metric), "%s_search_batch", engine->name);
+    report(r, metric, (now() - start) * 1e9 / n, "ns");
+    ok = ok && same_answers(expect, out, n);
+    ibt_destroy(trie);
+    return ok;
+}
+
+///
+/// Counts the addresses covered by the entries of a scan.
+///
+/// @param e the entry visited
+/// @param arg the running total, a size_t
+/// @return zero, so the scan goes on
+
+int add_span(Entry e, void *arg) {
+    *(size_t*) arg += (size_t) (e->key_to - e->key) + 1;
+    return 0;
+}
+
+///
+/// Loads, changes, searches and tears down tries of the IPv4 ranges.
+///
+/// @param r where the results go
+/// @param entries the ranges
+/// @param count the number of ranges
+/// @param queries the number of lookups per measurement
+/// @return 1 on success, 0 if the searches disagreed or memory ran out
+
+int bench_ipv4(const struct Report_s *r, Entry entries, size_t count,
+    size_t queries) {
+    double start;
+
+    Trie trie = ibt_create();
+    start = now();
+    for(size_t i = 0; i < count; i++) {
+        ibt_insert(trie, &entries[i]);
+    }
+    double took = now() - start;
+    report(r, "insert", took, "s");
+    report(r, "insert_rate", (double) count / took, "ranges/s");
+
+    // a delta feed: a tenth of the ranges are replaced and as many
+    // removed
+    size_t changes = 0;
+    start = now();
+    for(size_t i = 0; i + 5 < count; i += 10) {
+        ibt_upsert(trie, &entries[i]);
+        ibt_delete(trie, entries[i + 5].key);
+        changes += 2;
+    }
+    if(changes > 0) {
+        report(r, "delta", (now() - start) * 1e6 / changes, "us/change");
+    }
+    struct Memory_s memory;
+    ibt_memory(trie, &memory);
+    report(r, "memory", (double) memory.total, "bytes");
+    report(r, "memory_slack", (double) (memory.node_free + memory.node_spare +
+        memory.entry_free + memory.entry_spare), "bytes");
+    start = now();
+    ibt_compact(trie);
+    report(r, "compact", now() - start, "s");
+    ibt_memory(trie, &memory);
+    report(r, "memory_compact", (double) memory.total, "bytes");
+    start = now();
+    ibt_destroy(trie);
+    report(r, "destroy", now() - start, "s");
+
+    trie = ibt_create();
+    start = now();
+    ibt_build_bulk(trie, entries, count);
+    report(r, "bulk", now() - start, "s");
+
+    Trie parallel = ibt_create();
+    int cores = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    start = now();
+    ibt_build_parallel(parallel, entries, count, cores);
+    report(r, "bulk_parallel", now() - start, "s");
+    ibt_destroy(parallel);
+
+    // the first search builds the level-compressed index
+    start = now();
+    ibt_search(trie, 0);
+    report(r, "index", now() - start, "s");
+    report(r, "index_height", (double) ibt_engine_height(trie), "nodes");
+
+    ikey_t *keys = (ikey_t*) malloc(sizeof(ikey_t) * queries);
+    Entry *scalar = (Entry*) malloc(sizeof(Entry) * queries);
+    Entry *batch = (Entry*) malloc(sizeof(Entry) * queries);
+    if(keys == NULL || scalar == NULL || batch == NULL) {
+        free(keys);
+        free(scalar);
+        free(batch);
+        ibt_destroy(trie);
+        return 0;
+    }
+    ikey_t state = 88172645u;
+    int ok = 1;
+
+    skewed_keys(entries, count, keys, queries, &state);
+    ok = ok && latency(r, "skewed", trie, keys, queries);
+    start = now();
+    for(size_t i = 0; i < queries; i++) {
+        scalar[i] = ibt_search(trie, keys[i]);
+    }
+    report(r, "search_skewed", (now() - start) * 1e9 / queries, "ns");
+    ok = ok && bench_cache(r, "address", trie, 0, keys, scalar, batch,
+        queries);
+    ok = ok && bench_cache(r, "block", trie, 8, keys, scalar, batch, queries);
+    for(size_t i = 0; i < queries; i++) {
+        keys[i] = next_random(&state);
+    }
+    ok = ok && latency(r, "uniform", trie, keys, queries);
+
+    start = now();
+    for(size_t i = 0; i < queries; i++) {
+        scalar[i] = ibt_search(trie, keys[i]);
+    }
+    report(r, "search", (now() - start) * 1e9 / queries, "ns");
+    start = now();
+    ibt_search_batch(trie, keys, batch, queries);
+    report(r, "search_batch", (now() - start) * 1e9 / queries, "ns");
+    ok = ok && memcmp(scalar, batch, sizeof(Entry) * queries) == 0;
+
+    static const struct EngineName_s engines[] = {
+        { IBT_BINARY, "binary" }, { IBT_SORTED, "sorted" }
+    };
+    for(size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        ok = ok && bench_engine(r, &engines[i], entries, count, keys, scalar,
+            batch, queries);
+    }
+
+    size_t covered = 0;
+    start = now();
+    size_t scanned = ibt_range_scan(trie, 0, 4294967295u, add_span,
+        &covered);
+    report(r, "scan", (now() - start) * 1e9 / (scanned ? scanned : 1),
+        "ns/entry");
+
+    ibt_set_direct_bits(trie, DIRECT_BITS);
+    start = now();
+    ibt_search(trie, 0);
+    report(r, "direct_table", now() - start, "s");
+    start = now();
+    for(size_t i = 0; i < queries; i++) {
+        batch[i] = ibt_search(trie, keys[i]);
+    }
+    report(r, "search_direct", (now() - start) * 1e9 / queries, "ns");
+    ok = ok && memcmp(scalar, batch, sizeof(Entry) * queries) == 0;
+    start = now();
+    ibt_search_batch(trie, keys, batch, queries);
+    report(r, "search_direct_batch", (now() - start) * 1e9 / queries, "ns");
+    ok = ok && memcmp(scalar, batch, sizeof(Entry) * queries) == 0;
+    report_rss(r);
+    ibt_destroy(trie);
+
+    Trie prefixes = ibt_create();
+    size_t every = (count + PREFIX_RANGES - 1) / PREFIX_RANGES;
+    start = now();
+    for(size_t i = 0; i < count; i += every) {
+        ibt_insert_range_prefixes(prefixes, &entries[i]);
+    }
+    size_t stored = ibt_prefix_count(prefixes);
+    report(r, "prefix_insert", (now() - start) * 1e9 / (stored ? stored : 1),
+        "ns/prefix");
+    start = now();
+    for(size_t i = 0; i < queries; i++) {
+        batch[i] = ibt_lpm(prefixes, keys[i]);
+    }
+    report(r, "lpm", (now() - start) * 1e9 / queries, "ns");
+    ibt_destroy(prefixes);
+
+    free(keys);
+    free(scalar);
+    free(batch);
+    return ok;
+}
+
+///
+/// Loads, searches and tears down an IPv6 trie of count synthetic
+/// ranges.
+///
+/// @param r where the results go
+/// @param count the number of ranges
+/// @param queries the number of lookups
+/// @return 1 on success, 0 if memory ran out
+
+int bench_ipv6(const struct Report_s *r, size_t count, size_t queries) {
+    Entry6 entries = synthesize6(count);
+    ip6_t *keys = (ip6_t*) malloc(sizeof(ip6_t) * queries);
+    Trie6 trie = ibt6_create();
+    if(entries == NULL || keys == NULL || trie == NULL) {
+        free(entries);
+        free(keys);
+        if(trie != NULL) {
+            ibt6_destroy(trie);
+        }
+        return 0;
+    }
+
+    double start = now();
+    for(size_t i = 0; i < count; i++) {
+        ibt6_insert(trie, &entries[i]);
+    }
+    report(r, "ipv6_insert_rate", (double) count / (now() - start),
+        "ranges/s");
+    report(r, "ipv6_height", (double) ibt6_height(trie), "nodes");
+
+    // half the lookups land inside a range, half anywhere
+    ikey_t state = 362436069u;
+    for(size_t i = 0; i < queries; i++) {
+        keys[i] = (i % 2) ? entries[next_random(&state) % count].key +
+            next_random(&state) : ((ip6_t) next_random(&state) << 96) |
+            ((ip6_t) next_random(&state) << 64);
+    }
+    size_t hits = 0;
+    start = now();
+    for(size_t i = 0; i < queries; i++) {
+        hits += (ibt6_search(trie, keys[i]) != NULL);
+    }
+    report(r, "ipv6_search", (now() - start) * 1e9 / queries, "ns");
+    report(r, "ipv6_search_hits", (double) hits / (double) queries, "ratio");
+    report_rss(r);
+
+    start = now();
+    ibt6_destroy(trie);
+    report(r, "ipv6_destroy", now() - start, "s");
+    free(keys);
+    free(entries);
+    return 1;
+}
+
+///
+/// main() runs the suite on each dataset in turn, smallest first, so
+/// the peak RSS reported with a dataset is its own.
+///
+/// @param argc: the number of command line arguements
+/// @param argv: the command line arguements, see USAGE
+///
+/// @return zero if successful, 1 if not
+///
+int main(int argc, char* argv[]) {
+    struct Report_s r = { 0, "synthetic", 0 };
+    size_t sizes[MAX_DATASETS] = { DEFAULT_RANGES };
+    size_t num_sizes = 1;
+    size_t queries = DEFAULT_QUERIES;
+    char *end;
+    int opt;
+
+    while((opt = getopt(argc, argv, "jn:q:")) != -1) {
+        switch(opt) {
+        case 'j':
+            r.json = 1;
+            break;
+        case 'n':
+            num_sizes = 0;
+            end = optarg;
+            do {
+                if(num_sizes == MAX_DATASETS) {
+                    fprintf(stderr, USAGE);
+                    return 1;
+                }
+                sizes[num_sizes++] = (size_t) strtoul(end + (end != optarg),
+                    &end, 10);
+            } while(*end == ',');
+            if(*end != '\0') {
+                fprintf(stderr, USAGE);
+                return 1;
+            }
+            break;
+        case 'q':
+            queries = (size_t) strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            return 1;
+        }
+    }
+    if(queries == 0 || optind < argc - 1) {
+        fprintf(stderr, USAGE);
+        return 1;
+    }
+    if(optind < argc) {
+        r.dataset = argv[optind];
+        num_sizes = 1;
+    }
+    qsort(sizes, num_sizes, sizeof(size_t), compare_size);
+
+    int ok = 1;
+    for(size_t d = 0; d < num_sizes && ok; d++) {
+        size_t count = sizes[d];
+        Entry entries;
+
+        double start = now();
+        if(optind < argc) {
+            entries = load_csv(argv[optind], &count);
+            if(entries == NULL) {
+                fprintf(stderr, "%s: No such file or directory \n",
+                    argv[optind]);
+                return 1;
+            }
+        }
+        else {
+            entries = (count > 0) ? synthesize(count) : NULL;
+        }
+        if(entries == NULL || count == 0) {
+            fprintf(stderr, "bench: no ranges to measure\n");
+            free(entries);
+            return 1;
+        }
+        r.ranges = count;
+        report(&r, "parse", now() - start, "s");
+
+        ok = bench_ipv4(&r, entries, count, queries);
+        free(entries);
+        ok = ok && bench_ipv6(&r, count, queries);
+    }
+    entry_locations_release();
+    if(!ok) {
+        fprintf(stderr, "bench: searches disagree or memory ran out\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,223 @@
+//
+// File: cache.c
+// Set-associative cache of search results in front of a trie. Each set
+// fills one cache line: the tags of its ways, which of them are in use,
+// and the entries they resolve to, so a hit costs a single line. A set
+// is filled most recently first; the oldest way makes room on a miss.
+// // // // // // // // // // // // // // // // // // // // // // // //
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+
+/// entries a set holds
+#define WAYS 4
+
+/// bytes in a cache line; each set is aligned to one
+#define CACHE_LINE 64
+
+/// keys cache_search_batch probes before it searches their misses
+#define BATCH 256
+
+/////////////////////// struct definitions ////////////////////////////////
+
+/// One set: the buckets of its ways and what the trie holds for them.
+
+struct Set_s {
+    ikey_t tags[WAYS];       ///< bucket of each way, key >> bits
+    unsigned int used;       ///< bit w is set when way w holds a bucket
+    Entry found[WAYS];       ///< the entry of each way, or NULL
+};
+
+struct Cache_s {
+    Trie trie;
+    struct Set_s *sets;
+    size_t mask;             ///< number of sets less one, a power of two
+    unsigned int bits;       ///< low key bits a bucket spans
+    unsigned long generation;    ///< of the trie when the sets were filled
+    size_t hits;
+    size_t misses;
+};
+
+/////////////////////// private functions ////////////////////////////////
+
+/// Empties the cache if the trie changed since it was filled.
+///
+/// @param cache the cache
+/// @return the trie's generation, read before any search that follows
+
+static unsigned long check_generation( Cache cache) {
+    unsigned long generation = ibt_generation(cache->trie);
+    if(generation != cache->generation) {
+        for(size_t i = 0; i <= cache->mask; i++) {
+            cache->sets[i].used = 0;
+        }
+        cache->generation = generation;
+    }
+    return generation;
+}
+
+/// Tells whether what the trie answered since check_generation returned
+/// generation may be cached: no change was in progress then, and none
+/// has begun since, so the answers came from the version of that
+/// generation.
+///
+/// @param cache the cache
+/// @param generation what check_generation returned
+/// @return 1 if the answers may be cached
+
+static int settled( Cache cache, unsigned long generation) {
+    return (generation & 1) == 0 &&
+        ibt_generation(cache->trie) == generation;
+}
+
+/// Finds the set a bucket belongs in, scattering neighbouring buckets
+/// with a multiplicative hash.
+///
+/// @param cache the cache
+/// @param tag the bucket
+/// @return the set
+
+static struct Set_s *set_of( Cache cache, ikey_t tag) {
+    ikey_t h = tag * 2654435761u;
+    return &cache->sets[(h ^ (h >> 16)) & cache->mask];
+}
+
+/// Looks for a bucket among the ways of its set.
+///
+/// @param set the set
+/// @param tag the bucket
+/// @return the way holding it, or -1
+
+static int probe( const struct Set_s *set, ikey_t tag) {
+    for(int w = 0; w < WAYS; w++) {
+        if((set->used >> w & 1) && set->tags[w] == tag) {
+            return w;
+        }
+    }
+    return -1;
+}
+
+/// Caches what the trie holds for the bucket of key, if that is the
+/// same for every key of the bucket.
+///
+/// @param cache the cache
+/// @param key a key of the bucket
+/// @param e what ibt_search returned for key
+
+static void fill( Cache cache, ikey_t key, Entry e) {
+    ikey_t tag = key >> cache->bits;
+    if(cache->bits != 0) {
+        ikey_t lo = tag << cache->bits;
+        ikey_t hi = lo | (((ikey_t) 1 << cache->bits) - 1);
+        if(e == NULL || e->key > lo || e->key_to < hi) {
+            return;
+        }
+    }
+    struct Set_s *set = set_of(cache, tag);
+    if(probe(set, tag) >= 0) {
+        return;
+    }
+    for(int w = WAYS - 1; w > 0; w--) {
+        set->tags[w] = set->tags[w - 1];
+        set->found[w] = set->found[w - 1];
+    }
+    set->tags[0] = tag;
+    set->found[0] = e;
+    set->used = ((set->used << 1) | 1) & ((1u << WAYS) - 1);
+}
+
+/////////////////////// Functions of caches //////////////////////////////
+
+Cache cache_create( Trie trie, size_t slots, unsigned int bits) {
+    if(bits > CACHE_MAX_BITS) {
+        return NULL;
+    }
+    size_t num_sets = 1;
+    while(num_sets * WAYS < slots) {
+        num_sets *= 2;
+    }
+    Cache cache = (Cache) malloc(sizeof(struct Cache_s));
+    void *sets = NULL;
+    if(cache == NULL || posix_memalign(&sets, CACHE_LINE,
+        sizeof(struct Set_s) * num_sets) != 0) {
+        free(cache);
+        return NULL;
+    }
+    memset(sets, 0, sizeof(struct Set_s) * num_sets);
+    cache->trie = trie;
+    cache->sets = (struct Set_s*) sets;
+    cache->mask = num_sets - 1;
+    cache->bits = bits;
+    cache->generation = ibt_generation(trie);
+    cache->hits = 0;
+    cache->misses = 0;
+    return cache;
+}
+
+void cache_destroy( Cache cache) {
+    if(cache == NULL) {
+        return;
+    }
+    free(cache->sets);
+    free(cache);
+}
+
+Entry cache_search( Cache cache, ikey_t key) {
+    unsigned long generation = check_generation(cache);
+    ikey_t tag = key >> cache->bits;
+    struct Set_s *set = set_of(cache, tag);
+    int w = probe(set, tag);
+    if(w >= 0) {
+        cache->hits++;
+        return set->found[w];
+    }
+    cache->misses++;
+    Entry e = ibt_search(cache->trie, key);
+    if(settled(cache, generation)) {
+        fill(cache, key, e);
+    }
+    return e;
+}
+
+void cache_search_batch( Cache cache, const ikey_t *keys, Entry *out,
+    size_t n) {
+    ikey_t missed[BATCH];
+    Entry found[BATCH];
+    size_t at[BATCH];
+
+    unsigned long generation = check_generation(cache);
+    for(size_t first = 0; first < n; first += BATCH) {
+        size_t count = (n - first < BATCH) ? n - first : BATCH;
+        size_t m = 0;
+        for(size_t i = first; i < first + count; i++) {
+            ikey_t tag = keys[i] >> cache->bits;
+            struct Set_s *set = set_of(cache, tag);
+            int w = probe(set, tag);
+            if(w >= 0) {
+                out[i] = set->found[w];
+            }
+            else {
+                missed[m] = keys[i];
+                at[m++] = i;
+            }
+        }
+        cache->hits += count - m;
+        cache->misses += m;
+
+        ibt_search_batch(cache->trie, missed, found, m);
+        int keep = settled(cache, generation);
+        for(size_t j = 0; j < m; j++) {
+            out[at[j]] = found[j];
+            if(keep) {
+                fill(cache, missed[j], found[j]);
+            }
+        }
+    }
+}
+
+void cache_counts( Cache cache, size_t *hits, size_t *misses) {
+    *hits = cache->hits;
+    *misses = cache->misses;
+}
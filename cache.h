@@ -0,0 +1,73 @@
+//
+// File: cache.h
+// A small set-associative cache of search results in front of a trie,
+// for query streams where a few hot addresses make up most lookups.
+// // // // // // // // // // // // // // // // // // // // // // // //
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include "trie.h"
+
+
+/// Cache is a pointer to a cache of one thread's lookups in one trie.
+/// A cache is not shared: each thread searching through one makes its
+/// own, so lookups take no locks and the counters need no atomics.
+
+typedef struct Cache_s * Cache;
+
+/// most key bits a cache bucket can span, see cache_create
+
+#define CACHE_MAX_BITS 24
+
+/// Create a cache in front of a trie. Keys are cached by bucket: the
+/// key with its low bits cleared, so that one slot answers for every
+/// address of a /24 with bits 8. A bucket is cached only when a single
+/// range covers all of it; with bits 0 each address is its own bucket
+/// and addresses in no range are cached too.
+/// @param trie the trie to search on a miss
+/// @param slots the number of entries kept, rounded up to a whole
+/// number of sets
+/// @param bits the low key bits a bucket spans, 0 to CACHE_MAX_BITS
+/// @return the cache, or NULL if bits is too large or memory ran out
+
+Cache cache_create( Trie trie, size_t slots, unsigned int bits);
+
+/// Free a cache. The trie is left alone.
+/// @param cache the cache, may be NULL
+
+void cache_destroy( Cache cache);
+
+/// search for the entry whose range contains key, as ibt_search does,
+/// looking in the cache first. Any change to the trie empties the
+/// cache before its next lookup, and a miss that overlaps a change is
+/// answered but not cached; in a shared trie it is to be called within
+/// a read section, like ibt_search.
+/// @param cache the cache
+/// @param key the key to find
+/// @return what ibt_search(trie, key) returns
+
+Entry cache_search( Cache cache, ikey_t key);
+
+/// search for many keys at once; out[i] receives what
+/// cache_search(cache, keys[i]) would return. The keys the cache
+/// misses are searched together with ibt_search_batch.
+/// @param cache the cache
+/// @param keys the keys to find
+/// @param out receives one entry (or NULL) per key
+/// @param n the number of keys
+
+void cache_search_batch( Cache cache, const ikey_t *keys, Entry *out,
+    size_t n);
+
+/// get how many lookups the cache answered and how many it passed on
+/// to the trie since it was created.
+/// @param cache the cache
+/// @param hits receives the number answered from the cache
+/// @param misses receives the number searched in the trie
+
+void cache_counts( Cache cache, size_t *hits, size_t *misses);
+
+
+#endif // CACHE_H
@@ -6,6 +6,10 @@
 // description: made to be the IPV4 'entry' into the trie
 // and operations that can be done on it.
 //
+// The location strings of an entry are interned: every distinct
+// (cc, name, province, city) tuple is stored once in a dictionary
+// shared by all entries, and an entry only holds its id.
+//
 //////////////////////////////////////////////////////////
 
 #include <string.h>
@@ -13,64 +17,550 @@
 #include <stdlib.h>
 #include "entry.h"
 
+/// number of strings making up a location
+#define LOC_FIELDS 4
 
-/// Creates an entry out of character input, the expected input
-/// will create two entries, thus the 'tf' int
+/////////////////////// Location dictionary ///////////////////////////////
+
+/// Every location is stored in blob as its four NUL-terminated
+/// strings back to back: "cc\0name\0province\0city\0". records maps a
+/// location id to the offset of its strings; id 0 is never handed out.
+/// slots is an open-addressed hash table of ids used while interning.
+/// blob and records may instead point into a mapped snapshot, in which
+/// case they are copied to the heap before the first new location.
 ///
-/// @param e the entry (which has already been dynamically alloced)
-/// @param input a string which contains an ip address, 
-/// @param tf if 1, stores the ip_to address, if 0, stores the ip_from
-/// address
+/// Once shared, the dictionary may be read by other threads while one
+/// thread interns: blob, records and count are published with atomic
+/// stores, and arrays that grow are copied rather than reallocated,
+/// with the old ones kept until entry_locations_release.
+
+static struct {
+    char *blob;
+    size_t blob_size;
+    size_t blob_capacity;
+    size_t *records;
+    loc_t count;
+    loc_t capacity;
+    loc_t *slots;
+    size_t num_slots;        ///< always a power of two
+    int mapped;              ///< blob and records are borrowed
+    int shared;              ///< readers on other threads, see above
+    void **old;              ///< arrays replaced while shared
+    size_t num_old;
+    size_t old_capacity;
+} dict;
+
+/// FNV-1a hash of the fields of a location, NULs included.
 ///
+/// @param field the start of each field
+/// @param len the length of each field
+
+static size_t hash_fields(const char *field[], const size_t len[]) {
+    size_t h = 2166136261u;
+    for(int f = 0; f < LOC_FIELDS; f++) {
+        for(size_t i = 0; i < len[f]; i++) {
+            h = (h ^ (unsigned char) field[f][i]) * 16777619u;
+        }
+        h = h * 16777619u;
+    }
+    return h;
+}
 
-void entry_init(Entry e, char* input, int tf) {
-    const char delim[2] = ",";
-    char *token;
-    char *ptr;
-    char *buffer = (char*) malloc(sizeof(char) * 256);
-    strcpy(buffer, input);
+/// Checks whether the location stored as id has exactly these fields.
+
+static int same_location(loc_t id, const char *field[], const size_t len[]) {
+    const char *s = dict.blob + dict.records[id];
+    for(int f = 0; f < LOC_FIELDS; f++) {
+        if(strncmp(s, field[f], len[f]) != 0 || s[len[f]] != '\0') {
+            return 0;
+        }
+        s += len[f] + 1;
+    }
+    return 1;
+}
+
+/// Doubles the hash table and re-inserts every location.
+///
+/// @return 1 on success, 0 if memory ran out
+
+static int grow_slots(void) {
+    size_t num = dict.num_slots ? dict.num_slots * 2 : 1024;
+    loc_t *slots = (loc_t*) calloc(num, sizeof(loc_t));
+    if(slots == NULL) {
+        return 0;
+    }
+    for(loc_t id = 1; id < dict.count; id++) {
+        const char *field[LOC_FIELDS];
+        size_t len[LOC_FIELDS];
+        const char *s = dict.blob + dict.records[id];
+        for(int f = 0; f < LOC_FIELDS; f++) {
+            field[f] = s;
+            len[f] = strlen(s);
+            s += len[f] + 1;
+        }
+        size_t i = hash_fields(field, len) & (num - 1);
+        while(slots[i] != 0) {
+            i = (i + 1) & (num - 1);
+        }
+        slots[i] = id;
+    }
+    free(dict.slots);
+    dict.slots = slots;
+    dict.num_slots = num;
+    return 1;
+}
+
+/// Grows one of the arrays of the dictionary like realloc. While the
+/// dictionary is shared the array is copied instead, and the old one
+/// is kept for readers that may still be looking at it.
+///
+/// @param p the array
+/// @param used the bytes of p in use
+/// @param size the bytes wanted
+/// @return the grown array, or NULL if memory ran out
+
+static void *grow_array(void *p, size_t used, size_t size) {
+    if(!dict.shared) {
+        return realloc(p, size);
+    }
+    if(dict.num_old == dict.old_capacity) {
+        size_t cap = dict.old_capacity ? dict.old_capacity * 2 : 16;
+        void **old = (void**) realloc(dict.old, sizeof(void*) * cap);
+        if(old == NULL) {
+            return NULL;
+        }
+        dict.old = old;
+        dict.old_capacity = cap;
+    }
+    void *tmp = malloc(size);
+    if(tmp != NULL && p != NULL) {
+        memcpy(tmp, p, used);
+        dict.old[dict.num_old++] = p;
+    }
+    return tmp;
+}
+
+/// Copies borrowed blob and records to the heap so they can grow.
+///
+/// @return 1 on success, 0 if memory ran out
+
+static int own_dictionary(void) {
+    char *blob = (char*) malloc(dict.blob_size + 1);
+    size_t *records = (size_t*) malloc(sizeof(size_t) * (dict.count + 1));
+    if(blob == NULL || records == NULL) {
+        free(blob);
+        free(records);
+        return 0;
+    }
+    memcpy(blob, dict.blob, dict.blob_size);
+    memcpy(records, dict.records, sizeof(size_t) * dict.count);
+    __atomic_store_n(&dict.blob, blob, __ATOMIC_RELEASE);
+    dict.blob_capacity = dict.blob_size + 1;
+    __atomic_store_n(&dict.records, records, __ATOMIC_RELEASE);
+    dict.capacity = dict.count + 1;
+    dict.mapped = 0;
+    return 1;
+}
+
+/// Looks a location up in the dictionary, adding it if it is new.
+///
+/// @param field the start of each of the four fields
+/// @param len the length of each of the four fields
+/// @return the id of the location, or 0 if memory ran out
+
+static loc_t intern(const char *field[], const size_t len[]) {
+    if(dict.count == 0) {
+        __atomic_store_n(&dict.count, 1, __ATOMIC_RELEASE);  // id 0 is reserved
+    }
+    if(dict.mapped && !own_dictionary()) {
+        return 0;
+    }
+    if((size_t) dict.count * 2 >= dict.num_slots && !grow_slots()) {
+        return 0;
+    }
+    size_t i = hash_fields(field, len) & (dict.num_slots - 1);
+    while(dict.slots[i] != 0) {
+        if(same_location(dict.slots[i], field, len)) {
+            return dict.slots[i];
+        }
+        i = (i + 1) & (dict.num_slots - 1);
+    }
+
+    size_t need = len[0] + len[1] + len[2] + len[3] + LOC_FIELDS;
+    if(dict.blob_size + need > dict.blob_capacity) {
+        size_t cap = dict.blob_capacity ? dict.blob_capacity * 2 : 4096;
+        while(cap < dict.blob_size + need) {
+            cap *= 2;
+        }
+        char *blob = (char*) grow_array(dict.blob, dict.blob_size, cap);
+        if(blob == NULL) {
+            return 0;
+        }
+        __atomic_store_n(&dict.blob, blob, __ATOMIC_RELEASE);
+        dict.blob_capacity = cap;
+    }
+    if(dict.count >= dict.capacity) {
+        loc_t cap = dict.capacity ? dict.capacity * 2 : 256;
+        size_t *records = (size_t*) grow_array(dict.records,
+            sizeof(size_t) * dict.count, sizeof(size_t) * cap);
+        if(records == NULL) {
+            return 0;
+        }
+        __atomic_store_n(&dict.records, records, __ATOMIC_RELEASE);
+        dict.capacity = cap;
+    }
+
+    loc_t id = dict.count;
+    dict.records[id] = dict.blob_size;
+    for(int f = 0; f < LOC_FIELDS; f++) {
+        memcpy(dict.blob + dict.blob_size, field[f], len[f]);
+        dict.blob_size += len[f];
+        dict.blob[dict.blob_size++] = '\0';
+    }
+    dict.slots[i] = id;
+    // readers only look at ids below count, so the new one is complete
+    __atomic_store_n(&dict.count, id + 1, __ATOMIC_RELEASE);
+    return id;
+}
+
+/// Returns the strings of an entry's location, stored back to back
+/// as "cc\0name\0province\0city\0".
+///
+/// @param e the entry whose location is wanted
+/// @return the first of the four strings, or "" four times over for
+/// an entry without a location
+
+const char *entry_location(Entry e) {
+    return entry_location_of(e->loc);
+}
+
+/// Returns the strings of an interned location, as entry_location does
+/// for an entry.
+///
+/// @param loc the id of the location, 0 for none
+/// @return the first of the four strings
+
+const char *entry_location_of(loc_t loc) {
+    if(loc == 0 || loc >= __atomic_load_n(&dict.count, __ATOMIC_ACQUIRE)) {
+        return "\0\0\0";
+    }
+    const size_t *records = __atomic_load_n(&dict.records, __ATOMIC_ACQUIRE);
+    const char *blob = __atomic_load_n(&dict.blob, __ATOMIC_ACQUIRE);
+    return blob + records[loc];
+}
+
+/// @return the number of distinct locations interned so far
+
+size_t entry_locations_count(void) {
+    return dict.count ? dict.count - 1 : 0;
+}
+
+/// Frees the location dictionary. Every entry created so far is left
+/// without a location.
+
+void entry_locations_release(void) {
+    if(!dict.mapped) {
+        free(dict.blob);
+        free(dict.records);
+    }
+    for(size_t i = 0; i < dict.num_old; i++) {
+        free(dict.old[i]);
+    }
+    free(dict.old);
+    free(dict.slots);
+    memset(&dict, 0, sizeof(dict));
+}
+
+/// Lets other threads read locations while this one interns new ones,
+/// until the dictionary is released.
+
+void entry_locations_share(void) {
+    dict.shared = 1;
+}
 
+/// Describes the dictionary as two flat arrays, so it can be written
+/// to a snapshot.
+///
+/// @param blob set to the strings of every location
+/// @param blob_size set to the size of blob in bytes
+/// @param records set to the offset in blob of each id's strings
+/// @return the number of ids in records, the reserved id 0 included
+
+size_t entry_locations_image(const char **blob, size_t *blob_size,
+    const size_t **records) {
+    *blob = dict.blob;
+    *blob_size = dict.blob_size;
+    *records = dict.records;
+    return dict.count;
+}
 
-    token = strtok(buffer, delim);
+/// Makes a dictionary image, such as one in a mapped snapshot, the
+/// dictionary of the process, without copying it. The dictionary must
+/// be empty.
+///
+/// @param blob the strings of every location
+/// @param blob_size the size of blob in bytes
+/// @param records the offset in blob of each id's strings
+/// @param count the number of ids in records
+/// @return 1 on success, 0 if the dictionary already holds locations
+
+int entry_locations_map(const char *blob, size_t blob_size,
+    const size_t *records, size_t count) {
+    if(entry_locations_count() != 0) {
+        return 0;
+    }
+    entry_locations_release();
+    dict.blob = (char*) blob;
+    dict.blob_size = blob_size;
+    dict.records = (size_t*) records;
+    dict.count = (loc_t) count;
+    dict.mapped = 1;
+    return 1;
+}
 
-    if(tf) // tf == 1
-    e->key = (unsigned int) strtol(token + 1, &ptr, 10);
+/// Copies the dictionary to the heap if it is borrowed from the memory
+/// [start, start + size), which is about to go away.
+///
+/// @param start the start of the memory
+/// @param size the size of the memory
+/// @return 1 if the memory may go, 0 if memory ran out copying the
+/// dictionary, which still points into it and is otherwise unchanged
+
+int entry_locations_unmap(const void *start, size_t size) {
+    const char *lo = (const char*) start;
+    if(dict.mapped && dict.blob >= lo && dict.blob < lo + size) {
+        return own_dictionary();
+    }
+    return 1;
+}
 
-    token = strtok(NULL, delim);
+/// Reports the memory the dictionary takes: its strings, the offsets of
+/// its ids and its hash table. Arrays kept for readers of a shared
+/// dictionary are not counted.
+///
+/// @param used set to the bytes in use
+/// @param spare set to the bytes allocated for growth and not yet used
+
+void entry_locations_memory(size_t *used, size_t *spare) {
+    *used = dict.blob_size + sizeof(size_t) * dict.count +
+        sizeof(loc_t) * dict.num_slots;
+    *spare = 0;
+    if(!dict.mapped) {
+        *spare = (dict.blob_capacity - dict.blob_size) +
+            sizeof(size_t) * (dict.capacity - dict.count);
+    }
+}
 
-    if(!tf)  // tf == 0  
-    e->key = (unsigned int) strtol(token + 1, &ptr, 10);
+/// Interns a location given as its four strings back to back, as
+/// entry_location returns them.
+///
+/// @param strings the location's strings
+/// @return the id of the location, or 0 if memory ran out
+
+loc_t entry_locations_intern(const char *strings) {
+    const char *field[LOC_FIELDS];
+    size_t len[LOC_FIELDS];
+    for(int f = 0; f < LOC_FIELDS; f++) {
+        field[f] = strings;
+        len[f] = strlen(strings);
+        strings += len[f] + 1;
+    }
+    return intern(field, len);
+}
 
-    token = strtok(NULL, delim);
+/////////////////////////// Entries /////////////////////////////////////
 
-    e->cc = (char *) malloc(sizeof(char) * 3);
-    strncpy(e->cc, token + 1, strlen(token) - 2);
+/// Reads the next comma separated field of a CSV line, without the
+/// quotes around it. The line is not copied and need not be NUL
+/// terminated; the scan stops at a line break or at end. Inside quotes
+/// a doubled quote stands for one quote character.
+///
+/// @param p where the field starts
+/// @param end where the input ends
+/// @param start set to the first character of the field's value
+/// @param len set to the length of the field's value, escapes included
+/// @param escaped set to 1 if the value holds doubled quotes
+/// @return where the next field starts, or the line break ending the line
+
+static const char *next_field(const char *p, const char *end,
+    const char **start, size_t *len, int *escaped) {
+    *escaped = 0;
+    if(p < end && *p == '"') {
+        *start = ++p;
+        while(p < end && (*p != '"' || (p + 1 < end && p[1] == '"'))) {
+            if(*p == '"') {
+                *escaped = 1;
+                p++;
+            }
+            p++;
+        }
+        *len = (size_t) (p - *start);
+        if(p < end) {
+            p++;     // closing quote
+        }
+    }
+    else {
+        *start = p;
+        while(p < end && *p != ',' && *p != '\n' && *p != '\r') {
+            p++;
+        }
+        *len = (size_t) (p - *start);
+    }
+    while(p < end && *p != ',' && *p != '\n' && *p != '\r') {
+        p++;     // stray characters after a closing quote
+    }
+    if(p < end && *p == ',') {
+        p++;
+    }
+    return p;
+}
 
-    token = strtok(NULL, delim);
+/// Reads an unsigned decimal number.
 
-    e->name = (char *) malloc(sizeof(char) * (strlen(token) - 2));
-    strncpy(e->name, token + 1, strlen(token) - 2);
+static ikey_t parse_key(const char *s, size_t len) {
+    ikey_t key = 0;
+    for(size_t i = 0; i < len && s[i] >= '0' && s[i] <= '9'; i++) {
+        key = key * 10 + (ikey_t) (s[i] - '0');
+    }
+    return key;
+}
 
-    token = strtok(NULL, delim);
+/// Reads the location fields that follow the two addresses of a line.
+/// Fields are interned straight from the input; only a field holding
+/// doubled quotes is first copied to undo them.
+///
+/// @param e the entry receiving the location
+/// @param p where the third field of the line starts
+/// @param end where the input ends
+/// @return where the parse stopped
+
+static const char *init_location(Entry e, const char *p, const char *end) {
+    const char *field[LOC_FIELDS];
+    size_t field_len[LOC_FIELDS];
+    int escaped[LOC_FIELDS];
+    int any = 0;
+
+    for(int f = 0; f < LOC_FIELDS; f++) {
+        p = next_field(p, end, &field[f], &field_len[f], &escaped[f]);
+        any |= escaped[f];
+    }
+    if(!any) {
+        e->loc = intern(field, field_len);
+        return p;
+    }
+    char *copy = (char*) malloc(field_len[0] + field_len[1] +
+        field_len[2] + field_len[3] + 1);
+    char *out = copy;
+    for(int f = 0; copy != NULL && f < LOC_FIELDS; f++) {
+        const char *in = field[f];
+        const char *stop = in + field_len[f];
+        field[f] = out;
+        for(; in < stop; in++) {
+            *out++ = *in;
+            in += (*in == '"');
+        }
+        field_len[f] = (size_t) (out - field[f]);
+    }
+    e->loc = (copy != NULL) ? intern(field, field_len) : 0;
+    free(copy);
+    return p;
+}
 
-    e->province = (char *) malloc(sizeof(char) * (strlen(token) - 2));
-    strncpy(e->province, token + 1, strlen(token) - 2);
+/// Parses one line of CSV input in place into an entry covering the
+/// range [ip_from, ip_to]. Lines may be of any length and need not be
+/// NUL terminated.
+///
+/// @param e the entry receiving the range
+/// @param line where the line starts
+/// @param end where the input ends
+/// @return where the next line starts, or end
+
+const char *entry_parse_range(Entry e, const char *line, const char *end) {
+    const char *location;
+    const char *next = entry_parse_keys(e, line, end, &location);
+    init_location(e, location, end);
+    return next;
+}
 
-    token = strtok(NULL, delim);
+/// Parses the range of one line of CSV input in place, as
+/// entry_parse_range does, but leaves the location to the caller:
+/// threads may parse lines side by side this way, since nothing is
+/// interned.
+///
+/// @param e the entry receiving the range; its location is set to 0
+/// @param line where the line starts
+/// @param end where the input ends
+/// @param location set to where the location fields of the line start
+/// @return where the next line starts, or end
+
+const char *entry_parse_keys(Entry e, const char *line, const char *end,
+    const char **location) {
+    const char *start;
+    size_t len;
+    int escaped;
+    const char *p = line;
+
+    p = next_field(p, end, &start, &len, &escaped);
+    e->key = parse_key(start, len);
+    p = next_field(p, end, &start, &len, &escaped);
+    e->key_to = parse_key(start, len);
+    e->loc = 0;
+
+    *location = p;
+    while(p < end && *p != '\n') {
+        p++;
+    }
+    return (p < end) ? p + 1 : end;
+}
 
-    
+/// Interns the location fields of a line of CSV input, such as those
+/// entry_parse_keys found.
+///
+/// @param location where the location fields start
+/// @param end where the input ends; the line break ends the fields
+/// @return the id of the location, or 0 if memory ran out
+
+loc_t entry_parse_location(const char *location, const char *end) {
+    struct Entry_s e;
+    init_location(&e, location, end);
+    return e.loc;
+}
 
-    e->city = (char *) malloc(sizeof(char) * (strlen(token) - 2));
-    strncpy(e->city, token + 1, strlen(token) - 3);
+/// Creates an entry out of character input, the expected input
+/// will create two entries, thus the 'tf' int. Each entry is a
+/// single address: its key_to is its key.
+///
+/// @param e the entry (which has already been dynamically alloced)
+/// @param input a string which contains an ip address,
+/// @param tf if 1, stores the ip_from address, if 0, stores the ip_to
+/// address
+///
+
+void entry_init(Entry e, char* input, int tf) {
+    entry_parse_range(e, input, input + strlen(input));
+    if(tf) {
+        e->key_to = e->key;
+    }
+    else {
+        e->key = e->key_to;
+    }
+}
+
+/// Creates an entry covering the whole range [ip_from, ip_to] of a
+/// line of character input.
+///
+/// @param e the entry (which has already been dynamically alloced)
+/// @param input a string which contains an ip address range
 
-    free(buffer);
+void entry_init_range(Entry e, char* input) {
+    entry_parse_range(e, input, input + strlen(input));
 }
 
-/// Creates an entry by calling the above function, and 
+/// Creates an entry by calling the above function, and
 /// dynamically allocating it.
 /// @param e the entry (which has already been dynamically alloced)
-/// @param input a string which contains an ip address, 
-/// @param tf if 1, stores the ip_to address, if 0, stores the ip_from
+/// @param input a string which contains an ip address,
+/// @param tf if 1, stores the ip_from address, if 0, stores the ip_to
 /// address
 ///
 /// @return the created entry
@@ -86,63 +576,72 @@ Entry entry_create(char* input, int tf) {
 }
 
 
-/// Frees all dynamically allocated parts of the entry
-/// then frees the pointer to the entry itself 
-/// 
+/// Frees the entry. Its location stays in the dictionary, where
+/// other entries may share it.
+///
 /// @param e the entry to be destroyed
 
 void entry_destroy(Entry e) {
-    if(e != NULL) {
-        free(e->cc);
-        free(e->name);
-        free(e->province);
-        free(e->city);
-        free(e);
-    }
+    free(e);
 }
 
 
 ///
-/// Prints off the entry in the format specified int the 
+/// Prints off the entry in the format specified int the
 /// write up.
 ///
 /// @param e the entry to be printed
 /// @param stream the stream to which we are printing to
 
 void entry_print(Entry e, FILE *stream) {
+    char line[256];
+    int len = entry_format(e, line, sizeof(line));
+    if(len >= 0 && (size_t) len < sizeof(line)) {
+        fputs(line, stream);
+        return;
+    }
+    char *big = (char*) malloc((size_t) len + 1);
+    if(big != NULL) {
+        entry_format(e, big, (size_t) len + 1);
+        fputs(big, stream);
+        free(big);
+    }
+}
+
+/// Writes the line entry_print would print for an entry to a buffer.
+///
+/// @param e the entry to format
+/// @param buffer receives the line, NUL-terminated
+/// @param size the size of buffer
+/// @return the length of the whole line; if it is not less than size
+/// the line was cut short, as with snprintf
+
+int entry_format(Entry e, char *buffer, size_t size) {
     unsigned char bytes[4];
     bytes[0] = e->key & 0xFF;
     bytes[1] = (e->key >> 8) & 0xFF;
     bytes[2] = (e->key >> 16) & 0xFF;
     bytes[3] = (e->key >> 24) & 0xFF;
-    fprintf(stream, "%u:  ", e->key);
-    fprintf( stream, "(%d.%d.%d.%d, %s:  %s, %s, %s)\n",
-    bytes[3], bytes[2], bytes[1], bytes[0], e->cc, e->name, 
-    e->city, e->province);
+
+    const char *cc = entry_location(e);
+    const char *name = cc + strlen(cc) + 1;
+    const char *province = name + strlen(name) + 1;
+    const char *city = province + strlen(province) + 1;
+
+    return snprintf(buffer, size, "%u:  (%d.%d.%d.%d, %s:  %s, %s, %s)\n",
+        e->key, bytes[3], bytes[2], bytes[1], bytes[0], cc, name,
+        city, province);
 }
 
 ///
-/// creates a new dynamically allocated entry. used for when collisions
-/// happen in node_insert
+/// creates a new dynamically allocated entry. The copy shares
+/// the location of n.
 ///
 /// @param n the entry to be copied
 /// @return a node with datamembers with the same value as n
 
 Entry copy_entry(Entry n) {
     Entry tmp = (Entry) malloc(sizeof(struct Entry_s));
-    tmp->key = n->key;
-
-
-    tmp->cc = (char*) malloc(sizeof( char ) * 3);
-    strcpy(tmp->cc, n->cc);
-    tmp->city = (char*) malloc(sizeof(char) * (strlen(n->city) + 1));
-    strcpy(tmp->city, n->city);
-    tmp->name = (char*) malloc(sizeof(char) * (strlen(n->name) + 1));
-    strcpy(tmp->name, n->name);
-    tmp->province = (char*) malloc(sizeof(char) * 
-    (strlen(n->province) + 1));
-
-    strcpy(tmp->province, n->province);
-
+    *tmp = *n;
     return tmp;
 }
@@ -1,28 +1,64 @@
 #ifndef _ENTRYH_
 #define _ENTRYH_
 
+#include <stdio.h>
+
 
 typedef unsigned int ikey_t;
 
+/// id of an interned location, see entry_location
+typedef unsigned int loc_t;
+
 struct Entry_s {
-    ikey_t key;              ///< unique identifier key
-    char *cc;
-    char *name;
-    char *province;
-    char *city;
+    ikey_t key;              ///< unique identifier key, first of the range
+    ikey_t key_to;           ///< last key of the range, key for a point
+    loc_t loc;               ///< interned (cc, name, province, city)
 };
 
 typedef struct Entry_s * Entry;
 
 void entry_init(Entry e, char* input, int tf);
 
+void entry_init_range(Entry e, char* input);
+
+const char *entry_parse_range(Entry e, const char *line, const char *end);
+
+const char *entry_parse_keys(Entry e, const char *line, const char *end,
+    const char **location);
+
+loc_t entry_parse_location(const char *location, const char *end);
+
 void entry_destroy(Entry e);
 
 void entry_print(Entry e, FILE *stream);
 
+int entry_format(Entry e, char *buffer, size_t size);
+
 Entry entry_create(char* input, int tf);
 
 Entry copy_entry(Entry n);
 
+const char *entry_location(Entry e);
+
+const char *entry_location_of(loc_t loc);
+
+size_t entry_locations_count(void);
+
+void entry_locations_release(void);
+
+void entry_locations_share(void);
+
+size_t entry_locations_image(const char **blob, size_t *blob_size,
+    const size_t **records);
+
+int entry_locations_map(const char *blob, size_t blob_size,
+    const size_t *records, size_t count);
+
+int entry_locations_unmap(const void *start, size_t size);
+
+loc_t entry_locations_intern(const char *strings);
+
+void entry_locations_memory(size_t *used, size_t *spare);
+
 
 #endif
@@ -0,0 +1,511 @@
+//
+// File: lctrie.c
+// Level- and path-compressed index (LC-trie) over the sorted leaves
+// of the bitwise trie, after Nilsson and Karlsson's LC-trie.
+//
+// The nodes live in one array. A node either branches on 'branch' bits
+// after skipping 'skip' bits, with its 2^branch children stored
+// contiguously starting at 'adr', or it is a leaf (branch == 0) and
+// 'adr' indexes the sorted key array.
+// // // // // // // // // // // // // // // // // // // // // // // //
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "lctrie.h"
+
+#define KEYBITS 32
+#define MAX(x,y) ((x>y) ? x:y)
+
+/// extracts n bits of key k starting p bits from the most significant
+#define EXTRACT(p, n, k) ((ikey_t) ((k) << (p)) >> (KEYBITS - (n)))
+
+/// a node branches on more bits as long as at least half of the
+/// resulting children are non-empty
+#define FILL_NUMERATOR 1
+#define FILL_DENOMINATOR 2
+
+/// caps the width of a single node at 2^MAX_BRANCH children
+#define MAX_BRANCH 20
+
+/// number of lookups lc_search_batch walks in lockstep
+#define BATCH 16
+
+/////////////////////// struct definitions ////////////////////////////////
+
+struct LCNode_s {
+    unsigned int adr;         ///< first child, or key index for a leaf
+    unsigned char branch;     ///< log2 of the number of children
+    unsigned char skip;       ///< bits skipped before branching
+};
+
+struct LCTrie_s {
+    struct LCNode_s *nodes;
+    size_t num_nodes;         ///< slots of nodes in use
+    size_t capacity;          ///< slots of nodes allocated
+    ikey_t *keys;             ///< leaves in key order
+    unsigned int *values;     ///< what a search for each leaf returns
+    size_t size;              ///< number of leaves
+    size_t height;
+    size_t num_internal;
+    int failed;               ///< set when an allocation failed mid-build
+    int borrowed;             ///< the arrays belong to someone else
+};
+
+/// Remembers the range built for the previous child slot so that empty
+/// slots, which share their neighbour's range, reuse the built node.
+
+struct Slots_s {
+    size_t next;              ///< next child slot to fill
+    size_t prev_lo;
+    size_t prev_hi;
+};
+
+////////////////////////// Building ////////////////////////////////////
+
+/// Reserves count consecutive node slots at the end of the array.
+///
+/// @param lc the index being built
+/// @param count the number of slots wanted
+/// @return the index of the first reserved slot
+
+static size_t reserve_nodes( LCTrie lc, size_t count) {
+    if(lc->num_nodes + count > lc->capacity) {
+        size_t cap = MAX(lc->capacity * 2, lc->num_nodes + count);
+        struct LCNode_s *tmp = realloc(lc->nodes,
+            sizeof(struct LCNode_s) * cap);
+        if(tmp == NULL) {
+            lc->failed = 1;
+            return 0;
+        }
+        lc->nodes = tmp;
+        lc->capacity = cap;
+    }
+    size_t first = lc->num_nodes;
+    lc->num_nodes += count;
+    return first;
+}
+
+/// Finds the first entry in [lo, hi) whose bit at pos is set. All
+/// entries in the range agree on the bits above pos, so the set bits
+/// form a suffix of the range.
+///
+/// @param lc the index being built
+/// @param lo start of the range
+/// @param hi end of the range
+/// @param pos the bit to observe, counted from the most significant
+/// @return index of the first entry with the bit set, or hi
+
+static size_t split_point( LCTrie lc, size_t lo, size_t hi, int pos) {
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(EXTRACT(pos, 1, lc->keys[mid])) {
+            hi = mid;
+        }
+        else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+/// Counts the distinct values the n bits at pre take over a range.
+///
+/// @param lc the index being built
+/// @param first start of the range
+/// @param n length of the range
+/// @param pre the first bit observed
+/// @param branch how many bits are observed
+
+static size_t count_patterns( LCTrie lc, size_t first, size_t n, int pre,
+    int branch) {
+    size_t patterns = 1;
+    ikey_t last = EXTRACT(pre, branch, lc->keys[first]);
+    for(size_t i = first + 1; i < first + n; i++) {
+        ikey_t cur = EXTRACT(pre, branch, lc->keys[i]);
+        if(cur != last) {
+            patterns++;
+            last = cur;
+        }
+    }
+    return patterns;
+}
+
+/// Picks how many bits a node over the range branches on: the widest
+/// branch for which the fill factor of non-empty children still holds.
+
+static int compute_branch( LCTrie lc, size_t first, size_t n, int pre) {
+    int branch = 1;
+    while(branch < MAX_BRANCH && pre + branch < KEYBITS) {
+        size_t wanted = ((size_t) 1 << (branch + 1)) * FILL_NUMERATOR
+            / FILL_DENOMINATOR;
+        if(wanted > n || count_patterns(lc, first, n, pre, branch + 1)
+            < wanted) {
+            break;
+        }
+        branch++;
+    }
+    return branch;
+}
+
+static void build_node( LCTrie lc, size_t slot, size_t first, size_t n,
+    int pre, size_t depth);
+
+/// Assigns entry ranges to the child slots of a node, one bit at a time.
+/// When no entry takes the key's bit the walk continues in the other
+/// half, which is what the bitwise trie does at a node with one child,
+/// so every slot answers exactly as the bitwise trie would.
+///
+/// @param lc the index being built
+/// @param slots the child slots of the node being filled
+/// @param adr the first child slot of the node
+/// @param lo start of the range that reaches this bit
+/// @param hi end of the range that reaches this bit
+/// @param pos the bit to split the range on
+/// @param bits how many bits remain before the children are reached
+/// @param depth depth of the children
+
+static void fill_slots( LCTrie lc, struct Slots_s *slots, size_t adr,
+    size_t lo, size_t hi, int pos, int bits, size_t depth) {
+
+    if(bits == 0) {
+        size_t slot = adr + slots->next++;
+        if(lo == slots->prev_lo && hi == slots->prev_hi) {
+            lc->nodes[slot] = lc->nodes[slot - 1];
+        }
+        else {
+            build_node(lc, slot, lo, hi - lo, pos, depth);
+            slots->prev_lo = lo;
+            slots->prev_hi = hi;
+        }
+        return;
+    }
+    size_t mid = split_point(lc, lo, hi, pos);
+
+    if(mid > lo) {
+        fill_slots(lc, slots, adr, lo, mid, pos + 1, bits - 1, depth);
+    }
+    else {
+        fill_slots(lc, slots, adr, mid, hi, pos + 1, bits - 1, depth);
+    }
+    if(mid < hi) {
+        fill_slots(lc, slots, adr, mid, hi, pos + 1, bits - 1, depth);
+    }
+    else {
+        fill_slots(lc, slots, adr, lo, mid, pos + 1, bits - 1, depth);
+    }
+}
+
+/// Builds the node for the entries [first, first + n) into slot.
+///
+/// @param lc the index being built
+/// @param slot where the node is written
+/// @param first start of the range
+/// @param n length of the range, at least one
+/// @param pre bits already consumed by the ancestors
+/// @param depth depth of the node, the root is at depth one
+
+static void build_node( LCTrie lc, size_t slot, size_t first, size_t n,
+    int pre, size_t depth) {
+
+    if(lc->failed) {
+        return;
+    }
+    if(n == 1) {
+        lc->nodes[slot].adr = (unsigned int) first;
+        lc->nodes[slot].branch = 0;
+        lc->nodes[slot].skip = 0;
+        lc->height = MAX(lc->height, depth);
+        return;
+    }
+    // the range is sorted, so its first and last keys bound the
+    // prefix every key in it shares
+    ikey_t diff = (lc->keys[first] ^ lc->keys[first + n - 1])
+        << pre;
+    int skip = __builtin_clz(diff);
+    int branch = compute_branch(lc, first, n, pre + skip);
+
+    size_t adr = reserve_nodes(lc, (size_t) 1 << branch);
+    if(lc->failed) {
+        return;
+    }
+    lc->nodes[slot].adr = (unsigned int) adr;
+    lc->nodes[slot].branch = (unsigned char) branch;
+    lc->nodes[slot].skip = (unsigned char) skip;
+    lc->num_internal++;
+
+    struct Slots_s slots = { 0, 0, 0 };
+    fill_slots(lc, &slots, adr, first, first + n, pre + skip, branch,
+        depth + 1);
+}
+
+/// Build an index over keys sorted in strictly increasing order, each
+/// with a non-zero value (such as an entry id) a search hands back.
+/// @param keys the keys in order, ownership passes to the index
+/// @param values the value of each key, ownership passes to the index
+/// @param n number of keys
+/// @return the index, or NULL on allocation failure (the arrays are
+/// then freed)
+
+LCTrie lc_build( ikey_t *keys, unsigned int *values, size_t n) {
+    LCTrie lc = (LCTrie) calloc(1, sizeof(struct LCTrie_s));
+    if(lc == NULL) {
+        free(keys);
+        free(values);
+        return NULL;
+    }
+    lc->keys = keys;
+    lc->values = values;
+    lc->size = n;
+
+    if(n > 0) {
+        reserve_nodes(lc, 1);
+        build_node(lc, 0, 0, n, 0, 1);
+    }
+    if(lc->failed) {
+        lc_destroy(lc);
+        return NULL;
+    }
+    return lc;
+}
+
+/// Free the index and its arrays.
+/// @param lc the index to destroy, may be NULL
+
+void lc_destroy( LCTrie lc) {
+    if(lc != NULL) {
+        if(!lc->borrowed) {
+            free(lc->nodes);
+            free(lc->keys);
+            free(lc->values);
+        }
+        free(lc);
+    }
+}
+
+/// Describe the arrays of an index.
+/// @param lc the index
+/// @param image receives the description, which points into lc
+
+void lc_image( LCTrie lc, struct LCImage_s *image) {
+    image->nodes = lc->nodes;
+    image->num_nodes = lc->num_nodes;
+    image->node_size = sizeof(struct LCNode_s);
+    image->keys = lc->keys;
+    image->values = lc->values;
+    image->size = lc->size;
+    image->height = lc->height;
+    image->num_internal = lc->num_internal;
+}
+
+/// Make an index that searches the arrays of an image in place.
+/// @param image the arrays of an index made by lc_image
+/// @return the index, or NULL if the node size does not match or
+/// memory ran out
+
+LCTrie lc_from_image( const struct LCImage_s *image) {
+    if(image->node_size != sizeof(struct LCNode_s) ||
+        (image->size > 0 && image->num_nodes == 0)) {
+        return NULL;
+    }
+    LCTrie lc = (LCTrie) calloc(1, sizeof(struct LCTrie_s));
+    if(lc == NULL) {
+        return NULL;
+    }
+    lc->nodes = (struct LCNode_s*) image->nodes;
+    lc->num_nodes = lc->capacity = image->num_nodes;
+    lc->keys = (ikey_t*) image->keys;
+    lc->values = (unsigned int*) image->values;
+    lc->size = image->size;
+    lc->height = image->height;
+    lc->num_internal = image->num_internal;
+    lc->borrowed = 1;
+    return lc;
+}
+
+////////////////////////// Queries ////////////////////////////////////
+
+/// Checks whether the first len bits of two keys are equal.
+
+static int same_prefix( ikey_t a, ikey_t b, int len) {
+    return len == 0 || (a ^ b) >> (KEYBITS - len) == 0;
+}
+
+/// Finds the last key of the run of keys around i that share the
+/// first len bits of key, galloping outwards from i.
+///
+/// @param lc the index
+/// @param i a position inside the run
+/// @param key the key whose prefix the run shares
+/// @param len the prefix length
+/// @return the position of the last key of the run
+
+static size_t run_last( LCTrie lc, size_t i, ikey_t key, int len) {
+    size_t step = 1;
+    while(i + step < lc->size && same_prefix(lc->keys[i + step], key, len)) {
+        i += step;
+        step *= 2;
+    }
+    size_t hi = i + step;
+    if(hi > lc->size) {
+        hi = lc->size;
+    }
+    // the run ends in [i, hi)
+    while(hi - i > 1) {
+        size_t mid = i + (hi - i) / 2;
+        if(same_prefix(lc->keys[mid], key, len)) {
+            i = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return i;
+}
+
+/// Finds the first key of the run of keys around i that share the
+/// first len bits of key, galloping outwards from i.
+///
+/// @param lc the index
+/// @param i a position inside the run
+/// @param key the key whose prefix the run shares
+/// @param len the prefix length
+/// @return the position of the first key of the run
+
+static size_t run_first( LCTrie lc, size_t i, ikey_t key, int len) {
+    size_t step = 1;
+    while(step <= i && same_prefix(lc->keys[i - step], key, len)) {
+        i -= step;
+        step *= 2;
+    }
+    size_t lo = step > i ? 0 : i - step;
+    // the run starts in (lo, i], or at lo when lo is in it
+    if(same_prefix(lc->keys[lo], key, len)) {
+        return lo;
+    }
+    while(i - lo > 1) {
+        size_t mid = lo + (i - lo) / 2;
+        if(same_prefix(lc->keys[mid], key, len)) {
+            i = mid;
+        }
+        else {
+            lo = mid;
+        }
+    }
+    return i;
+}
+
+/// Turns the leaf a walk reached into the predecessor of key.
+///
+/// The walk follows the key's bits and skips the bits a subtree agrees
+/// on, exactly like the bitwise trie, so the leaf it reaches shares
+/// the longest prefix with key of all leaves. The keys sharing that
+/// prefix are a run of the sorted keys, and key sorts either after the
+/// whole run or before it, depending on its first bit past the prefix.
+///
+/// @param lc the index
+/// @param i the key index of the leaf the walk reached
+/// @param key the key searched for
+/// @return the value of the predecessor, or 0 if every key is greater
+
+static unsigned int leaf_predecessor( LCTrie lc, size_t i, ikey_t key) {
+    ikey_t found = lc->keys[i];
+    if(found == key) {
+        return lc->values[i];
+    }
+    int len = __builtin_clz(found ^ key);
+
+    if(EXTRACT(len, 1, key)) {
+        return lc->values[run_last(lc, i, key, len)];
+    }
+    i = run_first(lc, i, key, len);
+    return i == 0 ? 0 : lc->values[i - 1];
+}
+
+/// Find the largest key in the index that is not greater than key.
+/// @param lc the index to search
+/// @param key the key to find
+/// @return the value of the predecessor, or 0 if every key is greater
+
+unsigned int lc_search( LCTrie lc, ikey_t key) {
+    if(lc->size == 0) {
+        return 0;
+    }
+    struct LCNode_s node = lc->nodes[0];
+    int pos = 0;
+
+    while(node.branch != 0) {
+        int branch = node.branch;
+        pos += node.skip;
+        node = lc->nodes[node.adr + EXTRACT(pos, branch, key)];
+        pos += branch;
+    }
+    return leaf_predecessor(lc, node.adr, key);
+}
+
+/// Find the predecessor of many keys at once. Up to BATCH walks advance
+/// one level per round, and each prefetches the node it moves to, so
+/// the cache misses of one round overlap instead of following one
+/// another.
+/// @param lc the index to search
+/// @param keys the keys to find
+/// @param out receives the value of each key's predecessor, or 0
+/// @param n the number of keys
+
+void lc_search_batch( LCTrie lc, const ikey_t *keys, unsigned int *out,
+    size_t n) {
+    if(lc->size == 0) {
+        for(size_t i = 0; i < n; i++) {
+            out[i] = 0;
+        }
+        return;
+    }
+    for(size_t first = 0; first < n; first += BATCH) {
+        size_t lanes = (n - first < BATCH) ? n - first : BATCH;
+        const ikey_t *key = keys + first;
+        size_t at[BATCH];
+        int pos[BATCH];
+        size_t walking = lanes;
+
+        for(size_t l = 0; l < lanes; l++) {
+            at[l] = 0;
+            pos[l] = 0;
+        }
+        while(walking > 0) {
+            walking = 0;
+            for(size_t l = 0; l < lanes; l++) {
+                struct LCNode_s node = lc->nodes[at[l]];
+                if(node.branch == 0) {
+                    continue;
+                }
+                pos[l] += node.skip;
+                at[l] = node.adr + EXTRACT(pos[l], node.branch, key[l]);
+                pos[l] += node.branch;
+                __builtin_prefetch(&lc->nodes[at[l]]);
+                walking++;
+            }
+        }
+        for(size_t l = 0; l < lanes; l++) {
+            at[l] = lc->nodes[at[l]].adr;
+            __builtin_prefetch(&lc->keys[at[l]]);
+        }
+        for(size_t l = 0; l < lanes; l++) {
+            out[first + l] = leaf_predecessor(lc, at[l], key[l]);
+        }
+    }
+}
+
+/// get the height of the index: the most nodes any lookup visits
+/// @param lc the index
+/// @return height of the index
+
+size_t lc_height( LCTrie lc) {
+    return lc->height;
+}
+
+/// get the number of branching (internal) nodes in the index
+/// @param lc the index
+/// @return the count of internal nodes
+
+size_t lc_node_count( LCTrie lc) {
+    return lc->num_internal;
+}
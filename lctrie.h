@@ -0,0 +1,95 @@
+//
+// File: lctrie.h
+// Level- and path-compressed index (LC-trie) built over the sorted
+// leaves of an integer-keyed trie.
+// // // // // // // // // // // // // // // // // // // // // // // //
+
+#ifndef LCTRIE_H
+#define LCTRIE_H
+
+#include <stddef.h>
+#include "entry.h"
+
+
+/// LCTrie is a pointer to a read-only level-compressed index.
+/// Each node skips the bits its whole subtree agrees on and then
+/// branches on several bits at once, so a lookup visits only a
+/// handful of nodes instead of one node per key bit.
+
+typedef struct LCTrie_s * LCTrie;
+
+/// LCImage describes the arrays of an index, so they can be written to
+/// a file and later searched in place.
+
+struct LCImage_s {
+    const void *nodes;          ///< the node array
+    size_t num_nodes;
+    size_t node_size;           ///< bytes per node
+    const ikey_t *keys;         ///< leaves in key order
+    const unsigned int *values;
+    size_t size;                ///< number of leaves
+    size_t height;
+    size_t num_internal;
+};
+
+/// Build an index over keys sorted in strictly increasing order, each
+/// with a non-zero value (such as an entry id) a search hands back.
+/// @param keys the keys in order, ownership passes to the index
+/// @param values the value of each key, ownership passes to the index
+/// @param n number of keys
+/// @return the index, or NULL on allocation failure (the arrays are
+/// then freed)
+
+LCTrie lc_build( ikey_t *keys, unsigned int *values, size_t n);
+
+/// Free the index and its arrays.
+/// @param lc the index to destroy, may be NULL
+
+void lc_destroy( LCTrie lc);
+
+/// Describe the arrays of an index.
+/// @param lc the index
+/// @param image receives the description, which points into lc
+
+void lc_image( LCTrie lc, struct LCImage_s *image);
+
+/// Make an index that searches arrays described by an image, such as
+/// ones in a mapped file, without copying them. lc_destroy leaves the
+/// arrays alone.
+/// @param image the arrays of an index made by lc_image
+/// @return the index, or NULL if the node size does not match or
+/// memory ran out
+
+LCTrie lc_from_image( const struct LCImage_s *image);
+
+/// Find the largest key in the index that is not greater than key.
+/// @param lc the index to search
+/// @param key the key to find
+/// @return the value of the predecessor, or 0 if every key is greater
+
+unsigned int lc_search( LCTrie lc, ikey_t key);
+
+/// Find the predecessor of many keys at once, walking several lookups
+/// in lockstep so their memory accesses overlap.
+/// @param lc the index to search
+/// @param keys the keys to find
+/// @param out receives the value of each key's predecessor, or 0
+/// @param n the number of keys
+
+void lc_search_batch( LCTrie lc, const ikey_t *keys, unsigned int *out,
+    size_t n);
+
+/// get the height of the index: the most nodes any lookup visits
+/// @param lc the index
+/// @return height of the index
+
+size_t lc_height( LCTrie lc);
+
+/// get the number of branching (internal) nodes in the index
+/// @param lc the index
+/// @return the count of internal nodes
+
+size_t lc_node_count( LCTrie lc);
+
+
+#endif // LCTRIE_H
@@ -0,0 +1,631 @@
+//
+// File: loader.c
+// Reads geo-IP range tables in the place_ip CSV format by mapping the
+// whole file into memory and scanning it in place, and applies the
+// difference between two editions of a table to a live trie.
+// // // // // // // // // // // // // // // // // // // // // // // //
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "loader.h"
+
+/// most threads load_csv_parallel parses with
+#define MAX_LOADERS 256
+
+/// A slice of the file one thread parses, cut at line breaks, and the
+/// distinct location texts it met. Entries are given the chunk's own
+/// ids for their locations until those are interned.
+
+struct Chunk_s {
+    const char *start;
+    const char *end;
+    Entry entries;           ///< room for every line of the chunk
+    size_t lines;
+    size_t count;            ///< ranges parsed
+    const char **text;       ///< each local location's fields, by id
+    size_t *text_len;
+    loc_t *global;           ///< each local id's interned id
+    size_t num_texts;        ///< local ids in use, 0 included
+    size_t text_capacity;
+    loc_t *slots;            ///< open-addressed table of local ids
+    size_t num_slots;        ///< a power of two
+    int failed;              ///< memory ran out
+};
+
+/// A line of one of the two tables load_diff walks side by side.
+
+struct DiffLine_s {
+    const char *next;        ///< where the line after it starts
+    const char *end;         ///< where the table ends
+    struct Entry_s entry;    ///< its range, location not yet interned
+    const char *location;    ///< its location fields
+    size_t location_len;     ///< their length, line break left out
+    int valid;               ///< 0 once the table is used up
+};
+
+/// A change load_diff found: a range to remove, or one to upsert.
+
+struct DiffOp_s {
+    struct Entry_s entry;
+    int remove;
+};
+
+/// Counts the lines of a buffer, including a last line without a
+/// line break, so the entry array can be allocated once.
+///
+/// @param p the start of the buffer
+/// @param end the end of the buffer
+/// @return the number of lines
+
+static size_t count_lines( const char *p, const char *end) {
+    size_t lines = 0;
+    while(p < end) {
+        const char *nl = memchr(p, '\n', (size_t) (end - p));
+        lines++;
+        p = (nl == NULL) ? end : nl + 1;
+    }
+    return lines;
+}
+
+/// Parses every non-blank line of a buffer.
+///
+/// @param p the start of the buffer
+/// @param end the end of the buffer
+/// @param entries receives the ranges, with room for every line
+/// @return the number of ranges parsed
+
+static size_t parse_lines( const char *p, const char *end, Entry entries) {
+    size_t count = 0;
+    while(p < end) {
+        if(*p == '\n' || *p == '\r') {
+            p++;
+            continue;
+        }
+        p = entry_parse_range(&entries[count++], p, end);
+    }
+    return count;
+}
+
+/// Maps a whole file into memory for reading.
+///
+/// @param filename the file to map
+/// @param size set to the size of the file
+/// @return the mapping, NULL if the file is empty (size is then 0),
+/// or MAP_FAILED if it could not be read (errno tells why)
+
+static char *map_file( const char *filename, size_t *size) {
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) {
+        return MAP_FAILED;
+    }
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        return MAP_FAILED;
+    }
+    *size = (size_t) st.st_size;
+    if(st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    char *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data != MAP_FAILED) {
+        posix_madvise(data, *size, POSIX_MADV_SEQUENTIAL);
+    }
+    return data;
+}
+
+/// Read every range of a CSV file. The file is memory-mapped and each
+/// line is parsed in place, so lines are never copied and may be of
+/// any length.
+/// @param filename the file to read
+/// @param count set to the number of ranges read
+/// @return a malloc'd array of count entries, or NULL if the file could
+/// not be read (errno tells why)
+
+Entry load_csv( const char *filename, size_t *count) {
+    size_t size;
+    char *data = map_file(filename, &size);
+    *count = 0;
+    if(data == MAP_FAILED) {
+        return NULL;
+    }
+    if(data == NULL) {
+        return (Entry) malloc(sizeof(struct Entry_s));
+    }
+
+    Entry entries = (Entry) malloc(sizeof(struct Entry_s) *
+        count_lines(data, data + size));
+    if(entries != NULL) {
+        *count = parse_lines(data, data + size, entries);
+    }
+    else {
+        errno = ENOMEM;
+    }
+    munmap(data, size);
+    return entries;
+}
+
+/// Moves to the next range of a table, skipping blank lines and later
+/// lines with the key of the range before, which the bulk builds drop
+/// too.
+///
+/// @param line the current line of the table
+/// @return 1 on success, 0 if the table is not sorted by key
+
+static int next_diff_line( struct DiffLine_s *line) {
+    int first = !line->valid;
+    ikey_t last = line->entry.key;
+    const char *p = line->next;
+    while(p < line->end) {
+        if(*p == '\n' || *p == '\r') {
+            p++;
+            continue;
+        }
+        const char *location;
+        struct Entry_s e;
+        p = entry_parse_keys(&e, p, line->end, &location);
+        if(!first && e.key == last) {
+            continue;
+        }
+        if(!first && e.key < last) {
+            return 0;
+        }
+        const char *stop = location;
+        while(stop < p && *stop != '\n' && *stop != '\r') {
+            stop++;
+        }
+        line->next = p;
+        line->entry = e;
+        line->location = location;
+        line->location_len = (size_t) (stop - location);
+        line->valid = 1;
+        return 1;
+    }
+    line->next = p;
+    line->valid = 0;
+    return 1;
+}
+
+/// Interns the location of a table line into its entry.
+///
+/// @param line the line
+/// @return 1 on success, 0 if memory ran out
+
+static int intern_diff_line( struct DiffLine_s *line) {
+    line->entry.loc = entry_parse_location(line->location,
+        line->location + line->location_len);
+    return line->entry.loc != 0;
+}
+
+/// Adds a change to the list load_diff applies.
+///
+/// @param ops the list, grown as needed
+/// @param count the changes in it
+/// @param capacity the room it has
+/// @param e the range removed or stored
+/// @param remove 1 to remove the range, 0 to upsert it
+/// @return 1 on success, 0 if memory ran out
+
+static int add_diff_op( struct DiffOp_s **ops, size_t *count,
+    size_t *capacity, const struct Entry_s *e, int remove) {
+    if(*count == *capacity) {
+        size_t cap = *capacity ? *capacity * 2 : 256;
+        struct DiffOp_s *grown = (struct DiffOp_s*) realloc(*ops,
+            sizeof(struct DiffOp_s) * cap);
+        if(grown == NULL) {
+            return 0;
+        }
+        *ops = grown;
+        *capacity = cap;
+    }
+    (*ops)[*count].entry = *e;
+    (*ops)[*count].remove = remove;
+    (*count)++;
+    return 1;
+}
+
+/// Hashes the text of a location with FNV-1a.
+
+static size_t hash_text( const char *p, size_t len) {
+    size_t h = 2166136261u;
+    for(size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) p[i]) * 16777619u;
+    }
+    return h;
+}
+
+/// Grows the table of a chunk's local ids to twice its size.
+///
+/// @param c the chunk
+/// @return 1 on success, 0 if memory ran out
+
+static int grow_chunk_slots( struct Chunk_s *c) {
+    size_t num_slots = c->num_slots ? c->num_slots * 2 : 1024;
+    loc_t *slots = (loc_t*) calloc(num_slots, sizeof(loc_t));
+    if(slots == NULL) {
+        return 0;
+    }
+    for(size_t id = 1; id < c->num_texts; id++) {
+        size_t i = hash_text(c->text[id], c->text_len[id]) & (num_slots - 1);
+        while(slots[i] != 0) {
+            i = (i + 1) & (num_slots - 1);
+        }
+        slots[i] = (loc_t) id;
+    }
+    free(c->slots);
+    c->slots = slots;
+    c->num_slots = num_slots;
+    return 1;
+}
+
+/// Finds the chunk's local id of a location text, the exact bytes of
+/// its fields on the line, adding it if it is new.
+///
+/// @param c the chunk
+/// @param p the first byte of the fields
+/// @param len the length of the fields, without the line break
+/// @return the local id, or 0 if memory ran out
+
+static loc_t local_location( struct Chunk_s *c, const char *p, size_t len) {
+    if(c->num_texts * 2 >= c->num_slots && !grow_chunk_slots(c)) {
+        return 0;
+    }
+    size_t i = hash_text(p, len) & (c->num_slots - 1);
+    while(c->slots[i] != 0) {
+        loc_t id = c->slots[i];
+        if(c->text_len[id] == len && memcmp(c->text[id], p, len) == 0) {
+            return id;
+        }
+        i = (i + 1) & (c->num_slots - 1);
+    }
+    if(c->num_texts == c->text_capacity) {
+        size_t cap = c->text_capacity * 2;
+        const char **text = (const char**) realloc(c->text,
+            sizeof(const char*) * cap);
+        if(text == NULL) {
+            return 0;
+        }
+        c->text = text;
+        size_t *text_len = (size_t*) realloc(c->text_len,
+            sizeof(size_t) * cap);
+        if(text_len == NULL) {
+            return 0;
+        }
+        c->text_len = text_len;
+        c->text_capacity = cap;
+    }
+    loc_t id = (loc_t) c->num_texts++;
+    c->text[id] = p;
+    c->text_len[id] = len;
+    c->slots[i] = id;
+    return id;
+}
+
+/// Counts the lines of a chunk, so its part of the entry array can be
+/// placed before any chunk is parsed.
+///
+/// @param arg the chunk
+/// @return NULL
+
+static void *count_chunk( void *arg) {
+    struct Chunk_s *c = (struct Chunk_s*) arg;
+    c->lines = count_lines(c->start, c->end);
+    return NULL;
+}
+
+/// Parses every non-blank line of a chunk, giving each location text
+/// a local id; nothing shared is touched.
+///
+/// @param arg the chunk
+/// @return NULL
+
+static void *parse_chunk( void *arg) {
+    struct Chunk_s *c = (struct Chunk_s*) arg;
+    c->text_capacity = 256;
+    c->num_texts = 1;        // id 0 stands for no location
+    c->text = (const char**) malloc(sizeof(const char*) * c->text_capacity);
+    c->text_len = (size_t*) malloc(sizeof(size_t) * c->text_capacity);
+    if(c->text == NULL || c->text_len == NULL) {
+        c->failed = 1;
+        return NULL;
+    }
+    const char *p = c->start;
+    while(p < c->end) {
+        if(*p == '\n' || *p == '\r') {
+            p++;
+            continue;
+        }
+        Entry e = &c->entries[c->count++];
+        const char *location;
+        const char *next = entry_parse_keys(e, p, c->end, &location);
+        const char *stop = next;
+        while(stop > location && (stop[-1] == '\n' || stop[-1] == '\r')) {
+            stop--;
+        }
+        e->loc = local_location(c, location, (size_t) (stop - location));
+        c->failed |= (e->loc == 0);
+        p = next;
+    }
+    return NULL;
+}
+
+/// Gives the entries of a chunk their interned locations.
+///
+/// @param arg the chunk
+/// @return NULL
+
+static void *relabel_chunk( void *arg) {
+    struct Chunk_s *c = (struct Chunk_s*) arg;
+    for(size_t i = 0; i < c->count; i++) {
+        c->entries[i].loc = c->global[c->entries[i].loc];
+    }
+    return NULL;
+}
+
+/// Runs a step on every chunk, one thread each, and waits for them.
+/// A chunk whose thread cannot be started is done by the caller.
+///
+/// @param chunks the chunks
+/// @param n the number of chunks
+/// @param step what to run on each chunk
+
+static void run_chunks( struct Chunk_s *chunks, size_t n,
+    void *(*step)(void*)) {
+    pthread_t ids[MAX_LOADERS];
+    int started[MAX_LOADERS];
+    for(size_t i = 0; i < n; i++) {
+        started[i] = (pthread_create(&ids[i], NULL, step, &chunks[i]) == 0);
+        if(!started[i]) {
+            step(&chunks[i]);
+        }
+    }
+    for(size_t i = 0; i < n; i++) {
+        if(started[i]) {
+            pthread_join(ids[i], NULL);
+        }
+    }
+}
+
+/// Read every range of a CSV file on several threads, with the result
+/// load_csv gives. The mapped file is cut into a chunk per thread at
+/// line breaks; the threads count and then parse their lines side by
+/// side, each naming the locations it meets with ids of its own. Only
+/// the distinct locations of each chunk are then interned, one thread
+/// at a time, before the threads relabel their entries.
+/// @param filename the file to read
+/// @param count set to the number of ranges read
+/// @param threads the number of threads to parse with
+/// @return a malloc'd array of count entries, or NULL if the file could
+/// not be read (errno tells why)
+
+Entry load_csv_parallel( const char *filename, size_t *count, int threads) {
+    size_t size;
+    char *data = map_file(filename, &size);
+    *count = 0;
+    if(data == MAP_FAILED) {
+        return NULL;
+    }
+    if(data == NULL) {
+        return (Entry) malloc(sizeof(struct Entry_s));
+    }
+
+    size_t n = (threads < 1) ? 1 : (threads > MAX_LOADERS) ? MAX_LOADERS :
+        (size_t) threads;
+    struct Chunk_s *chunks = (struct Chunk_s*) calloc(n,
+        sizeof(struct Chunk_s));
+    if(chunks == NULL) {
+        munmap(data, size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    const char *p = data;
+    const char *end = data + size;
+    for(size_t i = 0; i < n; i++) {
+        const char *stop = (i + 1 == n) ? end : data + size / n * (i + 1);
+        stop = (stop < p) ? p : stop;
+        const char *nl = memchr(stop, '\n', (size_t) (end - stop));
+        stop = (stop == end || nl == NULL) ? end : nl + 1;
+        chunks[i].start = p;
+        chunks[i].end = stop;
+        p = stop;
+    }
+
+    run_chunks(chunks, n, count_chunk);
+    size_t lines = 0;
+    for(size_t i = 0; i < n; i++) {
+        lines += chunks[i].lines;
+    }
+    Entry entries = (Entry) malloc(sizeof(struct Entry_s) *
+        (lines ? lines : 1));
+    int failed = (entries == NULL);
+    if(!failed) {
+        lines = 0;
+        for(size_t i = 0; i < n; i++) {
+            chunks[i].entries = entries + lines;
+            lines += chunks[i].lines;
+        }
+        run_chunks(chunks, n, parse_chunk);
+    }
+
+    // intern each chunk's distinct locations, then relabel in parallel
+    for(size_t i = 0; i < n && !failed; i++) {
+        struct Chunk_s *c = &chunks[i];
+        c->global = (loc_t*) malloc(sizeof(loc_t) * c->num_texts);
+        failed = c->failed || c->global == NULL;
+        for(size_t id = 1; !failed && id < c->num_texts; id++) {
+            c->global[id] = entry_parse_location(c->text[id],
+                c->text[id] + c->text_len[id]);
+            failed = (c->global[id] == 0);
+        }
+        if(!failed) {
+            c->global[0] = 0;
+        }
+    }
+    if(!failed) {
+        run_chunks(chunks, n, relabel_chunk);
+        // blank lines leave gaps between the chunks' entries
+        for(size_t i = 0; i < n; i++) {
+            memmove(entries + *count, chunks[i].entries,
+                sizeof(struct Entry_s) * chunks[i].count);
+            *count += chunks[i].count;
+        }
+    }
+
+    for(size_t i = 0; i < n; i++) {
+        free(chunks[i].text);
+        free(chunks[i].text_len);
+        free(chunks[i].global);
+        free(chunks[i].slots);
+    }
+    free(chunks);
+    munmap(data, size);
+    if(failed) {
+        free(entries);
+        *count = 0;
+        errno = ENOMEM;
+        return NULL;
+    }
+    return entries;
+}
+
+/// Apply the difference between two editions of a CSV table to a trie
+/// holding the old one. Both files are mapped and walked side by side
+/// in key order: a key only the old file has is removed, a key only the
+/// new one has is inserted, and a key both have is replaced if its end
+/// or location changed. Lines compare as text first, so only the
+/// locations of changed lines are interned. Nothing is applied unless
+/// both files are sorted by key; then the trie is changed once per
+/// range that differs, so the cost follows the size of the change
+/// rather than the size of the table.
+/// @param trie the trie, holding the ranges of old_file
+/// @param old_file the table the trie was loaded from
+/// @param new_file the table to bring the trie up to
+/// @param diff set to what changed, may be NULL
+/// @return 1 on success, 0 if a file could not be read (errno tells
+/// why), was not sorted by key or the trie lacks a range old_file has
+/// and new_file drops (EINVAL; in both cases the trie is unchanged),
+/// or memory ran out (ENOMEM)
+
+int load_diff( Trie trie, const char *old_file, const char *new_file,
+    struct Diff_s *diff) {
+    size_t old_size = 0, new_size = 0;
+    char *old_data = map_file(old_file, &old_size);
+    if(old_data == MAP_FAILED) {
+        return 0;
+    }
+    char *new_data = map_file(new_file, &new_size);
+    if(new_data == MAP_FAILED) {
+        int error = errno;
+        if(old_data != NULL) {
+            munmap(old_data, old_size);
+        }
+        errno = error;
+        return 0;
+    }
+
+    struct DiffLine_s old_line = { old_data, old_data + old_size,
+        { 0, 0, 0 }, NULL, 0, 0 };
+    struct DiffLine_s new_line = { new_data, new_data + new_size,
+        { 0, 0, 0 }, NULL, 0, 0 };
+    struct Diff_s found = { 0, 0, 0, 0 };
+    struct DiffOp_s *ops = NULL;
+    size_t num_ops = 0, ops_capacity = 0;
+    int error = 0;
+
+    if(!next_diff_line(&old_line) || !next_diff_line(&new_line)) {
+        error = EINVAL;
+    }
+    while(!error && (old_line.valid || new_line.valid)) {
+        struct DiffLine_s *advance = NULL;
+        int ok = 1;
+        if(!new_line.valid || (old_line.valid &&
+            old_line.entry.key < new_line.entry.key)) {
+            ok = add_diff_op(&ops, &num_ops, &ops_capacity,
+                &old_line.entry, 1);
+            found.removed++;
+            advance = &old_line;
+        }
+        else if(!old_line.valid || new_line.entry.key < old_line.entry.key) {
+            ok = intern_diff_line(&new_line) && add_diff_op(&ops, &num_ops,
+                &ops_capacity, &new_line.entry, 0);
+            found.inserted++;
+            advance = &new_line;
+        }
+        else {
+            int same = old_line.entry.key_to == new_line.entry.key_to &&
+                old_line.location_len == new_line.location_len &&
+                memcmp(old_line.location, new_line.location,
+                old_line.location_len) == 0;
+            if(!same) {
+                // the same location may be written with other quoting
+                ok = intern_diff_line(&old_line) &&
+                    intern_diff_line(&new_line);
+                same = ok && old_line.entry.key_to == new_line.entry.key_to &&
+                    old_line.entry.loc == new_line.entry.loc;
+            }
+            if(ok && !same) {
+                ok = add_diff_op(&ops, &num_ops, &ops_capacity,
+                    &new_line.entry, 0);
+                found.changed++;
+            }
+            else if(ok) {
+                found.unchanged++;
+            }
+            if(!next_diff_line(&old_line)) {
+                error = EINVAL;
+            }
+            advance = &new_line;
+        }
+        if(!ok) {
+            error = ENOMEM;
+        }
+        else if(!error && !next_diff_line(advance)) {
+            error = EINVAL;
+        }
+    }
+    if(old_data != NULL) {
+        munmap(old_data, old_size);
+    }
+    if(new_data != NULL) {
+        munmap(new_data, new_size);
+    }
+
+    // a range to remove must be there, or the trie does not hold
+    // old_file; find out before anything is applied
+    for(size_t i = 0; !error && i < num_ops; i++) {
+        if(ops[i].remove) {
+            Entry e = ibt_search(trie, ops[i].entry.key);
+            if(e == NULL || e->key != ops[i].entry.key) {
+                error = EINVAL;
+            }
+        }
+    }
+    for(size_t i = 0; !error && i < num_ops; i++) {
+        // every range removed is present, so a delete that fails ran out
+        // of memory copying the path
+        int done = ops[i].remove ? ibt_delete(trie, ops[i].entry.key) :
+            ibt_upsert(trie, &ops[i].entry);
+        if(!done) {
+            error = ENOMEM;
+        }
+    }
+    free(ops);
+    if(error) {
+        errno = error;
+        return 0;
+    }
+    if(diff != NULL) {
+        *diff = found;
+    }
+    return 1;
+}
@@ -0,0 +1,63 @@
+//
+// File: loader.h
+// Reads geo-IP range tables in the place_ip CSV format.
+// // // // // // // // // // // // // // // // // // // // // // // //
+
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stddef.h>
+#include "entry.h"
+#include "trie.h"
+
+
+/// Read every range of a CSV file. The file is memory-mapped and each
+/// line is parsed in place, so lines are never copied and may be of
+/// any length.
+/// @param filename the file to read
+/// @param count set to the number of ranges read
+/// @return a malloc'd array of count entries, or NULL if the file could
+/// not be read (errno tells why)
+
+Entry load_csv( const char *filename, size_t *count);
+
+/// Read every range of a CSV file as load_csv does, parsing on several
+/// threads. Locations are interned in one pass over the distinct ones
+/// each thread met, so the result is the same as load_csv's.
+/// @param filename the file to read
+/// @param count set to the number of ranges read
+/// @param threads the number of threads to parse with
+/// @return a malloc'd array of count entries, or NULL if the file could
+/// not be read (errno tells why)
+
+Entry load_csv_parallel( const char *filename, size_t *count, int threads);
+
+/// What load_diff found between two editions of a table.
+
+struct Diff_s {
+    size_t inserted;         ///< ranges only the new table has
+    size_t removed;          ///< ranges only the old table has
+    size_t changed;          ///< ranges whose end or location changed
+    size_t unchanged;        ///< ranges left as they were
+};
+
+/// Bring a trie loaded from one edition of a CSV table up to another,
+/// for vendor updates that change a small part of a large table. Both
+/// files must be sorted by key; they are read side by side and only
+/// the ranges inserted, removed or changed are applied, with
+/// ibt_upsert and ibt_delete, so a shared trie keeps serving readers
+/// throughout.
+/// @param trie the trie, holding the ranges of old_file
+/// @param old_file the table the trie was loaded from
+/// @param new_file the table to bring the trie up to
+/// @param diff set to what changed, may be NULL
+/// @return 1 on success, 0 if a file could not be read (errno tells
+/// why), was not sorted by key (EINVAL), or memory ran out (ENOMEM);
+/// the trie is then left as it was, unless memory ran out while the
+/// changes were applied
+
+int load_diff( Trie trie, const char *old_file, const char *new_file,
+    struct Diff_s *diff);
+
+
+#endif // LOADER_H
@@ -2,14 +2,38 @@
 // file-name: place_ip.c
 // @author: Connor McRoberts cjm6653@rit.edu
 // 
-// flags to compile: -std=c99 -ggdb -Wall -Wextra
+// flags to compile: -std=c99 -ggdb -Wall -Wextra -pthread
+// (together with trie.c, lctrie.c, sarray.c, entry.c, loader.c,
+// server.c and cache.c)
 //
 // description: place_ip.c is a file that takes a single command line
 // arguement, that is suppose to be a filename. From there it builds 
-// a trie struct with each line from the file being to entrys
-// (showing the range of ip addresses). The user can then query the
+// a trie struct with each line from the file being an entry
+// (showing the range of ip addresses). The file may also be a snapshot
+// written earlier with '-s snapshot', which opens without parsing.
+// The user can then query the
 // tree with IP addresses either in numberical notation '10234106'
-// or IPV4 notation '120.0.0.255'
+// or IPV4 notation '120.0.0.255', and gets back the range holding it.
+//
+// With -p the queries are instead read from a pipe on stdin, and with
+// -u socket from clients of a Unix domain socket, and answered by a
+// pool of worker threads (-t, one per core by default; as many threads
+// parse the CSV file and build the trie). -c socket
+// turns place_ip into a client that sends -n random queries to such
+// a server and reports how many it got answered per second. -d bits
+// puts a direct table indexed by the top bits of the address in front
+// of the trie, trading memory for shorter lookups. -k slots gives each
+// worker a cache of that many hot lookups, keyed on the address or,
+// with -b bits, on the block of 2^bits addresses holding it.
+//
+// --apply-diff old.csv builds the trie from old.csv and then brings it
+// up to filename, a later edition of the same table, changing only the
+// ranges that differ; both files must be sorted by key. The time and
+// the changes it took are reported before queries are taken as usual.
+//
+// Typing 'stats' at the prompt, or sending it as a query, prints the
+// trie's counters and memory as JSON. The counters count only in a
+// build with -DIBT_STATS. Typing 'compact' repacks the trie's memory.
 //
 ////////////////////////////////////////////////////////////////////
 
@@ -18,8 +42,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
 #include "entry.h"
 #include "trie.h"
+#include "loader.h"
+#include "server.h"
+#include "cache.h"
+
+#define USAGE "usage: place_ip [-s snapshot] [-d bits] [-p | -u socket] " \
+    "[-t threads] [-k slots [-b bits]] filename\n" \
+    "       place_ip [options] --apply-diff old.csv new.csv\n" \
+    "       place_ip -c socket [-t connections] [-n queries]\n"
+
+/// number of queries -c sends unless -n says otherwise
+#define DEFAULT_CLIENT_QUERIES 1000000
 
 ///
 /// Converts character input from the user into 
@@ -75,48 +113,255 @@ ikey_t convert_to_key(char *input) {
     
 }
 
+///
+/// Builds the trie from a CSV file of ranges.
+///
+/// @param filename: the CSV file
+/// @param threads: the number of threads to parse and build with
+/// @return the trie, or NULL after reporting an error
+///
+Trie build_from_csv(const char *filename, int threads) {
+    size_t count = 0;
+    Entry entries = load_csv_parallel(filename, &count, threads);
+
+    if(entries == NULL) {
+        fprintf(stderr, "%s: No such file or directory \n", filename);
+        return NULL;
+    }
+    if(count == 0) {
+        perror("error: empty dataset\n");
+        free(entries);
+        return NULL;
+    }
+
+    Trie trie = ibt_create();
+    if(trie == NULL) {
+        perror(filename);
+        free(entries);
+        return NULL;
+    }
+
+    // every line is parsed already, build the trie in one pass
+    if(!ibt_build_parallel(trie, entries, count, threads)) {
+        perror(filename);
+        ibt_destroy(trie);
+        trie = NULL;
+    }
+    free(entries);
+    return trie;
+}
+
+///
+/// Brings a trie built from one edition of a table up to another,
+/// reporting what changed and how long it took.
+///
+/// @param trie: the trie, built from old_file
+/// @param old_file: the CSV file the trie was built from
+/// @param new_file: the later CSV file
+/// @return 1 if successful, 0 after reporting an error
+///
+int apply_diff(Trie trie, const char *old_file, const char *new_file) {
+    struct Diff_s diff;
+    struct timespec start, stop;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(!load_diff(trie, old_file, new_file, &diff)) {
+        perror("--apply-diff");
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    fprintf(stderr, "diff applied in %.3f s: %zu inserted, %zu removed, "
+        "%zu changed, %zu unchanged\n", (double) (stop.tv_sec - start.tv_sec) +
+        (double) (stop.tv_nsec - start.tv_nsec) * 1e-9, diff.inserted,
+        diff.removed, diff.changed, diff.unchanged);
+    return 1;
+}
+
+///
+/// Prints how many queries were answered and how fast.
+///
+/// @param stats: what the server or client got done
+/// @param threads: the number of threads or connections it used
+///
+void report(struct ServeStats_s *stats, int threads) {
+    fprintf(stderr, "%zu queries in %.3f s: %.0f queries/s on %d threads\n",
+        stats->queries, stats->seconds,
+        stats->seconds > 0 ? (double) stats->queries / stats->seconds : 0.0,
+        threads);
+    if(stats->cache_hits + stats->cache_misses > 0) {
+        fprintf(stderr, "cache: %zu hits, %zu misses (%.1f%% hits)\n",
+            stats->cache_hits, stats->cache_misses, 100.0 *
+            (double) stats->cache_hits /
+            (double) (stats->cache_hits + stats->cache_misses));
+    }
+}
+
+///
+/// Answers queries from a pipe on stdin, or from a socket, on a pool
+/// of threads, then frees the trie.
+///
+/// @param trie: the trie to search
+/// @param socket_path: the socket to listen on, or NULL for stdin
+/// @param threads: the number of worker threads
+/// @param cache_slots: the entries of each worker's cache, 0 for none
+/// @param cache_bits: the key bits a bucket of those caches spans
+///
+/// @return zero if successful, 1 if not
+///
+int serve(Trie trie, const char *socket_path, int threads,
+    size_t cache_slots, unsigned int cache_bits) {
+    struct ServeStats_s stats;
+    int ok;
+
+    // build the index now, the workers must not build it while they
+    // share the trie; without it every worker would try to
+    if(!ibt_reindex(trie)) {
+        perror("place_ip: index");
+        ibt_destroy(trie);
+        entry_locations_release();
+        return 1;
+    }
+    if(socket_path != NULL) {
+        ok = serve_socket(trie, socket_path, threads, cache_slots,
+            cache_bits, &stats);
+    }
+    else {
+        ok = serve_stream(trie, STDIN_FILENO, STDOUT_FILENO, threads,
+            cache_slots, cache_bits, &stats);
+    }
+    if(ok) {
+        report(&stats, threads);
+    }
+    else {
+        perror(socket_path != NULL ? socket_path : "place_ip");
+    }
+    ibt_destroy(trie);
+    entry_locations_release();
+    return ok ? 0 : 1;
+}
+
 ///
 /// main() takes a file, constructs the trie,
 /// the allows the user to query either integer representations
 /// or IPV4 representations of ip addresses
 ///
 /// @param argc: the number of command line arguements
-/// @param argv: the command line arguements
+/// @param argv: the command line arguements, see USAGE
 ///
 /// @return zero if successful, 1 if not
 ///
 int main(int argc, char* argv[]) {
+    const char *snapshot = NULL;
+    const char *socket_path = NULL;
+    const char *client_path = NULL;
+    const char *diff_from = NULL;
+    int pipe_mode = 0;
+    int threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    size_t queries = DEFAULT_CLIENT_QUERIES;
+    unsigned int direct_bits = 0;
+    size_t cache_slots = 0;
+    unsigned int cache_bits = 0;
+    int opt;
+    static const struct option long_options[] = {
+        { "apply-diff", required_argument, NULL, 'D' },
+        { NULL, 0, NULL, 0 }
+    };
 
-    if(argc != 2) {
-        perror("usage: place_ip filename \n");
+    while((opt = getopt_long(argc, argv, "s:d:pu:t:c:n:k:b:", long_options,
+        NULL)) != -1) {
+        switch(opt) {
+        case 'D':
+            diff_from = optarg;
+            break;
+        case 's':
+            snapshot = optarg;
+            break;
+        case 'd':
+            direct_bits = (unsigned int) strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            pipe_mode = 1;
+            break;
+        case 'u':
+            socket_path = optarg;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'c':
+            client_path = optarg;
+            break;
+        case 'n':
+            queries = (size_t) strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            cache_slots = (size_t) strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            cache_bits = (unsigned int) strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            return 1;
+        }
+    }
+    threads = (threads < 1) ? 1 : threads;
+    if(cache_bits > CACHE_MAX_BITS) {
+        fprintf(stderr, "-b: at most %d bits\n", CACHE_MAX_BITS);
         return 1;
     }
 
-    FILE *fp = fopen(argv[1], "r");
+    if(client_path != NULL) {
+        struct ServeStats_s stats;
+        if(!run_client(client_path, threads, queries, &stats)) {
+            perror(client_path);
+            return 1;
+        }
+        report(&stats, threads);
+        return 0;
+    }
+    if(optind != argc - 1 || (pipe_mode && socket_path != NULL)) {
+        fprintf(stderr, USAGE);
+        return 1;
+    }
+    const char *filename = argv[optind];
 
-    if(fp == NULL) {
-        fprintf(stderr, "%s: No such file or directory \n", argv[1]);
+    // a snapshot opens in place, anything else is parsed as CSV
+    Trie trie = NULL;
+    if(diff_from != NULL) {
+        trie = build_from_csv(diff_from, threads);
+        if(trie == NULL) {
+            return 1;
+        }
+        if(!apply_diff(trie, diff_from, filename)) {
+            ibt_destroy(trie);
+            return 1;
+        }
+    }
+    else {
+        trie = ibt_load_mapped(filename);
+    }
+    if(trie == NULL) {
+        trie = build_from_csv(filename, threads);
+        if(trie == NULL) {
+            return 1;
+        }
+    }
+    if(snapshot != NULL && !ibt_save(trie, snapshot)) {
+        perror(snapshot);
+    }
+    if(!ibt_set_direct_bits(trie, direct_bits)) {
+        fprintf(stderr, "-d: at most %d bits\n", IBT_DIRECT_MAX_BITS);
+        ibt_destroy(trie);
         return 1;
     }
+    if(pipe_mode || socket_path != NULL) {
+        return serve(trie, socket_path, threads, cache_slots, cache_bits);
+    }
 
     char *buffer;
     int bufsize = 256;
     buffer = (char*) malloc(sizeof(char) * bufsize);
-    Trie trie = ibt_create();
-    
-    if(fgets(buffer, bufsize, fp) == NULL) {
-        perror("error: empty dataset\n");
-        return 1;
-    }
-
-
-    for(;;) {
-        ibt_insert(trie, entry_create(buffer, 0));
-        ibt_insert(trie, entry_create(buffer, 1));
-        if(fgets(buffer, bufsize, fp) == NULL) {
-            break;
-        }
-    }
     printf("\n");
     ibt_update(trie);
     printf("\n");
@@ -124,6 +369,7 @@ int main(int argc, char* argv[]) {
 
     int invalid = 0;
     ikey_t key;
+    Entry found;
 
     printf("Enter an ipv4 string or a number (or a blank line to quit).\n");
     printf("> ");
@@ -132,16 +378,33 @@ int main(int argc, char* argv[]) {
         return 0;
     }
     while(strcmp(buffer, "\n") != 0) {
-        for(int i = 0; i < (int) strlen(buffer) - 1; i++) {
-            if(isalpha(buffer[i])) {
-                printf("(INVALID, -: -, -, -)\n");
-                invalid = 1;
-                break;
+        if(strcmp(buffer, "stats\n") == 0) {
+            ibt_stats_dump(trie, stdout);
+        }
+        else if(strcmp(buffer, "compact\n") == 0) {
+            if(!ibt_compact(trie)) {
+                perror("compact");
             }
+            ibt_stats_dump(trie, stdout);
         }
-        if(invalid == 0) {
-            key = convert_to_key(buffer);
-            entry_print(ibt_search(trie, key), stdout);
+        else {
+            for(int i = 0; i < (int) strlen(buffer) - 1; i++) {
+                if(isalpha(buffer[i])) {
+                    printf("(INVALID, -: -, -, -)\n");
+                    invalid = 1;
+                    break;
+                }
+            }
+            if(invalid == 0) {
+                key = convert_to_key(buffer);
+                found = ibt_search(trie, key);
+                if(found != NULL) {
+                    entry_print(found, stdout);
+                }
+                else {
+                    printf("(NOT FOUND, -: -, -, -)\n");
+                }
+            }
         }
         
         invalid = 0;
@@ -152,6 +415,8 @@ int main(int argc, char* argv[]) {
     }
     printf("\n");
     ibt_destroy(trie);
+    entry_locations_release();
+    free(buffer);
 
     return 0;
 }
@@ -0,0 +1,289 @@
+//
+// File: sarray.c
+// Sorted-array index over the leaves of the bitwise trie, searched as
+// a static B+-tree (after Khuong and Morin's array layouts for
+// comparison-based searching).
+//
+// The sorted keys are cut into blocks of BLOCK_KEYS, one cache line
+// each. Above them, each level has a block per BLOCK_KEYS blocks of
+// the level below, holding the first key of each of those blocks, up
+// to a single root block. A search counts the keys of a block that
+// are not greater than the key with vector compares (AVX2 or SSE2
+// when the compiler targets them) and goes down to the block that
+// count points at, one cache line per level.
+// // // // // // // // // // // // // // // // // // // // // // // //
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "sarray.h"
+
+/// keys in a block, filling one cache line
+#define BLOCK_KEYS 16
+
+/// bytes in a cache line; every block is aligned to one
+#define CACHE_LINE 64
+
+/// most levels an index of 2^32 keys needs
+#define MAX_LEVELS 9
+
+/// number of lookups sa_search_batch walks in lockstep
+#define BATCH 16
+
+/// pads the last block of a level; sorts after every key
+#define PAD INT32_MAX
+
+/////////////////////// struct definitions ////////////////////////////////
+
+/// A block of keys, stored with their top bit flipped so that the
+/// signed compares of the vector kernels order them as unsigned keys.
+
+struct SABlock_s {
+    int32_t keys[BLOCK_KEYS];
+};
+
+struct SArray_s {
+    struct SABlock_s *blocks;     ///< every level, the root's first
+    size_t first[MAX_LEVELS];     ///< the first block of each level
+    size_t count[MAX_LEVELS];     ///< the blocks of each level
+    size_t height;                ///< levels, the sorted keys' included
+    size_t num_blocks;
+    unsigned int *values;         ///< parallel to the sorted keys
+    size_t size;                  ///< number of keys
+};
+
+////////////////////////// Blocks //////////////////////////////////////
+
+/// Turns a key into the form blocks store it in.
+
+static int32_t biased( ikey_t key) {
+    return (int32_t) (key ^ 0x80000000u);
+}
+
+/// Counts the keys of a block that are not greater than key.
+///
+/// @param block the block, whose keys are in increasing order
+/// @param key the key, biased
+/// @return the count, 0 to BLOCK_KEYS
+
+static unsigned int count_le( const struct SABlock_s *block, int32_t key) {
+#if defined(__AVX2__)
+    __m256i k = _mm256_set1_epi32(key);
+    __m256i lo = _mm256_load_si256((const __m256i*) &block->keys[0]);
+    __m256i hi = _mm256_load_si256((const __m256i*) &block->keys[8]);
+    unsigned int greater = (unsigned int)
+        _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(lo, k))) |
+        (unsigned int) _mm256_movemask_ps(_mm256_castsi256_ps(
+        _mm256_cmpgt_epi32(hi, k))) << 8;
+    return BLOCK_KEYS - (unsigned int) __builtin_popcount(greater);
+#elif defined(__SSE2__)
+    __m128i k = _mm_set1_epi32(key);
+    unsigned int greater = 0;
+    for(int i = 0; i < BLOCK_KEYS / 4; i++) {
+        __m128i v = _mm_load_si128((const __m128i*) &block->keys[4 * i]);
+        greater |= (unsigned int) _mm_movemask_ps(
+            _mm_castsi128_ps(_mm_cmpgt_epi32(v, k))) << (4 * i);
+    }
+    return BLOCK_KEYS - (unsigned int) __builtin_popcount(greater);
+#else
+    unsigned int count = 0;
+    for(int i = 0; i < BLOCK_KEYS; i++) {
+        count += (block->keys[i] <= key);
+    }
+    return count;
+#endif
+}
+
+/// Goes down one level: from a block and the count of its keys not
+/// greater than the key, to the position of the last of them in the
+/// level below, or in the sorted keys. Past the last position there is
+/// only padding, which a search for the largest key also counts.
+///
+/// @param at the position of the block in its level
+/// @param count what count_le returned, at least 1
+/// @param below the positions the level below has
+/// @return the position in the level below
+
+static size_t descend( size_t at, unsigned int count, size_t below) {
+    size_t next = at * BLOCK_KEYS + count - 1;
+    return (next < below) ? next : below - 1;
+}
+
+////////////////////////// Building ////////////////////////////////////
+
+/// Build an index over keys sorted in strictly increasing order. The
+/// levels are sized from the bottom up and filled from the sorted keys
+/// upwards, each key of a block being the first key of a block below.
+/// @param keys the keys in order, ownership passes to the index
+/// @param values the value of each key, ownership passes to the index
+/// @param n number of keys
+/// @return the index, or NULL on allocation failure (the arrays are
+/// then freed)
+
+SArray sa_build( ikey_t *keys, unsigned int *values, size_t n) {
+    SArray sa = (SArray) calloc(1, sizeof(struct SArray_s));
+    if(sa == NULL) {
+        free(keys);
+        free(values);
+        return NULL;
+    }
+    sa->values = values;
+    sa->size = n;
+    if(n == 0) {
+        free(keys);
+        return sa;
+    }
+
+    // count the levels bottom up, then number them from the root
+    size_t counts[MAX_LEVELS];
+    size_t levels = 0;
+    size_t blocks = (n + BLOCK_KEYS - 1) / BLOCK_KEYS;
+    counts[levels++] = blocks;
+    while(blocks > 1) {
+        blocks = (blocks + BLOCK_KEYS - 1) / BLOCK_KEYS;
+        counts[levels++] = blocks;
+    }
+    sa->height = levels;
+    for(size_t l = 0; l < levels; l++) {
+        sa->count[l] = counts[levels - 1 - l];
+        sa->first[l] = sa->num_blocks;
+        sa->num_blocks += sa->count[l];
+    }
+    void *memory = NULL;
+    if(posix_memalign(&memory, CACHE_LINE,
+        sizeof(struct SABlock_s) * sa->num_blocks) != 0) {
+        free(keys);
+        sa_destroy(sa);
+        return NULL;
+    }
+    sa->blocks = (struct SABlock_s*) memory;
+
+    int32_t *leaf = sa->blocks[sa->first[levels - 1]].keys;
+    for(size_t i = 0; i < sa->count[levels - 1] * BLOCK_KEYS; i++) {
+        leaf[i] = (i < n) ? biased(keys[i]) : PAD;
+    }
+    free(keys);
+    for(size_t l = levels - 1; l > 0; l--) {
+        const struct SABlock_s *below = &sa->blocks[sa->first[l]];
+        int32_t *above = sa->blocks[sa->first[l - 1]].keys;
+        for(size_t i = 0; i < sa->count[l - 1] * BLOCK_KEYS; i++) {
+            above[i] = (i < sa->count[l]) ? below[i].keys[0] : PAD;
+        }
+    }
+    return sa;
+}
+
+/// Free the index and its arrays.
+/// @param sa the index to destroy, may be NULL
+
+void sa_destroy( SArray sa) {
+    if(sa != NULL) {
+        free(sa->blocks);
+        free(sa->values);
+        free(sa);
+    }
+}
+
+////////////////////////// Queries ////////////////////////////////////
+
+/// Find the largest key in the index that is not greater than key.
+/// @param sa the index to search
+/// @param key the key to find
+/// @return the value of the predecessor, or 0 if every key is greater
+
+unsigned int sa_search( SArray sa, ikey_t key) {
+    if(sa->size == 0) {
+        return 0;
+    }
+    int32_t k = biased(key);
+    size_t at = 0;
+    for(size_t l = 0; l < sa->height; l++) {
+        unsigned int count = count_le(&sa->blocks[sa->first[l] + at], k);
+        if(count == 0) {
+            // only the root can hold no key below key
+            return 0;
+        }
+        at = descend(at, count, (l + 1 < sa->height) ? sa->count[l + 1] :
+            sa->size);
+    }
+    return sa->values[at];
+}
+
+/// Find the predecessor of many keys at once. Up to BATCH lookups go
+/// down a level per round, and each prefetches the block it moves to,
+/// so the cache misses of one round overlap instead of following one
+/// another.
+/// @param sa the index to search
+/// @param keys the keys to find
+/// @param out receives the value of each key's predecessor, or 0
+/// @param n the number of keys
+
+void sa_search_batch( SArray sa, const ikey_t *keys, unsigned int *out,
+    size_t n) {
+    if(sa->size == 0) {
+        for(size_t i = 0; i < n; i++) {
+            out[i] = 0;
+        }
+        return;
+    }
+    for(size_t first = 0; first < n; first += BATCH) {
+        size_t lanes = (n - first < BATCH) ? n - first : BATCH;
+        int32_t key[BATCH];
+        size_t at[BATCH];
+        int found[BATCH];
+
+        for(size_t i = 0; i < lanes; i++) {
+            key[i] = biased(keys[first + i]);
+            at[i] = 0;
+            found[i] = 1;
+        }
+        for(size_t l = 0; l < sa->height; l++) {
+            size_t below = (l + 1 < sa->height) ? sa->count[l + 1] :
+                sa->size;
+            for(size_t i = 0; i < lanes; i++) {
+                unsigned int count = count_le(
+                    &sa->blocks[sa->first[l] + at[i]], key[i]);
+                found[i] &= (count != 0);
+                at[i] = (count == 0) ? 0 : descend(at[i], count, below);
+                if(l + 1 < sa->height) {
+                    __builtin_prefetch(&sa->blocks[sa->first[l + 1] + at[i]]);
+                }
+                else {
+                    __builtin_prefetch(&sa->values[at[i]]);
+                }
+            }
+        }
+        for(size_t i = 0; i < lanes; i++) {
+            out[first + i] = found[i] ? sa->values[at[i]] : 0;
+        }
+    }
+}
+
+/// get the height of the index: the blocks every lookup visits
+/// @param sa the index
+/// @return height of the index
+
+size_t sa_height( SArray sa) {
+    return sa->height;
+}
+
+/// get the number of blocks above the blocks of sorted keys
+/// @param sa the index
+/// @return the count of internal blocks
+
+size_t sa_node_count( SArray sa) {
+    return (sa->height == 0) ? 0 : sa->num_blocks - sa->count[sa->height - 1];
+}
+
+/// get the bytes the index takes: its blocks and its values
+/// @param sa the index
+/// @return the size of the index in bytes
+
+size_t sa_memory( SArray sa) {
+    return sizeof(struct SArray_s) + sizeof(struct SABlock_s) *
+        sa->num_blocks + sizeof(unsigned int) * sa->size;
+}
@@ -0,0 +1,73 @@
+//
+// File: sarray.h
+// Read-only sorted-array index over the leaves of an integer-keyed
+// trie, laid out as a static B+-tree of cache-line-sized blocks.
+// // // // // // // // // // // // // // // // // // // // // // // //
+
+#ifndef SARRAY_H
+#define SARRAY_H
+
+#include <stddef.h>
+#include "entry.h"
+
+
+/// SArray is a pointer to a read-only sorted-array index. The keys are
+/// stored in blocks of one cache line each, a level of blocks per step
+/// of the search, and each block is searched with a handful of vector
+/// compares instead of a chain of branches. The values sit in an array
+/// of their own, parallel to the sorted keys.
+
+typedef struct SArray_s * SArray;
+
+/// Build an index over keys sorted in strictly increasing order, each
+/// with a non-zero value (such as an entry id) a search hands back.
+/// @param keys the keys in order, ownership passes to the index
+/// @param values the value of each key, ownership passes to the index
+/// @param n number of keys
+/// @return the index, or NULL on allocation failure (the arrays are
+/// then freed)
+
+SArray sa_build( ikey_t *keys, unsigned int *values, size_t n);
+
+/// Free the index and its arrays.
+/// @param sa the index to destroy, may be NULL
+
+void sa_destroy( SArray sa);
+
+/// Find the largest key in the index that is not greater than key.
+/// @param sa the index to search
+/// @param key the key to find
+/// @return the value of the predecessor, or 0 if every key is greater
+
+unsigned int sa_search( SArray sa, ikey_t key);
+
+/// Find the predecessor of many keys at once, walking several lookups
+/// in lockstep so their memory accesses overlap.
+/// @param sa the index to search
+/// @param keys the keys to find
+/// @param out receives the value of each key's predecessor, or 0
+/// @param n the number of keys
+
+void sa_search_batch( SArray sa, const ikey_t *keys, unsigned int *out,
+    size_t n);
+
+/// get the height of the index: the blocks every lookup visits
+/// @param sa the index
+/// @return height of the index
+
+size_t sa_height( SArray sa);
+
+/// get the number of blocks above the blocks of sorted keys
+/// @param sa the index
+/// @return the count of internal blocks
+
+size_t sa_node_count( SArray sa);
+
+/// get the bytes the index takes: its blocks and its values
+/// @param sa the index
+/// @return the size of the index in bytes
+
+size_t sa_memory( SArray sa);
+
+
+#endif // SARRAY_H
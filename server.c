@@ -0,0 +1,965 @@
+//
+// File: server.c
+// Answers place_ip queries in bulk on a pool of worker threads that
+// share one read-only trie. Each worker collects the queries of a
+// chunk of input, searches them with ibt_search_batch and formats the
+// answers into a buffer of its own, so the threads only meet to take
+// work and to hand over finished output.
+// // // // // // // // // // // // // // // // // // // // // // // //
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "server.h"
+#include "entry.h"
+#include "cache.h"
+
+/// bytes of input a worker takes at a time, grown for longer lines
+#define CHUNK_SIZE (64 * 1024)
+
+/// queries searched with one ibt_search_batch call
+#define LINES_PER_BATCH 256
+
+/// chunks of a stream in flight per worker, bounding memory use
+#define SLOTS_PER_WORKER 4
+
+/// connections accepted but not yet taken by a worker
+#define MAX_PENDING 1024
+
+/// most worker threads a server starts
+#define MAX_WORKERS 256
+
+/// queries a client sends before it reads their answers
+#define CLIENT_BATCH 1024
+
+/// the answers to a line that is not an address, or not in the trie
+static const char INVALID[] = "(INVALID, -: -, -, -)\n";
+static const char NOT_FOUND[] = "(NOT FOUND, -: -, -, -)\n";
+
+/// the line that asks for the trie's counters instead of an address
+static const char STATS_QUERY[] = "stats";
+
+//////////////////////////// Buffers ////////////////////////////////////
+
+/// A growable run of bytes.
+
+struct Buffer_s {
+    char *data;
+    size_t size;             ///< bytes in use
+    size_t capacity;         ///< bytes allocated
+};
+
+/// Makes room for more bytes at the end of a buffer.
+///
+/// @param b the buffer
+/// @param more the number of bytes about to be added
+/// @return 1 on success, 0 if memory ran out
+
+static int buffer_reserve( struct Buffer_s *b, size_t more) {
+    if(b->size + more <= b->capacity) {
+        return 1;
+    }
+    size_t cap = b->capacity ? b->capacity * 2 : CHUNK_SIZE;
+    while(cap < b->size + more) {
+        cap *= 2;
+    }
+    char *tmp = (char*) realloc(b->data, cap);
+    if(tmp == NULL) {
+        return 0;
+    }
+    b->data = tmp;
+    b->capacity = cap;
+    return 1;
+}
+
+/// Appends bytes to a buffer; they are dropped if memory ran out.
+
+static void buffer_append( struct Buffer_s *b, const char *p, size_t n) {
+    if(n > 0 && buffer_reserve(b, n)) {
+        memcpy(b->data + b->size, p, n);
+        b->size += n;
+    }
+}
+
+/// Appends the answer line of an entry to a buffer.
+
+static void buffer_append_entry( struct Buffer_s *b, Entry e) {
+    if(!buffer_reserve(b, 256)) {
+        return;
+    }
+    int len = entry_format(e, b->data + b->size, b->capacity - b->size);
+    if(len < 0) {
+        return;
+    }
+    if((size_t) len >= b->capacity - b->size) {
+        if(!buffer_reserve(b, (size_t) len + 1)) {
+            return;
+        }
+        entry_format(e, b->data + b->size, b->capacity - b->size);
+    }
+    b->size += (size_t) len;
+}
+
+/// Appends the trie's counters to a buffer, as a line of JSON. The
+/// trie is not changed while it is served and ibt_stats_format only
+/// reads it, so workers may answer "stats" side by side.
+
+static void buffer_append_stats( struct Buffer_s *b, Trie trie) {
+    if(!buffer_reserve(b, 1024)) {
+        return;
+    }
+    int len = ibt_stats_format(trie, b->data + b->size, b->capacity - b->size);
+    if(len > 0 && (size_t) len < b->capacity - b->size) {
+        b->size += (size_t) len;
+    }
+}
+
+/// Writes all of a buffer to a file descriptor, retrying on short
+/// writes. Sockets are written without raising SIGPIPE.
+///
+/// @return 1 on success, 0 on an error (errno tells why)
+
+static int write_all( int fd, const char *p, size_t n, int is_socket) {
+    while(n > 0) {
+        ssize_t done = is_socket ? send(fd, p, n, MSG_NOSIGNAL) :
+            write(fd, p, n);
+        if(done < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        p += done;
+        n -= (size_t) done;
+    }
+    return 1;
+}
+
+/// Reads a monotonic clock.
+///
+/// @return the current time in seconds
+
+static double now( void ) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+//////////////////////////// Queries ////////////////////////////////////
+
+/// Reads a number the way atoi does, wrapping to 32 bits.
+///
+/// @param p the first character
+/// @param end the end of the text
+/// @return the number, 0 if there is none
+
+static ikey_t parse_number( const char *p, const char *end) {
+    while(p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    int negative = 0;
+    if(p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        p++;
+    }
+    ikey_t value = 0;
+    while(p < end && *p >= '0' && *p <= '9') {
+        value = value * 10 + (ikey_t) (*p - '0');
+        p++;
+    }
+    return negative ? (ikey_t) 0 - value : value;
+}
+
+/// Turns a query into a key in the notation of the interactive prompt:
+/// a dotted address such as 120.0.0.255, whose missing parts are zero,
+/// or a plain number such as 10234106.
+///
+/// @param p the first character of the query
+/// @param end the end of the query
+/// @param key receives the key
+/// @return 1 if the query is valid, 0 if it holds a letter
+
+static int parse_query( const char *p, const char *end, ikey_t *key) {
+    const char *dot = NULL;
+    for(const char *c = p; c < end; c++) {
+        if((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z')) {
+            return 0;
+        }
+        if(*c == '.' && dot == NULL) {
+            dot = c;
+        }
+    }
+    if(dot == NULL) {
+        *key = parse_number(p, end);
+        return 1;
+    }
+    // empty parts are skipped, like strtok skips repeated delimiters
+    *key = 0;
+    int shift = 24;
+    while(p < end && shift >= 0) {
+        const char *stop = memchr(p, '.', (size_t) (end - p));
+        if(stop == NULL) {
+            stop = end;
+        }
+        if(stop > p) {
+            *key |= parse_number(p, stop) << shift;
+            shift -= 8;
+        }
+        p = stop + 1;
+    }
+    return 1;
+}
+
+/// Answers every line of queries in a buffer, one answer line each.
+/// Blank lines are skipped; a last line needs no line break. A line
+/// reading "stats" is answered with the trie's counters in JSON.
+///
+/// @param trie the trie to search
+/// @param cache the worker's cache in front of trie, or NULL
+/// @param p the start of the queries
+/// @param end the end of the queries
+/// @param out the buffer the answers are appended to
+/// @return the number of queries answered
+
+static size_t answer_lines( Trie trie, Cache cache, const char *p,
+    const char *end, struct Buffer_s *out) {
+    ikey_t keys[LINES_PER_BATCH];
+    Entry found[LINES_PER_BATCH];
+    char valid[LINES_PER_BATCH];     // 1 for a key, 2 for STATS_QUERY
+    size_t answered = 0;
+
+    while(p < end) {
+        size_t lines = 0;
+        size_t num_keys = 0;
+        while(p < end && lines < LINES_PER_BATCH) {
+            const char *nl = memchr(p, '\n', (size_t) (end - p));
+            const char *stop = (nl == NULL) ? end : nl;
+            if(stop > p && stop[-1] == '\r') {
+                stop--;
+            }
+            if((size_t) (stop - p) == sizeof(STATS_QUERY) - 1 &&
+                memcmp(p, STATS_QUERY, sizeof(STATS_QUERY) - 1) == 0) {
+                valid[lines++] = 2;
+            }
+            else if(stop > p) {
+                valid[lines] = (char) parse_query(p, stop, &keys[num_keys]);
+                num_keys += (size_t) valid[lines];
+                lines++;
+            }
+            p = (nl == NULL) ? end : nl + 1;
+        }
+
+        if(cache != NULL) {
+            cache_search_batch(cache, keys, found, num_keys);
+        }
+        else {
+            ibt_search_batch(trie, keys, found, num_keys);
+        }
+        for(size_t i = 0, k = 0; i < lines; i++) {
+            if(!valid[i]) {
+                buffer_append(out, INVALID, sizeof(INVALID) - 1);
+            }
+            else if(valid[i] == 2) {
+                buffer_append_stats(out, trie);
+            }
+            else if(found[k] == NULL) {
+                buffer_append(out, NOT_FOUND, sizeof(NOT_FOUND) - 1);
+                k++;
+            }
+            else {
+                buffer_append_entry(out, found[k++]);
+            }
+        }
+        answered += lines;
+    }
+    return answered;
+}
+
+//////////////////////////// Streams ////////////////////////////////////
+
+/// the life of a chunk of a stream: read in, answered, written out
+enum { SLOT_EMPTY, SLOT_FILLED, SLOT_TAKEN, SLOT_DONE };
+
+/// A chunk of a stream and its answers.
+
+struct Slot_s {
+    int state;
+    struct Buffer_s input;   ///< whole lines of queries
+    struct Buffer_s output;  ///< their answers
+    size_t queries;
+};
+
+/// A stream being served. Chunks get consecutive sequence numbers and
+/// live in slot seq % num_slots; they are filled, taken and written
+/// strictly in sequence, but answered in any order.
+
+struct Stream_s {
+    Trie trie;
+    size_t cache_slots;      ///< entries of each worker's cache, or 0
+    unsigned int cache_bits;
+    int out;
+    struct Slot_s *slots;
+    size_t num_slots;
+    size_t next_fill;        ///< sequence number of the next chunk read
+    size_t next_take;        ///< ... taken by a worker
+    size_t next_write;       ///< ... written out
+    int eof;                 ///< no chunk will be read any more
+    int writing;             ///< a worker is writing chunks out
+    int failed;              ///< a write failed, errno is in error
+    int error;
+    size_t queries;
+    size_t cache_hits;       ///< added up as the workers finish
+    size_t cache_misses;
+    pthread_mutex_t lock;
+    pthread_cond_t work;     ///< a chunk was filled, or the input ended
+    pthread_cond_t space;    ///< a chunk was written out
+};
+
+/// Writes out the finished chunks that are next in sequence. Called
+/// with the lock held by the worker that finished a chunk; only one
+/// worker writes at a time, the others leave their chunks to it.
+///
+/// @param s the stream
+
+static void write_finished( struct Stream_s *s) {
+    if(s->writing) {
+        return;
+    }
+    s->writing = 1;
+    for(;;) {
+        struct Slot_s *slot = &s->slots[s->next_write % s->num_slots];
+        if(slot->state != SLOT_DONE) {
+            break;
+        }
+        pthread_mutex_unlock(&s->lock);
+        int ok = s->failed || write_all(s->out, slot->output.data,
+            slot->output.size, 0);
+        int error = errno;
+        pthread_mutex_lock(&s->lock);
+        if(!ok) {
+            s->failed = 1;
+            s->error = error;
+        }
+        s->queries += slot->queries;
+        slot->state = SLOT_EMPTY;
+        s->next_write++;
+        pthread_cond_signal(&s->space);
+    }
+    s->writing = 0;
+}
+
+/// Creates a worker's cache as a server was asked to.
+///
+/// @param trie the trie the worker searches
+/// @param slots the entries of the cache, 0 for none
+/// @param bits the key bits a bucket of the cache spans
+/// @return the cache, or NULL for none
+
+static Cache worker_cache( Trie trie, size_t slots, unsigned int bits) {
+    return (slots > 0) ? cache_create(trie, slots, bits) : NULL;
+}
+
+/// Adds the counts of a worker's cache to a server's.
+///
+/// @param cache the worker's cache, may be NULL
+/// @param hits the server's count of hits
+/// @param misses the server's count of misses
+
+static void add_cache_counts( Cache cache, size_t *hits, size_t *misses) {
+    if(cache != NULL) {
+        size_t h, m;
+        cache_counts(cache, &h, &m);
+        *hits += h;
+        *misses += m;
+    }
+}
+
+/// A worker of a stream: answers chunks until the input is used up.
+///
+/// @param arg the stream
+/// @return NULL
+
+static void *stream_worker( void *arg) {
+    struct Stream_s *s = (struct Stream_s*) arg;
+    Cache cache = worker_cache(s->trie, s->cache_slots, s->cache_bits);
+
+    pthread_mutex_lock(&s->lock);
+    for(;;) {
+        while(s->next_take == s->next_fill && !s->eof) {
+            pthread_cond_wait(&s->work, &s->lock);
+        }
+        if(s->next_take == s->next_fill) {
+            break;
+        }
+        struct Slot_s *slot = &s->slots[s->next_take++ % s->num_slots];
+        slot->state = SLOT_TAKEN;
+        pthread_mutex_unlock(&s->lock);
+
+        slot->output.size = 0;
+        slot->queries = answer_lines(s->trie, cache, slot->input.data,
+            slot->input.data + slot->input.size, &slot->output);
+
+        pthread_mutex_lock(&s->lock);
+        slot->state = SLOT_DONE;
+        write_finished(s);
+    }
+    add_cache_counts(cache, &s->cache_hits, &s->cache_misses);
+    pthread_mutex_unlock(&s->lock);
+    cache_destroy(cache);
+    return NULL;
+}
+
+/// Reads the next chunk of whole lines into a slot: whatever the next
+/// read brings, so that a slow writer of queries gets answers without
+/// waiting for a chunk to fill up. The part of the last line that has
+/// not arrived yet is moved into carry for the next chunk.
+///
+/// @param in the file descriptor to read
+/// @param slot the slot to fill
+/// @param carry the start of the chunk, and the rest of the input
+/// after it
+/// @return 1 if more input may follow, 0 at the end of the input, -1
+/// on a read error
+
+static int read_chunk( int in, struct Slot_s *slot, struct Buffer_s *carry) {
+    struct Buffer_s *b = &slot->input;
+    b->size = 0;
+    buffer_append(b, carry->data, carry->size);
+    carry->size = 0;
+
+    for(;;) {
+        if(!buffer_reserve(b, CHUNK_SIZE / 2)) {
+            return -1;
+        }
+        ssize_t got = read(in, b->data + b->size, b->capacity - b->size);
+        if(got < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        b->size += (size_t) got;
+        if(got == 0) {
+            return 0;
+        }
+        // keep whole lines; a line longer than the chunk grows it
+        char *last = b->data + b->size;
+        while(last > b->data && last[-1] != '\n') {
+            last--;
+        }
+        if(last > b->data) {
+            buffer_append(carry, last, (size_t) (b->data + b->size - last));
+            b->size = (size_t) (last - b->data);
+            return 1;
+        }
+    }
+}
+
+int serve_stream( Trie trie, int in, int out, int threads,
+    size_t cache_slots, unsigned int cache_bits, struct ServeStats_s *stats) {
+    struct Stream_s s;
+    pthread_t workers[MAX_WORKERS];
+    struct Buffer_s carry = { NULL, 0, 0 };
+    double start = now();
+    int read_error = 0;
+    int started = 0;
+
+    threads = (threads < 1) ? 1 : (threads > MAX_WORKERS) ? MAX_WORKERS :
+        threads;
+    memset(&s, 0, sizeof(s));
+    s.trie = trie;
+    s.cache_slots = cache_slots;
+    s.cache_bits = cache_bits;
+    s.out = out;
+    s.num_slots = (size_t) threads * SLOTS_PER_WORKER;
+    s.slots = (struct Slot_s*) calloc(s.num_slots, sizeof(struct Slot_s));
+    if(s.slots == NULL) {
+        return 0;
+    }
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.work, NULL);
+    pthread_cond_init(&s.space, NULL);
+    while(started < threads &&
+        pthread_create(&workers[started], NULL, stream_worker, &s) == 0) {
+        started++;
+    }
+
+    int more = (started > 0);
+    while(more > 0) {
+        pthread_mutex_lock(&s.lock);
+        struct Slot_s *slot = &s.slots[s.next_fill % s.num_slots];
+        while(slot->state != SLOT_EMPTY) {
+            pthread_cond_wait(&s.space, &s.lock);
+        }
+        pthread_mutex_unlock(&s.lock);
+
+        more = read_chunk(in, slot, &carry);
+        if(more < 0) {
+            read_error = errno;
+        }
+        if(slot->input.size > 0) {
+            pthread_mutex_lock(&s.lock);
+            slot->state = SLOT_FILLED;
+            s.next_fill++;
+            pthread_cond_signal(&s.work);
+            pthread_mutex_unlock(&s.lock);
+        }
+    }
+
+    pthread_mutex_lock(&s.lock);
+    s.eof = 1;
+    pthread_cond_broadcast(&s.work);
+    pthread_mutex_unlock(&s.lock);
+    for(int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    stats->queries = s.queries;
+    stats->seconds = now() - start;
+    stats->cache_hits = s.cache_hits;
+    stats->cache_misses = s.cache_misses;
+    for(size_t i = 0; i < s.num_slots; i++) {
+        free(s.slots[i].input.data);
+        free(s.slots[i].output.data);
+    }
+    free(s.slots);
+    free(carry.data);
+    pthread_mutex_destroy(&s.lock);
+    pthread_cond_destroy(&s.work);
+    pthread_cond_destroy(&s.space);
+
+    if(started == 0 || read_error != 0 || s.failed) {
+        errno = (started == 0) ? EAGAIN : read_error ? read_error : s.error;
+        return 0;
+    }
+    return 1;
+}
+
+//////////////////////////// Sockets ////////////////////////////////////
+
+/// set by SIGINT or SIGTERM to stop serve_socket
+static volatile sig_atomic_t stop_requested;
+
+static void request_stop( int signal) {
+    (void) signal;
+    stop_requested = 1;
+}
+
+/// The counters of one worker, on a cache line of their own so that
+/// workers do not slow each other down counting. The cache's are set
+/// when the worker stops.
+
+struct Counter_s {
+    size_t queries;
+    size_t cache_hits;
+    size_t cache_misses;
+    char pad[64 - 3 * sizeof(size_t)];
+};
+
+/// A socket server: accepted connections wait in a ring for a worker.
+
+struct Server_s {
+    Trie trie;
+    size_t cache_slots;      ///< entries of each worker's cache, or 0
+    unsigned int cache_bits;
+    int pending[MAX_PENDING];
+    size_t first;            ///< the oldest pending connection
+    size_t count;            ///< the number of pending connections
+    int active[MAX_WORKERS]; ///< each worker's connection, or -1
+    struct Counter_s *counters;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t work;     ///< a connection arrived, or stop was set
+};
+
+/// A worker of a socket server and what it needs to find its slot.
+
+struct Worker_s {
+    struct Server_s *server;
+    int id;
+};
+
+/// Answers the queries of one client until it closes the connection.
+/// Answers go out once per read, so a client that pipelines many
+/// queries gets their answers in a few large writes.
+///
+/// @param trie the trie to search
+/// @param cache the worker's cache in front of trie, or NULL
+/// @param fd the connection
+/// @param in the worker's input buffer
+/// @param out the worker's output buffer
+/// @param counter the worker's count of queries
+
+static void serve_connection( Trie trie, Cache cache, int fd,
+    struct Buffer_s *in, struct Buffer_s *out, size_t *counter) {
+    in->size = 0;
+    for(;;) {
+        if(!buffer_reserve(in, CHUNK_SIZE / 2)) {
+            return;
+        }
+        ssize_t got = read(fd, in->data + in->size, in->capacity - in->size);
+        if(got < 0 && errno == EINTR) {
+            continue;
+        }
+        if(got <= 0) {
+            break;
+        }
+        in->size += (size_t) got;
+
+        char *last = in->data + in->size;
+        while(last > in->data && last[-1] != '\n') {
+            last--;
+        }
+        out->size = 0;
+        size_t answered = answer_lines(trie, cache, in->data, last, out);
+        __atomic_add_fetch(counter, answered, __ATOMIC_RELAXED);
+        if(!write_all(fd, out->data, out->size, 1)) {
+            return;
+        }
+        in->size -= (size_t) (last - in->data);
+        memmove(in->data, last, in->size);
+    }
+    // a last query without a line break
+    out->size = 0;
+    size_t answered = answer_lines(trie, cache, in->data,
+        in->data + in->size, out);
+    __atomic_add_fetch(counter, answered, __ATOMIC_RELAXED);
+    write_all(fd, out->data, out->size, 1);
+}
+
+/// A worker of a socket server: serves connections one after another
+/// until the server stops.
+///
+/// @param arg the worker
+/// @return NULL
+
+static void *socket_worker( void *arg) {
+    struct Worker_s *w = (struct Worker_s*) arg;
+    struct Server_s *server = w->server;
+    struct Buffer_s in = { NULL, 0, 0 };
+    struct Buffer_s out = { NULL, 0, 0 };
+    Cache cache = worker_cache(server->trie, server->cache_slots,
+        server->cache_bits);
+
+    for(;;) {
+        pthread_mutex_lock(&server->lock);
+        while(server->count == 0 && !server->stop) {
+            pthread_cond_wait(&server->work, &server->lock);
+        }
+        if(server->stop) {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+        int fd = server->pending[server->first];
+        server->first = (server->first + 1) % MAX_PENDING;
+        server->count--;
+        server->active[w->id] = fd;
+        pthread_mutex_unlock(&server->lock);
+
+        serve_connection(server->trie, cache, fd, &in, &out,
+            &server->counters[w->id].queries);
+
+        pthread_mutex_lock(&server->lock);
+        server->active[w->id] = -1;
+        pthread_mutex_unlock(&server->lock);
+        close(fd);
+    }
+    add_cache_counts(cache, &server->counters[w->id].cache_hits,
+        &server->counters[w->id].cache_misses);
+    cache_destroy(cache);
+    free(in.data);
+    free(out.data);
+    return NULL;
+}
+
+/// Adds up the queries the workers of a server have answered.
+
+static size_t count_queries( struct Server_s *server, int threads) {
+    size_t total = 0;
+    for(int i = 0; i < threads; i++) {
+        total += __atomic_load_n(&server->counters[i].queries,
+            __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+/// Creates a listening Unix domain socket, replacing a stale socket
+/// left at path.
+///
+/// @return the socket, or -1 on failure (errno tells why)
+
+static int listen_at( const char *path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if(stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        return -1;
+    }
+    if(bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ||
+        listen(fd, 128) != 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+int serve_socket( Trie trie, const char *path, int threads,
+    size_t cache_slots, unsigned int cache_bits, struct ServeStats_s *stats) {
+    struct Server_s server;
+    struct Worker_s workers[MAX_WORKERS];
+    pthread_t ids[MAX_WORKERS];
+    void *counters = NULL;
+
+    threads = (threads < 1) ? 1 : (threads > MAX_WORKERS) ? MAX_WORKERS :
+        threads;
+    int listener = listen_at(path);
+    if(listener < 0) {
+        return 0;
+    }
+    if(posix_memalign(&counters, 64,
+        sizeof(struct Counter_s) * (size_t) threads) != 0) {
+        close(listener);
+        errno = ENOMEM;
+        return 0;
+    }
+    memset(counters, 0, sizeof(struct Counter_s) * (size_t) threads);
+    memset(&server, 0, sizeof(server));
+    server.trie = trie;
+    server.cache_slots = cache_slots;
+    server.cache_bits = cache_bits;
+    server.counters = (struct Counter_s*) counters;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.work, NULL);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigemptyset(&action.sa_mask);
+    stop_requested = 0;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    int started = 0;
+    for(; started < threads; started++) {
+        workers[started].server = &server;
+        workers[started].id = started;
+        server.active[started] = -1;
+        if(pthread_create(&ids[started], NULL, socket_worker,
+            &workers[started]) != 0) {
+            break;
+        }
+    }
+
+    double start = now();
+    double last_report = start;
+    size_t last_queries = 0;
+    while(!stop_requested && started > 0) {
+        struct pollfd p = { listener, POLLIN, 0 };
+        if(poll(&p, 1, 1000) > 0) {
+            int fd = accept(listener, NULL, NULL);
+            if(fd >= 0) {
+                pthread_mutex_lock(&server.lock);
+                if(server.count < MAX_PENDING) {
+                    server.pending[(server.first + server.count++) %
+                        MAX_PENDING] = fd;
+                    pthread_cond_signal(&server.work);
+                    fd = -1;
+                }
+                pthread_mutex_unlock(&server.lock);
+                if(fd >= 0) {
+                    close(fd);
+                }
+            }
+        }
+        double t = now();
+        if(t - last_report >= 1.0) {
+            size_t queries = count_queries(&server, started);
+            if(queries != last_queries) {
+                fprintf(stderr, "%.0f queries/s\n",
+                    (double) (queries - last_queries) / (t - last_report));
+            }
+            last_queries = queries;
+            last_report = t;
+        }
+    }
+
+    // wake the workers, cutting short the connections they serve
+    pthread_mutex_lock(&server.lock);
+    server.stop = 1;
+    for(int i = 0; i < started; i++) {
+        if(server.active[i] >= 0) {
+            shutdown(server.active[i], SHUT_RDWR);
+        }
+    }
+    pthread_cond_broadcast(&server.work);
+    pthread_mutex_unlock(&server.lock);
+    for(int i = 0; i < started; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    for(size_t i = 0; i < server.count; i++) {
+        close(server.pending[(server.first + i) % MAX_PENDING]);
+    }
+
+    stats->queries = count_queries(&server, started);
+    stats->seconds = now() - start;
+    stats->cache_hits = stats->cache_misses = 0;
+    for(int i = 0; i < started; i++) {
+        stats->cache_hits += server.counters[i].cache_hits;
+        stats->cache_misses += server.counters[i].cache_misses;
+    }
+    close(listener);
+    unlink(path);
+    free(counters);
+    pthread_mutex_destroy(&server.lock);
+    pthread_cond_destroy(&server.work);
+    if(started == 0) {
+        errno = EAGAIN;
+        return 0;
+    }
+    return 1;
+}
+
+//////////////////////////// Client ////////////////////////////////////
+
+/// One connection of the client and what it got done.
+
+struct Client_s {
+    const char *path;
+    size_t queries;          ///< queries to send
+    size_t answered;         ///< answer lines received
+    unsigned int seed;
+    int error;               ///< errno of a failure, 0 if none
+};
+
+/// Sends a connection's queries in batches, reading the answers to
+/// each batch before sending the next.
+///
+/// @param arg the connection
+/// @return NULL
+
+static void *client_thread( void *arg) {
+    struct Client_s *c = (struct Client_s*) arg;
+    struct sockaddr_un addr;
+    struct Buffer_s queries = { NULL, 0, 0 };
+    char answers[CHUNK_SIZE];
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, c->path, sizeof(addr.sun_path) - 1);
+    if(fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        c->error = errno;
+        if(fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    ikey_t x = c->seed ? c->seed : 1;
+    for(size_t sent = 0; sent < c->queries; ) {
+        size_t batch = c->queries - sent;
+        batch = (batch < CLIENT_BATCH) ? batch : CLIENT_BATCH;
+        queries.size = 0;
+        for(size_t i = 0; i < batch; i++) {
+            char line[20];
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            int len = snprintf(line, sizeof(line), "%u.%u.%u.%u\n",
+                x >> 24, (x >> 16) & 0xFF, (x >> 8) & 0xFF, x & 0xFF);
+            buffer_append(&queries, line, (size_t) len);
+        }
+        if(!write_all(fd, queries.data, queries.size, 1)) {
+            c->error = errno;
+            break;
+        }
+        sent += batch;
+
+        size_t lines = 0;
+        while(lines < batch) {
+            ssize_t got = read(fd, answers, sizeof(answers));
+            if(got < 0 && errno == EINTR) {
+                continue;
+            }
+            if(got <= 0) {
+                c->error = (got == 0) ? ECONNRESET : errno;
+                break;
+            }
+            for(const char *p = answers; (p = memchr(p, '\n',
+                (size_t) (answers + got - p))) != NULL; p++) {
+                lines++;
+            }
+        }
+        c->answered += lines;
+        if(c->error != 0) {
+            break;
+        }
+    }
+    close(fd);
+    free(queries.data);
+    return NULL;
+}
+
+int run_client( const char *path, int connections, size_t queries,
+    struct ServeStats_s *stats) {
+    struct Client_s clients[MAX_WORKERS];
+    pthread_t ids[MAX_WORKERS];
+    int error = 0;
+
+    connections = (connections < 1) ? 1 :
+        (connections > MAX_WORKERS) ? MAX_WORKERS : connections;
+    double start = now();
+    int started = 0;
+    for(; started < connections; started++) {
+        struct Client_s *c = &clients[started];
+        c->path = path;
+        c->queries = queries / (size_t) connections +
+            ((size_t) started < queries % (size_t) connections);
+        c->answered = 0;
+        c->seed = 2463534242u + (unsigned int) started * 7919u;
+        c->error = 0;
+        if(pthread_create(&ids[started], NULL, client_thread, c) != 0) {
+            error = EAGAIN;
+            break;
+        }
+    }
+
+    stats->queries = 0;
+    stats->cache_hits = stats->cache_misses = 0;
+    for(int i = 0; i < started; i++) {
+        pthread_join(ids[i], NULL);
+        stats->queries += clients[i].answered;
+        if(clients[i].error != 0) {
+            error = clients[i].error;
+        }
+    }
+    stats->seconds = now() - start;
+    if(error != 0) {
+        errno = error;
+        return 0;
+    }
+    return 1;
+}
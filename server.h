@@ -0,0 +1,72 @@
+//
+// File: server.h
+// Answers place_ip queries in bulk on many threads, from a pipe on
+// standard input or from clients of a Unix domain socket, and a client
+// that puts load on such a socket.
+// // // // // // // // // // // // // // // // // // // // // // // //
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+#include "trie.h"
+
+
+/// What a server or client got done, for reporting throughput.
+
+struct ServeStats_s {
+    size_t queries;          ///< queries answered
+    double seconds;          ///< wall-clock time it took
+    size_t cache_hits;       ///< lookups the workers' caches answered
+    size_t cache_misses;     ///< lookups they passed on to the trie
+};
+
+/// Answer the newline-delimited queries read from in, one line each on
+/// out and in the same order. The input is cut into chunks that a pool
+/// of worker threads answer side by side; each worker formats a whole
+/// chunk before it is written. Queries use the notation of the
+/// interactive prompt; blank lines are skipped, and a line reading
+/// "stats" is answered with ibt_stats_format. Each worker may look
+/// keys up in a cache of its own first, see cache_create.
+/// @param trie the trie to search, not changed while serving
+/// @param in the file descriptor to read queries from
+/// @param out the file descriptor to write answers to
+/// @param threads the number of worker threads
+/// @param cache_slots the entries of each worker's cache, 0 for none
+/// @param cache_bits the key bits a bucket of those caches spans
+/// @param stats receives the number of queries and the time taken
+/// @return 1 on success, 0 on a read or write error (errno tells why)
+
+int serve_stream( Trie trie, int in, int out, int threads,
+    size_t cache_slots, unsigned int cache_bits, struct ServeStats_s *stats);
+
+/// Listen on a Unix domain socket and answer newline-delimited queries
+/// from each client, in order and as serve_stream does, until SIGINT or
+/// SIGTERM. Connections are
+/// handed to a pool of worker threads; the queries answered per second
+/// are reported on stderr while it runs.
+/// @param trie the trie to search, not changed while serving
+/// @param path where to create the socket
+/// @param threads the number of worker threads
+/// @param cache_slots the entries of each worker's cache, 0 for none
+/// @param cache_bits the key bits a bucket of those caches spans
+/// @param stats receives the number of queries and the time taken
+/// @return 1 on success, 0 if the socket could not be set up (errno
+/// tells why)
+
+int serve_socket( Trie trie, const char *path, int threads,
+    size_t cache_slots, unsigned int cache_bits, struct ServeStats_s *stats);
+
+/// Send random addresses to a server over several connections at once,
+/// each pipelining its queries in batches, and wait for every answer.
+/// @param path the server's socket
+/// @param connections the number of connections, one thread each
+/// @param queries the total number of queries to send
+/// @param stats receives the number of answers and the time taken
+/// @return 1 on success, 0 if a connection failed (errno tells why)
+
+int run_client( const char *path, int connections, size_t queries,
+    struct ServeStats_s *stats);
+
+
+#endif // SERVER_H
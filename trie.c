@@ -5,11 +5,21 @@
 // @author Connor McRoberts cjm6653@rit.edu
 // // // // // // // // // // // // // // // // // // // // // // // // 
 
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "trie.h"
 #include "entry.h"
+#include "lctrie.h"
+#include "sarray.h"
 
 #define IS_BIT_SET(BF, N) ((BF >> N) & 0x1)
 #define MAX(x,y) ((x>y) ? x:y)
@@ -21,96 +31,635 @@ const size_t BITSPERWORD = 31;        ///< number of bits in a word
 const size_t BYTESPERWORD = 4;       ///< number of bytes in a word
 const size_t RADIX = 4294967295;    ///< number of possible key values
 
+/// index of a node inside its trie's node pool
+typedef unsigned int nidx_t;
+
+/// index of an entry inside its trie's entry pool
+typedef unsigned int eidx_t;
+
+/// index 0 of either pool is never handed out, so it plays the part
+/// of NULL
+#define NIL 0
+
+/// number of depths a node can be at: the root is at depth 0, and a
+/// leaf below the last key bit at depth 32
+#define DEPTHS IBT_DEPTHS
+
+/// most nodes a single insert can add: a chain of one-child nodes
+/// down to the last bit plus the two leaves below it
+#define INSERT_NODES 34
+
+/// number of keys ibt_search_batch hands the engine at a time
+#define BATCH_CHUNK 256
+
+/// first bytes of a snapshot file, and the layout version it follows
+#define SNAPSHOT_MAGIC "IBTSNAP"
+#define SNAPSHOT_VERSION 4
+
+/// written as is, so a snapshot from a machine of the other byte order
+/// reads back differently and is rejected
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+
+/// every section of a snapshot starts at a multiple of this many bytes
+#define SNAPSHOT_ALIGN 64
+
+/// most threads that can search a shared trie at the same time
+#define MAX_READERS 128
+
+/// bytes in a cache line; each reader slot gets a line to itself
+#define CACHE_LINE 64
+
+/// most threads ibt_build_parallel builds with
+#define MAX_BUILDERS 256
+
+/// fewest entries per thread for which ibt_build_parallel starts
+/// threads rather than calling ibt_build_bulk
+#define BUILD_MIN_PER_THREAD 16384
+
+/// most top key bits ibt_build_parallel partitions the entries by
+#define MAX_PARTITION_BITS 12
+
 typedef
 struct Node_s {
-    //TODO define Node_s data members
-    struct Node_s *left_child;
-    Entry value;
-    struct Node_s *right_child;
+    nidx_t left_child;
+    nidx_t right_child;
+    eidx_t value;
 } * Node;
 
 
-typedef Node * NodeH;  
-
 struct Trie_s {
     size_t height;
     size_t num_leaf_nodes;
     size_t num_nodes_total;
-    NodeH head;
+    size_t leaves_at_depth[DEPTHS];     ///< kept up to date by every change
+    size_t internal_at_depth[DEPTHS];   ///< ... as are these and the above
+    struct Node_s *pool;     ///< every node of the trie, addressed by index
+    nidx_t pool_size;        ///< slots of pool in use, including NIL
+    nidx_t pool_capacity;    ///< slots of pool allocated
+    nidx_t root;
+    struct Entry_s *entries; ///< every entry of the trie, addressed by index
+    eidx_t num_entries;      ///< slots of entries in use, including NIL
+    eidx_t entries_capacity; ///< slots of entries allocated
+    Engine engine;
+    LCTrie lc;               ///< level-compressed index over the leaves
+    SArray sorted;           ///< sorted-array index over the leaves
+    int lc_stale;            ///< set when the engine's index, lc or
+                             ///< sorted, no longer matches the nodes
+    void *mapping;           ///< snapshot the pools may point into
+    size_t mapping_size;
+    nidx_t free_nodes;       ///< released nodes, linked by left_child
+    eidx_t free_entries;     ///< released entries, linked by key
+    struct Shared_s *shared; ///< set once readers may run concurrently
+    nidx_t prefix_root;      ///< trie of prefixes, see ibt_insert_prefix
+    size_t num_prefixes;
+    unsigned int direct_bits;    ///< key bits the direct table covers, or 0
+    struct Direct_s *direct;     ///< table in front of the nodes, or NULL
+    int direct_stale;            ///< set when direct no longer matches
+    struct Stats_s stats;        ///< kept with IBT_STATS, see STATS_ADD
+    unsigned long generation;    ///< odd while a change is in progress,
+                                 ///< see begin_change
+};
+
+/// One slot of the direct table: what the trie holds under one value
+/// of the top bits of a key. At most one of node and value is set.
+
+struct DirSlot_s {
+    nidx_t node;             ///< body node the rest of the key is
+                             ///< searched from
+    eidx_t value;            ///< the only entry under the slot
+    eidx_t carry;            ///< the entry with the largest key below
+                             ///< the slot, or NIL
+};
+
+/// A flat table indexed by the top bits of a key, so that a lookup
+/// lands on the node at that depth, or on the answer, in one step.
+
+struct Direct_s {
+    unsigned int bits;       ///< key bits indexing the slots
+    struct DirSlot_s slots[];
+};
+
+/// What readers of a shared trie search: the pools and root as the
+/// writer last published them. Nothing a version reaches is changed
+/// until no reader can still be using it.
+
+struct Version_s {
+    struct Node_s *pool;
+    struct Entry_s *entries;
+    nidx_t root;
+    nidx_t prefix_root;
+    LCTrie lc;               ///< index over this version, or NULL
+    SArray sorted;           ///< sorted array over this version, or NULL
+    struct Direct_s *direct; ///< direct table over this version, or NULL
+};
+
+/// A reader thread's slot. epoch is the epoch it entered its read
+/// section in, 0 while it is outside one.
+
+struct Reader_s {
+    unsigned long epoch;
+    Trie trie;
+    int in_use;
+    char pad[CACHE_LINE - sizeof(unsigned long) - sizeof(Trie) -
+        sizeof(int)];
+};
+
+/// The kinds of storage a writer retires.
+
+enum {
+    RETIRED_NODE,            ///< a slot of the node pool
+    RETIRED_ENTRY,           ///< a slot of the entry pool
+    RETIRED_MEMORY,          ///< a block to free
+    RETIRED_INDEX,           ///< a level-compressed index to destroy
+    RETIRED_SORTED           ///< a sorted-array index to destroy
+};
+
+/// Storage the writer no longer reaches but a reader still might.
+
+struct Retired_s {
+    unsigned long epoch;     ///< first epoch that cannot reach it, or 0
+                             ///< until the version dropping it is out
+    int kind;
+    unsigned int index;      ///< the slot of a node or entry
+    void *memory;            ///< the block or index
+};
+
+/// The state of a trie shared between one writer and many readers.
+/// Readers announce the epoch they enter in; storage retired in a
+/// later epoch is only reused once every announcement is past it.
+
+struct Shared_s {
+    struct Version_s *current;
+    unsigned long epoch;
+    struct Reader_s *readers;    ///< MAX_READERS slots
+    struct Retired_s *retired;   ///< in the order it was retired
+    size_t num_retired;
+    size_t retired_capacity;
+};
+
+/// The arrays of a snapshot, in file order.
+
+enum {
+    SEC_NODES,
+    SEC_ENTRIES,
+    SEC_LC_NODES,
+    SEC_LC_KEYS,
+    SEC_LC_VALUES,
+    SEC_LOC_RECORDS,
+    SEC_LOC_BLOB,
+    NUM_SECTIONS
+};
+
+/// The header at the start of a snapshot file. Sections are located by
+/// their offset from the start of the file, so the file can be mapped
+/// at any address and used in place.
+
+struct Snapshot_s {
+    char magic[8];           ///< SNAPSHOT_MAGIC
+    uint32_t version;        ///< SNAPSHOT_VERSION
+    uint32_t byte_order;     ///< SNAPSHOT_BYTE_ORDER
+    uint32_t engine;
+    uint32_t root;
+    uint32_t prefix_root;
+    uint32_t free_nodes;     ///< first released node, see Trie_s
+    uint32_t free_entries;   ///< first released entry, see Trie_s
+    uint32_t unused;         ///< zero
+    uint64_t num_prefixes;
+    uint64_t lc_height;
+    uint64_t lc_internal;
+    uint64_t leaves_at_depth[DEPTHS];
+    uint64_t internal_at_depth[DEPTHS];
+    struct {
+        uint64_t offset;     ///< bytes from the start of the file
+        uint64_t count;      ///< number of elements
+        uint64_t size;       ///< bytes per element
+    } section[NUM_SECTIONS];
+};
+
+/// A position in an in-order walk over the leaves: the subtries still
+/// to be visited, the one whose keys come first on top. The pools are
+/// those of the version the walk started on.
+
+struct Iter_s {
+    Trie trie;
+    const struct Node_s *pool;
+    struct Entry_s *entries;
+    nidx_t stack[DEPTHS + 1];
+    size_t top;
 };
 
+#ifdef IBT_STATS
+
+/// The nodes this thread's lookup walked so far. The walks take pools
+/// rather than a trie, so they count here and the search adds the
+/// tally to its trie once it is done.
+
+static __thread struct {
+    size_t visited;
+    size_t backtracks;
+} walk;
+
+/// adds n to a counter of the trie; readers of a shared trie count
+/// at the same time as each other
+#define STATS_ADD(trie, field, n) \
+    ((void) __atomic_fetch_add(&(trie)->stats.field, (size_t) (n), \
+    __ATOMIC_RELAXED))
+
+/// adds n to a counter of the current walk
+#define WALK_ADD(field, n) (walk.field += (size_t) (n))
+
+/// starts the tally of a lookup
+#define WALK_BEGIN() (walk.visited = walk.backtracks = 0)
+
+/// adds the tally of count lookups to the trie's counters
+#define WALK_END(trie, count) do { \
+        STATS_ADD(trie, searches, count); \
+        STATS_ADD(trie, nodes_visited, walk.visited); \
+        STATS_ADD(trie, backtracks, walk.backtracks); \
+    } while(0)
+
+#else
+
+#define STATS_ADD(trie, field, n) ((void) 0)
+#define WALK_ADD(field, n) ((void) 0)
+#define WALK_BEGIN() ((void) 0)
+#define WALK_END(trie, count) ((void) 0)
+
+#endif
+
+/// the node stored at index i of the trie's pool
+#define NODE(trie, i) (&(trie)->pool[i])
+
+/// the entry stored at index i of the trie's entry pool
+#define ENTRY(trie, i) (&(trie)->entries[i])
+
+/// whether p points into the snapshot the trie was loaded from
+#define IS_MAPPED(trie, p) ((trie)->mapping != NULL && \
+    (const char*) (p) >= (const char*) (trie)->mapping && \
+    (const char*) (p) < (const char*) (trie)->mapping + (trie)->mapping_size)
+
+static void retire(Trie trie, int kind, unsigned int index, void *memory);
+
+/// Tells the caches in front of the trie, see ibt_generation, that the
+/// entries they hold may change or move: the generation is odd until
+/// end_change. Called before a change starts, so a reader of a shared
+/// trie that reads the same even generation before and after a search
+/// searched the version published under that generation.
+///
+/// @param trie the trie about to change
+
+static void begin_change(Trie trie) {
+    __atomic_add_fetch(&trie->generation, 1, __ATOMIC_SEQ_CST);
+}
+
+/// Ends a change begun with begin_change, once its version (if any) is
+/// published or the change failed: the generation is even again.
+///
+/// @param trie the trie that changed
+
+static void end_change(Trie trie) {
+    __atomic_add_fetch(&trie->generation, 1, __ATOMIC_SEQ_CST);
+}
+
+/// Grows an array like realloc, except that an array borrowed from a
+/// snapshot, or one readers of a shared trie may be searching, is
+/// copied instead of being reallocated.
+///
+/// @param trie the trie the array belongs to
+/// @param p the array
+/// @param used the bytes of p in use
+/// @param size the bytes wanted
+/// @return the grown array, or NULL if memory ran out
+
+static void *grow_array(Trie trie, void *p, size_t used, size_t size) {
+    STATS_ADD(trie, bytes_allocated, size);
+    if(!IS_MAPPED(trie, p) && trie->shared == NULL) {
+        return realloc(p, size);
+    }
+    void *tmp = malloc(size);
+    if(tmp == NULL || p == NULL) {
+        return tmp;
+    }
+    memcpy(tmp, p, used);
+    if(!IS_MAPPED(trie, p)) {
+        retire(trie, RETIRED_MEMORY, 0, p);
+    }
+    return tmp;
+}
+
 ////////////////////// Functions of Nodes ////////////////////////////////
 
-/// Creates a dynamically allocated node
-/// @param e The entry which will be the new nodes value.
+/// Keeps the shape counters up to date as a node appears at, or goes
+/// from, the depth where bit index of a key is observed.
+///
+/// @param trie the trie that owns the node
+/// @param index the bit observed at the node's depth
+/// @param leaf whether the node is a leaf or a body node
+/// @param delta 1 for a node that appears, -1 for one that goes
+
+static void count_node(Trie trie, int index, int leaf, int delta) {
+    size_t depth = (size_t) ((int) BITSPERWORD - index);
+    if(leaf) {
+        trie->leaves_at_depth[depth] += (size_t) delta;
+        trie->num_leaf_nodes += (size_t) delta;
+    }
+    else {
+        trie->internal_at_depth[depth] += (size_t) delta;
+        trie->num_nodes_total += (size_t) delta;
+    }
+}
+
+/// Makes room in the pool for count more nodes, so that node
+/// pointers stay valid while those nodes are created.
+///
+/// @param trie the trie whose pool grows
+/// @param count the number of nodes about to be created
+/// @return 1 on success, 0 if the pool could not grow
+
+int reserve_nodes(Trie trie, size_t count) {
+    if(trie->pool_size + count <= trie->pool_capacity) {
+        return 1;
+    }
+    size_t cap = MAX((size_t) trie->pool_capacity * 2,
+        trie->pool_size + count);
+    if(cap > (nidx_t) -1) {
+        return 0;
+    }
+    Node tmp = (Node) grow_array(trie, trie->pool,
+        sizeof(struct Node_s) * trie->pool_size, sizeof(struct Node_s) * cap);
+    if(tmp == NULL) {
+        return 0;
+    }
+    trie->pool = tmp;
+    trie->pool_capacity = (nidx_t) cap;
+    return 1;
+}
+
+/// Makes room in the entry pool for count more entries.
+///
+/// @param trie the trie whose entry pool grows
+/// @param count the number of entries about to be stored
+/// @return 1 on success, 0 if the pool could not grow
+
+int reserve_entries(Trie trie, size_t count) {
+    if(trie->num_entries + count <= trie->entries_capacity) {
+        return 1;
+    }
+    size_t cap = MAX((size_t) trie->entries_capacity * 2, 16);
+    cap = MAX(cap, trie->num_entries + count);
+    if(cap > (eidx_t) -1) {
+        return 0;
+    }
+    Entry tmp = (Entry) grow_array(trie, trie->entries,
+        sizeof(struct Entry_s) * trie->num_entries,
+        sizeof(struct Entry_s) * cap);
+    if(tmp == NULL) {
+        return 0;
+    }
+    trie->entries = tmp;
+    trie->entries_capacity = (eidx_t) cap;
+    return 1;
+}
+
+/// Copies an entry into the entry pool. Room must have been made
+/// beforehand with reserve_entries.
+///
+/// @param trie the trie that owns the entry pool
+/// @param e the entry to be copied
+/// @return the index of the copy
+
+eidx_t store_entry(Trie trie, Entry e) {
+    eidx_t i = trie->free_entries;
+    if(i != NIL) {
+        trie->free_entries = ENTRY(trie, i)->key;
+    }
+    else {
+        i = trie->num_entries++;
+    }
+    STATS_ADD(trie, entries_copied, 1);
+    *ENTRY(trie, i) = *e;
+    return i;
+}
 
-Node create_node(Entry e) {
+/// Takes the next node out of the pool. Room must have been made
+/// beforehand with reserve_nodes.
+///
+/// @param trie the trie that owns the node
+/// @param e The index of the entry which will be the new nodes value.
+/// @return the index of the new node
 
-    Node tmp = (Node) malloc(sizeof(struct Node_s));
+nidx_t create_node(Trie trie, eidx_t e) {
+    nidx_t i = trie->free_nodes;
+    if(i != NIL) {
+        trie->free_nodes = NODE(trie, i)->left_child;
+    }
+    else {
+        i = trie->pool_size++;
+    }
+    Node tmp = NODE(trie, i);
 
     tmp->value = e;
-    tmp->left_child = NULL;
-    tmp->right_child = NULL;
+    tmp->left_child = NIL;
+    tmp->right_child = NIL;
 
-    return tmp;
+    return i;
+}
+
+/// Releases the node pool and the entry pool in one go; nodes are
+/// not visited in tree order.
+///
+/// @param trie the trie whose nodes are destroyed
+
+void destroy_nodes( Trie trie) {
+    if(!IS_MAPPED(trie, trie->pool)) {
+        free(trie->pool);
+    }
+    if(!IS_MAPPED(trie, trie->entries)) {
+        free(trie->entries);
+    }
+    trie->pool = NULL;
+    trie->entries = NULL;
+    trie->pool_size = trie->pool_capacity = 0;
+    trie->num_entries = trie->entries_capacity = 0;
+}
+
+////////////////////////// Reclamation ////////////////////////////////
+
+/// Frees retired storage, or puts a node or entry slot back in its
+/// pool for reuse.
+///
+/// @param trie the trie the storage belonged to
+/// @param kind what the storage is
+/// @param index the slot of a node or entry
+/// @param memory the block or index
+
+static void release(Trie trie, int kind, unsigned int index, void *memory) {
+    switch(kind) {
+    case RETIRED_NODE:
+        NODE(trie, index)->left_child = trie->free_nodes;
+        trie->free_nodes = index;
+        break;
+    case RETIRED_ENTRY:
+        ENTRY(trie, index)->key = trie->free_entries;
+        trie->free_entries = index;
+        break;
+    case RETIRED_MEMORY:
+        free(memory);
+        break;
+    case RETIRED_INDEX:
+        lc_destroy((LCTrie) memory);
+        break;
+    case RETIRED_SORTED:
+        sa_destroy((SArray) memory);
+        break;
+    }
 }
 
-/// Destroys and frees all nodes + entries within the trie
-/// uses the head as a point of access, traverses in order from there.
+/// Hands storage the writer has stopped using over for reuse. In a
+/// shared trie it waits until no reader can reach it any more; storage
+/// that cannot be queued for lack of memory is leaked, never reused
+/// early.
 ///
-/// @param n the head node of the trie to be destroyed 
+/// @param trie the trie the storage belongs to
+/// @param kind what the storage is
+/// @param index the slot of a node or entry
+/// @param memory the block or index
 
-void destroy_nodes( Node n) {
-    if(n == NULL) {
+static void retire(Trie trie, int kind, unsigned int index, void *memory) {
+    struct Shared_s *shared = trie->shared;
+    if(shared == NULL) {
+        release(trie, kind, index, memory);
         return;
     }
-    destroy_nodes(n->left_child);
-    destroy_nodes(n->right_child);
+    if(shared->num_retired == shared->retired_capacity) {
+        size_t cap = shared->retired_capacity ?
+            shared->retired_capacity * 2 : 256;
+        struct Retired_s *tmp = (struct Retired_s*) realloc(shared->retired,
+            sizeof(struct Retired_s) * cap);
+        if(tmp == NULL) {
+            return;
+        }
+        shared->retired = tmp;
+        shared->retired_capacity = cap;
+    }
+    struct Retired_s *r = &shared->retired[shared->num_retired++];
+    r->epoch = 0;
+    r->kind = kind;
+    r->index = index;
+    r->memory = memory;
+}
+
+/// Releases the retired storage that every reader is past: storage
+/// retired in epoch t is unreachable to a reader that entered in epoch
+/// t or later.
+///
+/// @param trie a shared trie
+
+static void reclaim(Trie trie) {
+    struct Shared_s *shared = trie->shared;
+    unsigned long oldest = __atomic_load_n(&shared->epoch, __ATOMIC_SEQ_CST);
+
+    for(size_t i = 0; i < MAX_READERS; i++) {
+        unsigned long epoch = __atomic_load_n(&shared->readers[i].epoch,
+            __ATOMIC_SEQ_CST);
+        if(epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    size_t kept = 0;
+    for(size_t i = 0; i < shared->num_retired; i++) {
+        struct Retired_s *r = &shared->retired[i];
+        if(r->epoch != 0 && r->epoch <= oldest) {
+            release(trie, r->kind, r->index, r->memory);
+        }
+        else {
+            shared->retired[kept++] = *r;
+        }
+    }
+    shared->num_retired = kept;
+}
+
+/// Makes the writer's pools and root what readers search from now on,
+/// then starts a new epoch for the storage retired since the last
+/// version. The version is allocated by the caller before it changes
+/// anything, so publishing cannot fail halfway.
+///
+/// @param trie a shared trie
+/// @param next the version to fill in and publish
+
+static void publish(Trie trie, struct Version_s *next) {
+    struct Shared_s *shared = trie->shared;
+    next->pool = trie->pool;
+    next->entries = trie->entries;
+    next->root = trie->root;
+    next->prefix_root = trie->prefix_root;
+    next->lc = (trie->engine == IBT_LC && !trie->lc_stale) ? trie->lc : NULL;
+    next->sorted = (trie->engine == IBT_SORTED && !trie->lc_stale) ?
+        trie->sorted : NULL;
+    next->direct = (trie->direct_bits != 0 && !trie->direct_stale) ?
+        trie->direct : NULL;
 
-    entry_destroy(n->value);
-    free(n);
+    struct Version_s *old = __atomic_exchange_n(&shared->current, next,
+        __ATOMIC_SEQ_CST);
+    if(old != NULL) {
+        retire(trie, RETIRED_MEMORY, 0, old);
+    }
+    unsigned long epoch = __atomic_add_fetch(&shared->epoch, 1,
+        __ATOMIC_SEQ_CST);
+    for(size_t i = shared->num_retired; i > 0; i--) {
+        if(shared->retired[i - 1].epoch != 0) {
+            break;
+        }
+        shared->retired[i - 1].epoch = epoch;
+    }
+    reclaim(trie);
 }
 
 ///
 /// Traverses the trie with two entries, obersing their bits to 
-/// see where to insert them.
+/// see where to insert them: a chain of body nodes down to the first
+/// bit the keys differ in, and a leaf for each below it.
 ///
-/// @param head a pointer to a pointer to an instance of Node_s
-/// @param e1 the first entry to be inserted
-/// @param e2 the second entry to be inserted 
+/// @param trie the trie that owns the nodes
+/// @param head the node the two entries collided at
+/// @param e1 the index of the first entry to be inserted
+/// @param e2 the index of the second entry to be inserted 
 /// @param index which bit will be observed in both entries.
 ///
 
-void node_insert_w2(NodeH head, Entry e1, Entry e2, int index) {
-    
-    if(IS_BIT_SET(e1->key, index) != IS_BIT_SET(e2->key, index)) {
-        if(IS_BIT_SET(e1->key, index)) {
-            (*head)->right_child = create_node(e1);
-            (*head)->left_child = create_node(e2);
+void node_insert_w2(Trie trie, nidx_t head, eidx_t e1, eidx_t e2,
+    int index) {
+    ikey_t k1 = ENTRY(trie, e1)->key;
+    ikey_t k2 = ENTRY(trie, e2)->key;
+
+    STATS_ADD(trie, collisions, 1);
+    while(IS_BIT_SET(k1, index) == IS_BIT_SET(k2, index)) {
+        count_node(trie, index - 1, 0, 1);
+        nidx_t body = create_node(trie, NIL);
+        if(IS_BIT_SET(k1, index)) {
+            NODE(trie, head)->right_child = body;
         }
         else {
-            (*head)->right_child = create_node(e2);
-            (*head)->left_child = create_node(e1);
+            NODE(trie, head)->left_child = body;
         }
-        return;
+        head = body;
+        index--;
+    }
+    count_node(trie, index - 1, 1, 2);
+    nidx_t leaf1 = create_node(trie, e1);
+    nidx_t leaf2 = create_node(trie, e2);
+    if(IS_BIT_SET(k1, index)) {
+        NODE(trie, head)->right_child = leaf1;
+        NODE(trie, head)->left_child = leaf2;
     }
     else {
-        if(IS_BIT_SET(e1->key, index)) {
-            (*head)->right_child = create_node(NULL);
-            Node right = (*head)->right_child;
-            node_insert_w2(&right, e1, e2, index - 1);
-        }
-        else {
-            (*head)->left_child = create_node(NULL);
-            Node left = (*head)->left_child;
-            node_insert_w2(&left, e1, e2, index - 1);
-        }
-        return;
+        NODE(trie, head)->right_child = leaf2;
+        NODE(trie, head)->left_child = leaf1;
     }
 }
 
 
-/// Inserts a node into the trie tree recursively.
+/// Inserts a node into the trie tree in a single walk from the root.
 ///
 /// Three main cases:
 /// - node is a leaf node without value, insert the entry into node.
@@ -119,207 +668,1717 @@ void node_insert_w2(NodeH head, Entry e1, Entry e2, int index) {
 ///   bit of entry->key.
 ///
 /// - node collides with another node, read documentation on
-///   node_insert_w_2.
+///   node_insert_w_2. A collision with the same key keeps the
+///   entry already present.
 ///
-/// @param node a pointer to a pointer to an instance of Node_s
+/// Room for INSERT_NODES nodes must have been made beforehand, so the
+/// child links walked stay valid.
+///
+/// @param trie the trie that owns the nodes
+/// @param node the index of the root of the trie
 /// @param e the entry to be inserted amongst the Trie
-/// @param index which bit to observe in e->key
+/// @param index which bit to observe in e->key at the root
 /// 
-/// @return either a Node wil NULL value, or a node with Entry e
-/// as its value.
+/// @return the root of the trie, which changes only if it was empty
 
-Node node_insert(NodeH node, Entry e, int index) {
+nidx_t node_insert(Trie trie, nidx_t node, Entry e, int index) {
+    nidx_t root = node;
+    nidx_t *link = &root;
 
+    while(*link != NIL) {
+        Node n = NODE(trie, *link);
+        // comes to a body node, must traverse the tree
+        if(n->value == NIL) {
+            link = IS_BIT_SET(e->key, index) ? &n->right_child :
+                &n->left_child;
+            index--;
+            continue;
+        }
+        // the key is already present
+        if(ENTRY(trie, n->value)->key == e->key) {
+            return root;
+        }
+        // runs into collision with previous key, must traverse with both
+        eidx_t old = n->value;
+        n->value = NIL;
+        count_node(trie, index, 1, -1);
+        count_node(trie, index, 0, 1);
 
+        // not moving to child node so index stays the same
+        node_insert_w2(trie, *link, store_entry(trie, e), old, index);
+        return root;
+    }
     //comes to an empty leaf node
-    if(*node == NULL) {
-        return create_node(e);
+    count_node(trie, index, 1, 1);
+    nidx_t leaf = create_node(trie, store_entry(trie, e));
+    *link = leaf;
+    return root;
+}
+
+/// Inserts an entry without changing any existing node: the nodes on
+/// the path are copied on the way down, each copy is linked to the one
+/// before, and the originals are retired. If the key is in the trie
+/// already, the copy of its leaf gets the new entry instead.
+///
+/// @param trie the trie that owns the nodes
+/// @param node the index of the root of the trie
+/// @param e the entry to be inserted
+/// @param index which bit to observe in e->key at the root
+/// @return the copy that replaces the root
+
+nidx_t node_insert_copy(Trie trie, nidx_t node, Entry e, int index) {
+    nidx_t root = node;
+    nidx_t *link = &root;
+
+    while(*link != NIL) {
+        struct Node_s n = *NODE(trie, *link);
+        nidx_t copy = create_node(trie, NIL);
+        retire(trie, RETIRED_NODE, *link, NULL);
+        *link = copy;
+
+        if(n.value != NIL && ENTRY(trie, n.value)->key == e->key) {
+            NODE(trie, copy)->value = store_entry(trie, e);
+            retire(trie, RETIRED_ENTRY, n.value, NULL);
+            return root;
+        }
+        if(n.value != NIL) {
+            count_node(trie, index, 1, -1);
+            count_node(trie, index, 0, 1);
+            node_insert_w2(trie, copy, store_entry(trie, e), n.value, index);
+            return root;
+        }
+        NODE(trie, copy)->left_child = n.left_child;
+        NODE(trie, copy)->right_child = n.right_child;
+        link = IS_BIT_SET(e->key, index) ? &NODE(trie, copy)->right_child :
+            &NODE(trie, copy)->left_child;
+        index--;
+    }
+    count_node(trie, index, 1, 1);
+    nidx_t leaf = create_node(trie, store_entry(trie, e));
+    *link = leaf;
+    return root;
+}
+
+/// Removes the leaf of a key that is in the trie, copying the nodes on
+/// the path instead of changing them. A body node left with no child
+/// goes away, and one left with a single leaf below it is replaced by
+/// that leaf, so the trie keeps the shape inserts alone would give.
+/// The path is walked down once and the copies are made on the way
+/// back up, from a stack as deep as the trie can be.
+///
+/// @param trie the trie that owns the nodes
+/// @param node the index of the root of the trie
+/// @param key the key to remove
+/// @param index which bit to observe in key at the root
+/// @return the node that replaces the root, NIL if none
+
+nidx_t node_delete(Trie trie, nidx_t node, ikey_t key, int index) {
+    nidx_t path[DEPTHS];
+    size_t top = 0;
+
+    while(NODE(trie, node)->value == NIL) {
+        path[top++] = node;
+        node = IS_BIT_SET(key, index) ? NODE(trie, node)->right_child :
+            NODE(trie, node)->left_child;
+        index--;
     }
-    // comes to a body node, must traverse the tree
-    if((*node)->value == NULL) {
-        if(IS_BIT_SET(e->key, index)) {
-            //problem lyes here
-            Node right = (*node)->right_child;
-            (*node)->right_child = node_insert(&right, e, index - 1);
+    retire(trie, RETIRED_ENTRY, NODE(trie, node)->value, NULL);
+    retire(trie, RETIRED_NODE, node, NULL);
+    count_node(trie, index, 1, -1);
+
+    nidx_t child = NIL;
+    while(top > 0) {
+        nidx_t parent = path[--top];
+        struct Node_s n = *NODE(trie, parent);
+        retire(trie, RETIRED_NODE, parent, NULL);
+        index++;
+        if(IS_BIT_SET(key, index)) {
+            n.right_child = child;
         }
         else {
-            //problem
-            Node left = (*node)->left_child;
-            (*node)->left_child = node_insert(&left, e, index - 1);
+            n.left_child = child;
         }
-        return *node;
-    }
-    // runs into collision with previous key, must traverse with both
-    else {
-        Entry cpy = copy_entry((*node)->value);
-        entry_destroy((*node)->value);
-        (*node)->value = NULL;
 
-        // not moving to child node so index stays the same
-        node_insert_w2(node, e, cpy, index);
-        return *node;
+        if(n.left_child == NIL || n.right_child == NIL) {
+            nidx_t only = (n.left_child == NIL) ? n.right_child :
+                n.left_child;
+            if(only == NIL || NODE(trie, only)->value != NIL) {
+                count_node(trie, index, 0, -1);
+                if(only != NIL) {
+                    // the leaf moves up into this node's place
+                    count_node(trie, index - 1, 1, -1);
+                    count_node(trie, index, 1, 1);
+                }
+                child = only;
+                continue;
+            }
+        }
+        child = create_node(trie, NIL);
+        NODE(trie, child)->left_child = n.left_child;
+        NODE(trie, child)->right_child = n.right_child;
     }
+    return child;
 }
 
+/// Removes the leaf of a key that is in the trie, changing the nodes in
+/// place. On the way back up, a body node left with no child is freed
+/// and one left with a single leaf is replaced by that leaf, so chains
+/// collapse the way node_insert_w2 grows them. The walk up stops at the
+/// first node that still has two children.
 ///
-/// Gets the height of the trie, should not return
-/// numbers larger than 31.
-///
-/// @param node node which is being traversed inside the trie
-///
+/// @param trie the trie that owns the nodes, not shared
+/// @param node the index of the root of the trie
+/// @param key the key to remove
+/// @param index which bit to observe in key at the root
+/// @return the root of the trie, which changes if it collapses
 
-size_t get_height(Node node) {
-    if(node != NULL) {
-        int left_height = get_height(node->left_child);
-        int right_height = get_height(node->right_child);
-        
-        return MAX(left_height, right_height) + 1;
+nidx_t node_remove(Trie trie, nidx_t node, ikey_t key, int index) {
+    nidx_t path[DEPTHS];
+    size_t top = 0;
+    nidx_t root = node;
+
+    while(NODE(trie, node)->value == NIL) {
+        path[top++] = node;
+        node = IS_BIT_SET(key, index) ? NODE(trie, node)->right_child :
+            NODE(trie, node)->left_child;
+        index--;
     }
-    else {
-        return 0;
+    retire(trie, RETIRED_ENTRY, NODE(trie, node)->value, NULL);
+    retire(trie, RETIRED_NODE, node, NULL);
+    count_node(trie, index, 1, -1);
+
+    nidx_t child = NIL;
+    while(top > 0) {
+        nidx_t parent = path[--top];
+        Node n = NODE(trie, parent);
+        index++;
+        if(IS_BIT_SET(key, index)) {
+            n->right_child = child;
+        }
+        else {
+            n->left_child = child;
+        }
+        if(n->left_child != NIL && n->right_child != NIL) {
+            return root;
+        }
+        nidx_t only = (n->left_child == NIL) ? n->right_child :
+            n->left_child;
+        if(only != NIL && NODE(trie, only)->value == NIL) {
+            return root;
+        }
+        count_node(trie, index, 0, -1);
+        if(only != NIL) {
+            // the leaf moves up into this node's place
+            count_node(trie, index - 1, 1, -1);
+            count_node(trie, index, 1, 1);
+        }
+        retire(trie, RETIRED_NODE, parent, NULL);
+        child = only;
     }
+    return child;
 }
 
-/// Recursive function that only counts the BODY nodes.
-/// i.e; Nodes that do note have a value
+/// Stores an entry for a prefix in the trie of prefixes, where a node
+/// at depth plen holds the entry of the prefix its path spells, and
+/// nodes above it may hold shorter prefixes' entries. The path is
+/// created as needed in one walk; in a shared trie each node on it is
+/// copied and the original retired. Room for plen + 1 nodes must have
+/// been made beforehand.
 ///
-/// @param node node that is being checked if it has a value or not.
+/// @param trie the trie that owns the nodes
+/// @param key the prefix, bits past plen clear
+/// @param plen the prefix length
+/// @param value the entry to store, already in the entry pool
+/// @return the root of the trie of prefixes
 
-size_t get_internal_nodes(Node node) {
-    size_t total = 0;
-    if(node != NULL) {
-        if(node->value == NULL) {
-            total++;
+nidx_t prefix_insert(Trie trie, ikey_t key, unsigned int plen,
+    eidx_t value) {
+    nidx_t root = trie->prefix_root;
+    nidx_t *link = &root;
+    int index = BITSPERWORD;
+
+    for(unsigned int depth = 0; ; depth++) {
+        if(*link == NIL) {
+            nidx_t node = create_node(trie, NIL);
+            *link = node;
+        }
+        else if(trie->shared != NULL) {
+            nidx_t copy = create_node(trie, NIL);
+            *NODE(trie, copy) = *NODE(trie, *link);
+            retire(trie, RETIRED_NODE, *link, NULL);
+            *link = copy;
+        }
+        if(depth == plen) {
+            break;
         }
-        total += get_internal_nodes(node->left_child);
-        total += get_internal_nodes(node->right_child);
+        Node n = NODE(trie, *link);
+        link = IS_BIT_SET(key, index) ? &n->right_child : &n->left_child;
+        index--;
     }
-    return total;
+    NODE(trie, *link)->value = value;
+    return root;
 }
 
-/// Recursive function that gets the total number of
-/// leaf nodes inside the Trie.
+/// Stores a prefix that answers with an entry, unless the prefix has
+/// one already. Prefixes given the same value share one copy of the
+/// entry: the first of them stores it and sets value.
 ///
-/// @param node the node that is being observed if it has a value
+/// @param trie the trie
+/// @param key the prefix, bits past plen clear
+/// @param plen the prefix length, 0 to 32
+/// @param e the entry, copied if value is NIL
+/// @param value the index of the copy, NIL until one is stored
+/// @return 1 on success, 0 if memory ran out
 
-size_t get_leaf_nodes(Node node) {
-    int leaf_nodes = 0;
-    if(node != NULL) {
-        if(node->value != NULL) {
-            leaf_nodes++;
+static int add_prefix( Trie trie, ikey_t key, unsigned int plen, Entry e,
+    eidx_t *value) {
+    nidx_t node = trie->prefix_root;
+    int index = BITSPERWORD;
+    for(unsigned int depth = 0; depth < plen && node != NIL; depth++) {
+        node = IS_BIT_SET(key, index) ? NODE(trie, node)->right_child :
+            NODE(trie, node)->left_child;
+        index--;
+    }
+    if(node != NIL && NODE(trie, node)->value != NIL) {
+        return 1;
+    }
+    struct Version_s *next = NULL;
+    if(trie->shared != NULL) {
+        next = (struct Version_s*) malloc(sizeof(struct Version_s));
+        if(next == NULL) {
+            return 0;
+        }
+    }
+    begin_change(trie);
+    int ok = reserve_nodes(trie, plen + 1) &&
+        (*value != NIL || reserve_entries(trie, 1));
+    if(ok) {
+        if(*value == NIL) {
+            *value = store_entry(trie, e);
+        }
+        trie->prefix_root = prefix_insert(trie, key, plen, *value);
+        trie->num_prefixes++;
+        if(next != NULL) {
+            publish(trie, next);
         }
-        leaf_nodes += get_leaf_nodes(node->left_child);
-        leaf_nodes += get_leaf_nodes(node->right_child);
     }
-    return leaf_nodes;
+    else {
+        free(next);
+    }
+    end_change(trie);
+    return ok;
 }
 
+/// Finds the entry of the longest prefix in the trie of prefixes that
+/// key starts with: one walk down the key's path, remembering the last
+/// entry passed.
+///
+/// @param pool the nodes of the trie
+/// @param node the root of the trie of prefixes
+/// @param key the key to find
+/// @return the index of the entry, or NIL if no prefix matches
+
+eidx_t prefix_search( const struct Node_s *pool, nidx_t node, ikey_t key) {
+    eidx_t best = NIL;
+    int index = BITSPERWORD;
+
+    while(node != NIL) {
+        if(pool[node].value != NIL) {
+            best = pool[node].value;
+        }
+        if(index < 0) {
+            break;
+        }
+        node = IS_BIT_SET(key, index) ? pool[node].right_child :
+            pool[node].left_child;
+        index--;
+    }
+    return best;
+}
 
-/// Works as a recursively called function, travering
-/// the nodes of the trie in-order and printing them off as such. 
+/// Traverses the nodes of the trie in-order and prints the entries of
+/// the leaves as such. The subtrees still to be visited are kept on a
+/// stack, never deeper than the trie, rather than in recursive calls.
 ///
-/// @param node the node which is being observed and will have
-/// its children called inside the function.
+/// @param trie the trie that owns the nodes
+/// @param node the root of the subtree to print
 /// @param stream the file the contents of the Trie are being 
 /// printed to.
 ///
 
-void show_nodes( Node node, FILE * stream) {
+void show_nodes( Trie trie, nidx_t node, FILE * stream) {
+    nidx_t stack[DEPTHS + 1];
+    size_t top = 0;
 
-    if(node != NULL) {
-        show_nodes(node->left_child, stream);
-        if(node->value != NULL) {
-            entry_print(node->value, stream);
+    if(node != NIL) {
+        stack[top++] = node;
+    }
+    while(top > 0) {
+        Node n = NODE(trie, stack[--top]);
+        if(n->value != NIL) {
+            entry_print(ENTRY(trie, n->value), stream);
+            continue;
+        }
+        // the left subtree goes on top so it is printed first
+        if(n->right_child != NIL) {
+            stack[top++] = n->right_child;
+        }
+        if(n->left_child != NIL) {
+            stack[top++] = n->left_child;
         }
-        show_nodes(node->right_child, stream);
     }
 }
 
-Entry node_search( Node node, ikey_t key, int index) {
-    // at a leaf node
-    if(node != NULL) {
-        // we are at a leaf node, return the entry
-        if(node->value != NULL) {
-            return node->value;
+/// Copies the keys and entry indices of the leaves into keys and
+/// values in key order (in-order), walking the trie with an explicit
+/// stack like show_nodes.
+///
+/// @param trie the trie that owns the nodes
+/// @param node the root of the subtree to collect
+/// @param keys the array receiving the keys
+/// @param values the array receiving the entry indices
+/// @param count how many leaves have been written so far
+
+void collect_leaves( Trie trie, nidx_t node, ikey_t *keys, eidx_t *values,
+    size_t *count) {
+    nidx_t stack[DEPTHS + 1];
+    size_t top = 0;
+
+    if(node != NIL) {
+        stack[top++] = node;
+    }
+    while(top > 0) {
+        Node n = NODE(trie, stack[--top]);
+        if(n->value != NIL) {
+            keys[*count] = ENTRY(trie, n->value)->key;
+            values[(*count)++] = n->value;
+            continue;
         }
-        // we are in a body node, traverse the tree accordingly
-        else {
-            Entry tmp;
-            if(IS_BIT_SET(key, index)) {
-                tmp = node_search(node->right_child, key, index -1);
-                if(tmp != NULL) {
-                    return tmp;
-                }
-                tmp = node_search(node->left_child, key, index -1);
-                if(tmp != NULL) {
-                    return tmp;
-                }
-                printf("We should not have reached here...\n");
-            }
-            else {
-                tmp = node_search(node->left_child, key, index - 1);
-                if(tmp != NULL) {
-                    return tmp;
-                }
-                tmp = node_search(node->right_child, key, index - 1);
-                if(tmp != NULL) {
-                    return tmp;
-                }
-                printf("We should not have made it this far\n"); 
-            }
+        if(n->right_child != NIL) {
+            stack[top++] = n->right_child;
+        }
+        if(n->left_child != NIL) {
+            stack[top++] = n->left_child;
         }
     }
-    return NULL;
 }
 
+/// Finds the entry with the largest key below a node by always
+/// taking the right child when there is one.
+///
+/// @param pool the nodes of the trie
+/// @param node the root of the subtree
+/// @return the index of the entry, or NIL for an empty subtree
 
-/////////////////////// Functions of tries ///////////////////////////////
+eidx_t node_max( const struct Node_s *pool, nidx_t node) {
+    while(node != NIL && pool[node].value == NIL) {
+        WALK_ADD(visited, 1);
+        node = (pool[node].right_child != NIL) ? pool[node].right_child :
+            pool[node].left_child;
+    }
+    return (node == NIL) ? NIL : pool[node].value;
+}
 
-/// Create a Trie instance and initialize its fields.
-/// @return pointer to the Trie object instance or NULL on failure
-/// @post Trie is NULL on failure or initialized with a NULL trie root
+/// Finds the entry with the largest key that is not greater than key,
+/// the only entry whose range can contain key. It takes the pools
+/// rather than the trie so that readers of a shared trie can search
+/// the version they hold.
+///
+/// The walk goes from node down to a leaf once. On the way it notes
+/// the last left sibling it passed by going right: every key under it
+/// is smaller than key, so if the leaf turns out too large, or the
+/// path ends, the answer is the largest key under that sibling.
+///
+/// @param pool the nodes of the trie
+/// @param entries the entries of the trie
+/// @param node the node the walk starts from
+/// @param key the key to find
+/// @param index which bit of key to observe at node
+/// @return the index of the entry, or NIL if every key is greater
 
-Trie ibt_create( void ) {
-    Trie tmp = (Trie) malloc( sizeof(struct Trie_s) );
+eidx_t node_search( const struct Node_s *pool,
+    const struct Entry_s *entries, nidx_t node, ikey_t key, int index) {
+    nidx_t smaller = NIL;
 
-    tmp->height = -1;
-    tmp->num_leaf_nodes = 0;
-    tmp->num_nodes_total = 0;
-    tmp->head = (NodeH) malloc(sizeof(struct Node_s));
-    *(tmp->head) = NULL;
-    return tmp;
+    while(node != NIL && pool[node].value == NIL) {
+        const struct Node_s *n = &pool[node];
+        WALK_ADD(visited, 1);
+        if(IS_BIT_SET(key, index)) {
+            if(n->left_child != NIL) {
+                smaller = n->left_child;
+            }
+            node = n->right_child;
+        }
+        else {
+            node = n->left_child;
+        }
+        index--;
+    }
+    // we are at a leaf node, it is the answer unless it is too large
+    WALK_ADD(visited, node != NIL);
+    if(node != NIL && entries[pool[node].value].key <= key) {
+        return pool[node].value;
+    }
+    WALK_ADD(backtracks, smaller != NIL);
+    return node_max(pool, smaller);
 }
 
-/// Destroy the trie and free all storage.
-/// Uses Trie's Delete_value function to free app-specific (key and) value;
-/// If the Trie's Delete_value function is NULL,
-/// then call free() on the value in (key,value).
-/// @param trie a pointer to a Trie instance
-/// @pre trie is a valid Trie instance pointer
-/// @post the storage associated with the Trie and all data has been freed
 
-void ibt_destroy( Trie trie) {
-    destroy_nodes(*(trie->head));
-    free(trie);
-}
+/// Sorts entries by key into out with a stable radix sort, one byte
+/// of the key per pass. The four passes alternate between out and
+/// tmp, so the result lands in out.
+///
+/// @param entries the entries to sort, left untouched
+/// @param n the number of entries
+/// @param out receives the sorted entries
+/// @param tmp scratch space for n entries
 
+void sort_entries(const struct Entry_s *entries, size_t n,
+    struct Entry_s *out, struct Entry_s *tmp) {
+    const struct Entry_s *src = entries;
+    struct Entry_s *dst = tmp;
 
-/// insert an entry into the Trie as long as the entry is not already present
+    for(size_t shift = 0; shift < BITSPERWORD + 1; shift += BITSPERBYTE) {
+        size_t offset[256] = { 0 };
+        for(size_t i = 0; i < n; i++) {
+            offset[(src[i].key >> shift) & 0xFF]++;
+        }
+        size_t sum = 0;
+        for(size_t b = 0; b < 256; b++) {
+            size_t count = offset[b];
+            offset[b] = sum;
+            sum += count;
+        }
+        for(size_t i = 0; i < n; i++) {
+            dst[offset[(src[i].key >> shift) & 0xFF]++] = src[i];
+        }
+        src = dst;
+        dst = (dst == tmp) ? out : tmp;
+    }
+}
+
+/// A subtrie node_build has still to lay out, and where to link it.
+
+struct BuildFrame_s {
+    eidx_t lo;               ///< the first entry of the subtrie
+    eidx_t hi;               ///< one past its last entry
+    int index;               ///< the bit its root observes
+    nidx_t parent;           ///< the node it hangs from, NIL for the root
+    int right;               ///< whether it is the parent's right child
+};
+
+/// Builds the subtrie over the sorted entries [lo, hi) of the entry
+/// pool in one pass, the same shape repeated inserts would give:
+/// a leaf once a single entry is left, otherwise a body node split
+/// on the bit at index. Subtries are laid out depth first, left
+/// before right, from a stack of pending ranges as deep as the trie.
+///
+/// @param trie the trie that owns the nodes and entries
+/// @param lo the first entry of the subtrie
+/// @param hi one past the last entry of the subtrie
+/// @param index which bit the subtrie's root observes
+/// @return the root of the subtrie, or NIL if the pool could not grow
+
+nidx_t node_build(Trie trie, eidx_t lo, eidx_t hi, int index) {
+    struct BuildFrame_s stack[DEPTHS + 1];
+    size_t top = 0;
+    nidx_t root = NIL;
+
+    stack[top++] = (struct BuildFrame_s) { lo, hi, index, NIL, 0 };
+    while(top > 0) {
+        struct BuildFrame_s f = stack[--top];
+        if(!reserve_nodes(trie, 1)) {
+            return NIL;
+        }
+        nidx_t node;
+        if(f.hi - f.lo == 1) {
+            count_node(trie, f.index, 1, 1);
+            node = create_node(trie, f.lo);
+        }
+        else {
+            count_node(trie, f.index, 0, 1);
+            node = create_node(trie, NIL);
+
+            // keys agree on the bits above index, so the set bits are a
+            // suffix
+            eidx_t mid = f.lo, end = f.hi;
+            while(mid < end) {
+                eidx_t half = mid + (end - mid) / 2;
+                if(IS_BIT_SET(ENTRY(trie, half)->key, f.index)) {
+                    end = half;
+                }
+                else {
+                    mid = half + 1;
+                }
+            }
+            // the left half goes on top so it is laid out first
+            if(mid < f.hi) {
+                stack[top++] = (struct BuildFrame_s) { mid, f.hi,
+                    f.index - 1, node, 1 };
+            }
+            if(mid > f.lo) {
+                stack[top++] = (struct BuildFrame_s) { f.lo, mid,
+                    f.index - 1, node, 0 };
+            }
+        }
+        if(f.parent == NIL) {
+            root = node;
+        }
+        else if(f.right) {
+            NODE(trie, f.parent)->right_child = node;
+        }
+        else {
+            NODE(trie, f.parent)->left_child = node;
+        }
+    }
+    return root;
+}
+
+/// A node compact_subtrie has still to copy, and where to link the copy.
+
+struct CompactFrame_s {
+    nidx_t node;             ///< the node in the trie's pool
+    nidx_t parent;           ///< the copy of its parent, NIL for the root
+    int right;               ///< whether it is the parent's right child
+};
+
+/// Copies a subtrie into new pools depth first: each node right after
+/// its parent, and a left subtrie before the right one. Entries are
+/// copied as the nodes holding them are met; remap records where each
+/// went, so an entry several nodes share is copied once.
+///
+/// @param trie the trie that owns the subtrie
+/// @param root the root of the subtrie, or NIL
+/// @param pool receives the nodes, with room for all of them
+/// @param pool_size the nodes of pool in use, advanced
+/// @param entries receives the entries, with room for all of them
+/// @param num_entries the entries in use, advanced
+/// @param remap the new index of each entry of the trie, NIL until
+/// it is copied
+/// @return the root of the copy, or NIL
+
+static nidx_t compact_subtrie( Trie trie, nidx_t root, struct Node_s *pool,
+    nidx_t *pool_size, struct Entry_s *entries, eidx_t *num_entries,
+    eidx_t *remap) {
+    struct CompactFrame_s stack[DEPTHS + 1];
+    size_t top = 0;
+    nidx_t copy_root = NIL;
+
+    if(root != NIL) {
+        stack[top++] = (struct CompactFrame_s) { root, NIL, 0 };
+    }
+    while(top > 0) {
+        struct CompactFrame_s f = stack[--top];
+        const struct Node_s *n = NODE(trie, f.node);
+        nidx_t copy = (*pool_size)++;
+        pool[copy].left_child = NIL;
+        pool[copy].right_child = NIL;
+        pool[copy].value = NIL;
+        if(n->value != NIL) {
+            if(remap[n->value] == NIL) {
+                remap[n->value] = (*num_entries)++;
+                entries[remap[n->value]] = *ENTRY(trie, n->value);
+            }
+            pool[copy].value = remap[n->value];
+        }
+        if(f.parent == NIL) {
+            copy_root = copy;
+        }
+        else if(f.right) {
+            pool[f.parent].right_child = copy;
+        }
+        else {
+            pool[f.parent].left_child = copy;
+        }
+        // the left child goes on top so it is copied first
+        if(n->right_child != NIL) {
+            stack[top++] = (struct CompactFrame_s) { n->right_child, copy, 1 };
+        }
+        if(n->left_child != NIL) {
+            stack[top++] = (struct CompactFrame_s) { n->left_child, copy, 0 };
+        }
+    }
+    return copy_root;
+}
+
+/// Collects the keys of the leaves in order, and the entry of each,
+/// into new arrays for an index to be built over.
+///
+/// @param trie a pointer to a Trie instance
+/// @param keys receives the keys
+/// @param values receives the entries
+/// @param count receives the number of leaves
+/// @return 1 on success, 0 if memory ran out
+
+static int leaf_arrays( Trie trie, ikey_t **keys, eidx_t **values,
+    size_t *count) {
+    size_t leaves = trie->num_leaf_nodes + 1;
+    *keys = (ikey_t*) malloc(sizeof(ikey_t) * leaves);
+    *values = (eidx_t*) malloc(sizeof(eidx_t) * leaves);
+    if(*keys == NULL || *values == NULL) {
+        free(*keys);
+        free(*values);
+        return 0;
+    }
+    *count = 0;
+    collect_leaves(trie, trie->root, *keys, *values, count);
+    return 1;
+}
+
+/// Rebuilds the level-compressed index from the leaves if an insert
+/// has happened since it was last built.
+///
+/// @param trie a pointer to a Trie instance
+/// @return the index, or NULL if it could not be built
+
+LCTrie refresh_lc( Trie trie ) {
+    if(trie->lc_stale) {
+        size_t count;
+        ikey_t *keys;
+        eidx_t *values;
+        if(!leaf_arrays(trie, &keys, &values, &count)) {
+            return NULL;
+        }
+
+        if(trie->shared != NULL) {
+            retire(trie, RETIRED_INDEX, 0, trie->lc);
+        }
+        else {
+            lc_destroy(trie->lc);
+        }
+        trie->lc = lc_build(keys, values, count);
+        trie->lc_stale = (trie->lc == NULL);
+    }
+    return trie->lc;
+}
+
+/// Rebuilds the sorted-array index from the leaves if the trie has
+/// changed since it was last built. The whole array is laid out anew,
+/// so the engine suits tables that are built once and then searched.
+///
+/// @param trie a pointer to a Trie instance
+/// @return the index, or NULL if it could not be built
+
+SArray refresh_sorted( Trie trie ) {
+    if(trie->lc_stale) {
+        size_t count;
+        ikey_t *keys;
+        eidx_t *values;
+        if(!leaf_arrays(trie, &keys, &values, &count)) {
+            return NULL;
+        }
+
+        if(trie->shared != NULL) {
+            retire(trie, RETIRED_SORTED, 0, trie->sorted);
+        }
+        else {
+            sa_destroy(trie->sorted);
+        }
+        trie->sorted = sa_build(keys, values, count);
+        trie->lc_stale = (trie->sorted == NULL);
+    }
+    return trie->sorted;
+}
+
+/// Points the slots of the direct table at what lies below them: the
+/// body node at the table's depth, or the leaf that ends the path
+/// above it, in the slot of the leaf's own key. The nodes above the
+/// table's depth are walked with an explicit stack.
+///
+/// @param trie the trie that owns the nodes
+/// @param direct the table being filled, zeroed beforehand
+
+void direct_fill( Trie trie, struct Direct_s *direct) {
+    struct {
+        nidx_t node;
+        unsigned int depth;
+        size_t prefix;       ///< the bits of the path to node
+    } stack[DEPTHS + 1];
+    size_t top = 0;
+
+    if(trie->root != NIL) {
+        stack[top].node = trie->root;
+        stack[top].depth = 0;
+        stack[top++].prefix = 0;
+    }
+    while(top > 0) {
+        top--;
+        Node n = NODE(trie, stack[top].node);
+        unsigned int depth = stack[top].depth;
+        size_t prefix = stack[top].prefix;
+        if(n->value != NIL) {
+            ikey_t key = ENTRY(trie, n->value)->key;
+            direct->slots[key >> (BITSPERWORD + 1 - direct->bits)].value =
+                n->value;
+            continue;
+        }
+        if(depth == direct->bits) {
+            direct->slots[prefix].node = stack[top].node;
+            continue;
+        }
+        if(n->right_child != NIL) {
+            stack[top].node = n->right_child;
+            stack[top].depth = depth + 1;
+            stack[top++].prefix = (prefix << 1) | 1;
+        }
+        if(n->left_child != NIL) {
+            stack[top].node = n->left_child;
+            stack[top].depth = depth + 1;
+            stack[top++].prefix = prefix << 1;
+        }
+    }
+}
+
+/// Rebuilds the direct table if the trie has changed, or the table's
+/// size has, since it was last built.
+///
+/// @param trie a pointer to a Trie instance with direct_bits set
+/// @return the table, or NULL if it could not be built
+
+struct Direct_s *refresh_direct( Trie trie ) {
+    if(trie->direct_stale) {
+        size_t slots = (size_t) 1 << trie->direct_bits;
+        struct Direct_s *direct = (struct Direct_s*) calloc(1,
+            sizeof(struct Direct_s) + sizeof(struct DirSlot_s) * slots);
+        if(direct == NULL) {
+            return NULL;
+        }
+        STATS_ADD(trie, bytes_allocated,
+            sizeof(struct Direct_s) + sizeof(struct DirSlot_s) * slots);
+        direct->bits = trie->direct_bits;
+        direct_fill(trie, direct);
+
+        // the carry of a slot is the last entry of the slots before it
+        eidx_t last = NIL;
+        for(size_t i = 0; i < slots; i++) {
+            struct DirSlot_s *slot = &direct->slots[i];
+            slot->carry = last;
+            if(slot->node != NIL) {
+                last = node_max(trie->pool, slot->node);
+            }
+            else if(slot->value != NIL) {
+                last = slot->value;
+            }
+        }
+        if(trie->direct != NULL) {
+            retire(trie, RETIRED_MEMORY, 0, trie->direct);
+        }
+        trie->direct = direct;
+        trie->direct_stale = 0;
+    }
+    return trie->direct;
+}
+
+/// Finds the entry with the largest key that is not greater than key
+/// through the direct table: the slot of the key's top bits has the
+/// answer, or the node the remaining bits are searched from.
+///
+/// @param direct the table
+/// @param pool the nodes of the trie
+/// @param entries the entries of the trie
+/// @param key the key to find
+/// @return the index of the entry, or NIL if every key is greater
+
+eidx_t direct_search( const struct Direct_s *direct,
+    const struct Node_s *pool, const struct Entry_s *entries, ikey_t key) {
+    const struct DirSlot_s *slot =
+        &direct->slots[key >> (BITSPERWORD + 1 - direct->bits)];
+    if(slot->node != NIL) {
+        eidx_t e = node_search(pool, entries, slot->node, key,
+            (int) (BITSPERWORD - direct->bits));
+        return (e != NIL) ? e : slot->carry;
+    }
+    if(slot->value != NIL && entries[slot->value].key <= key) {
+        return slot->value;
+    }
+    return slot->carry;
+}
+
+/// Searches for many keys through the direct table, a chunk at a time:
+/// the slots of a chunk are prefetched before any is read, so their
+/// cache misses overlap.
+///
+/// @param direct the table
+/// @param pool the nodes of the trie
+/// @param entries the entries of the trie
+/// @param keys the keys to find
+/// @param out receives one entry (or NULL) per key
+/// @param n the number of keys
+
+void direct_batch( const struct Direct_s *direct, const struct Node_s *pool,
+    struct Entry_s *entries, const ikey_t *keys, Entry *out, size_t n) {
+    size_t shift = BITSPERWORD + 1 - direct->bits;
+
+    for(size_t first = 0; first < n; first += BATCH_CHUNK) {
+        size_t count = (n - first < BATCH_CHUNK) ? n - first : BATCH_CHUNK;
+        for(size_t i = 0; i < count; i++) {
+            __builtin_prefetch(&direct->slots[keys[first + i] >> shift]);
+        }
+        for(size_t i = 0; i < count; i++) {
+            ikey_t key = keys[first + i];
+            eidx_t e = direct_search(direct, pool, entries, key);
+            out[first + i] = (e != NIL && key <= entries[e].key_to) ?
+                &entries[e] : NULL;
+        }
+    }
+}
+
+/// Searches a published version of a shared trie.
+///
+/// @param v the version
+/// @param key the key to find
+/// @return the entry whose range contains key, or NULL
+
+Entry version_search( struct Version_s *v, ikey_t key) {
+    eidx_t e;
+    if(v->direct != NULL) {
+        e = direct_search(v->direct, v->pool, v->entries, key);
+    }
+    else if(v->lc != NULL) {
+        e = lc_search(v->lc, key);
+    }
+    else if(v->sorted != NULL) {
+        e = sa_search(v->sorted, key);
+    }
+    else {
+        e = node_search(v->pool, v->entries, v->root, key, BITSPERWORD);
+    }
+    if(e == NIL || key > v->entries[e].key_to) {
+        return NULL;
+    }
+    return &v->entries[e];
+}
+
+/// Turns the predecessors an index found for a chunk of keys into the
+/// entries containing the keys.
+///
+/// @param entries the entries the index refers to
+/// @param keys the keys of the chunk
+/// @param found the predecessor of each key, or NIL
+/// @param out receives one entry (or NULL) per key
+/// @param count the number of keys
+
+static void resolve_chunk( struct Entry_s *entries, const ikey_t *keys,
+    const eidx_t *found, Entry *out, size_t count) {
+    for(size_t i = 0; i < count; i++) {
+        __builtin_prefetch(&entries[found[i]]);
+    }
+    for(size_t i = 0; i < count; i++) {
+        out[i] = NULL;
+        if(found[i] != NIL && keys[i] <= entries[found[i]].key_to) {
+            out[i] = &entries[found[i]];
+        }
+    }
+}
+
+/// Searches for many keys with a level-compressed index, a chunk at a
+/// time, and turns each predecessor into the entry containing its key.
+///
+/// @param lc the index
+/// @param entries the entries the index refers to
+/// @param keys the keys to find
+/// @param out receives one entry (or NULL) per key
+/// @param n the number of keys
+
+void lc_batch( LCTrie lc, struct Entry_s *entries, const ikey_t *keys,
+    Entry *out, size_t n) {
+    eidx_t found[BATCH_CHUNK];
+
+    for(size_t first = 0; first < n; first += BATCH_CHUNK) {
+        size_t count = (n - first < BATCH_CHUNK) ? n - first : BATCH_CHUNK;
+        lc_search_batch(lc, keys + first, found, count);
+        resolve_chunk(entries, keys + first, found, out + first, count);
+    }
+}
+
+/// Searches for many keys with a sorted-array index, as lc_batch does.
+///
+/// @param sorted the index
+/// @param entries the entries the index refers to
+/// @param keys the keys to find
+/// @param out receives one entry (or NULL) per key
+/// @param n the number of keys
+
+void sorted_batch( SArray sorted, struct Entry_s *entries,
+    const ikey_t *keys, Entry *out, size_t n) {
+    eidx_t found[BATCH_CHUNK];
+
+    for(size_t first = 0; first < n; first += BATCH_CHUNK) {
+        size_t count = (n - first < BATCH_CHUNK) ? n - first : BATCH_CHUNK;
+        sa_search_batch(sorted, keys + first, found, count);
+        resolve_chunk(entries, keys + first, found, out + first, count);
+    }
+}
+
+////////////////////////// Parallel building ///////////////////////////
+
+/// The entries whose keys start with the same top bits, and the subtrie
+/// a thread built over them.
+
+struct Part_s {
+    eidx_t first;            ///< its first slot of the entry pool
+    size_t total;            ///< entries falling in it
+    size_t unique;           ///< of those, with distinct keys
+    eidx_t final;            ///< its first slot once duplicates are gone
+    Trie builder;            ///< the trie its nodes were built in
+    nidx_t root;             ///< its subtrie's root in builder, or NIL
+    nidx_t lo;               ///< the nodes of the subtrie in builder are
+    nidx_t hi;               ///< [lo, hi), laid out depth first
+    nidx_t moved;            ///< where node lo goes in the trie
+};
+
+/// What the threads of ibt_build_parallel share. Each step gives every
+/// thread a slice of the input or takes partitions from next_part, so
+/// no two threads ever write the same memory.
+
+struct Build_s {
+    Trie trie;
+    const struct Entry_s *input;
+    size_t n;
+    int threads;
+    unsigned int bits;       ///< top key bits that pick a partition
+    size_t num_parts;
+    struct Part_s *parts;
+    size_t *offsets;         ///< per thread and partition: a count,
+                             ///< then where the next entry goes
+    size_t next_part;        ///< the partition a thread takes next
+    int failed;              ///< set, atomically, by a thread that ran
+                             ///< out of memory
+};
+
+/// One thread of ibt_build_parallel and its own storage.
+
+struct Builder_s {
+    struct Build_s *build;
+    int id;
+    Trie trie;               ///< holds the nodes this thread builds
+    struct Entry_s *tmp;     ///< scratch space of the radix sort
+    size_t tmp_size;
+};
+
+/// The partition of a key.
+
+static size_t part_of( const struct Build_s *b, ikey_t key) {
+    return key >> (BITSPERWORD + 1 - b->bits);
+}
+
+/// Counts how many entries of the thread's slice of the input fall in
+/// each partition.
+///
+/// @param arg the thread
+/// @return NULL
+
+static void *count_slice( void *arg) {
+    struct Builder_s *w = (struct Builder_s*) arg;
+    struct Build_s *b = w->build;
+    size_t *count = &b->offsets[(size_t) w->id * b->num_parts];
+    size_t lo = b->n * (size_t) w->id / (size_t) b->threads;
+    size_t hi = b->n * (size_t) (w->id + 1) / (size_t) b->threads;
+    for(size_t i = lo; i < hi; i++) {
+        count[part_of(b, b->input[i].key)]++;
+    }
+    return NULL;
+}
+
+/// Copies the thread's slice of the input into the entry pool, each
+/// entry to the next slot its partition set aside for the thread, so
+/// that every partition keeps the order of the input.
+///
+/// @param arg the thread
+/// @return NULL
+
+static void *scatter_slice( void *arg) {
+    struct Builder_s *w = (struct Builder_s*) arg;
+    struct Build_s *b = w->build;
+    size_t *next = &b->offsets[(size_t) w->id * b->num_parts];
+    size_t lo = b->n * (size_t) w->id / (size_t) b->threads;
+    size_t hi = b->n * (size_t) (w->id + 1) / (size_t) b->threads;
+    for(size_t i = lo; i < hi; i++) {
+        b->trie->entries[next[part_of(b, b->input[i].key)]++] = b->input[i];
+    }
+    return NULL;
+}
+
+/// Sorts the partitions the thread takes in place, drops the entries
+/// whose key came earlier, and builds a subtrie over each partition
+/// left with two entries or more in the thread's own trie.
+///
+/// @param arg the thread
+/// @return NULL
+
+static void *build_parts( void *arg) {
+    struct Builder_s *w = (struct Builder_s*) arg;
+    struct Build_s *b = w->build;
+    size_t p;
+    while((p = __atomic_fetch_add(&b->next_part, 1, __ATOMIC_RELAXED)) <
+        b->num_parts) {
+        struct Part_s *part = &b->parts[p];
+        if(part->total == 0) {
+            continue;
+        }
+        if(part->total > w->tmp_size) {
+            free(w->tmp);
+            w->tmp = (struct Entry_s*) malloc(sizeof(struct Entry_s) *
+                part->total);
+            w->tmp_size = (w->tmp == NULL) ? 0 : part->total;
+            if(w->tmp == NULL) {
+                __atomic_store_n(&b->failed, 1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+        }
+        Entry sorted = &b->trie->entries[part->first];
+        sort_entries(sorted, part->total, sorted, w->tmp);
+        part->unique = 1;
+        for(size_t i = 1; i < part->total; i++) {
+            if(sorted[i].key != sorted[part->unique - 1].key) {
+                sorted[part->unique++] = sorted[i];
+            }
+        }
+        if(part->unique < 2) {
+            continue;
+        }
+        part->builder = w->trie;
+        part->lo = w->trie->pool_size;
+        part->root = node_build(w->trie, part->first,
+            part->first + (eidx_t) part->unique,
+            (int) (BITSPERWORD - b->bits));
+        part->hi = w->trie->pool_size;
+        if(part->root == NIL) {
+            __atomic_store_n(&b->failed, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/// Copies the subtries of the partitions the thread takes into the
+/// trie's pool, renumbering their nodes and their entries, which
+/// moved down over the dropped duplicates.
+///
+/// @param arg the thread
+/// @return NULL
+
+static void *move_parts( void *arg) {
+    struct Builder_s *w = (struct Builder_s*) arg;
+    struct Build_s *b = w->build;
+    size_t p;
+    while((p = __atomic_fetch_add(&b->next_part, 1, __ATOMIC_RELAXED)) <
+        b->num_parts) {
+        struct Part_s *part = &b->parts[p];
+        if(part->builder == NULL) {
+            continue;
+        }
+        nidx_t node_shift = part->moved - part->lo;
+        eidx_t entry_shift = part->first - part->final;
+        const struct Node_s *from = NODE(part->builder, part->lo);
+        struct Node_s *to = NODE(b->trie, part->moved);
+        for(nidx_t i = 0; i < part->hi - part->lo; i++) {
+            to[i].left_child = (from[i].left_child == NIL) ? NIL :
+                from[i].left_child + node_shift;
+            to[i].right_child = (from[i].right_child == NIL) ? NIL :
+                from[i].right_child + node_shift;
+            to[i].value = (from[i].value == NIL) ? NIL :
+                from[i].value - entry_shift;
+        }
+    }
+    return NULL;
+}
+
+/// Runs a step on every thread and waits for them. A thread that
+/// cannot be started is run by the caller.
+///
+/// @param w the threads
+/// @param threads the number of threads
+/// @param step what each thread runs
+
+static void run_builders( struct Builder_s *w, int threads,
+    void *(*step)(void*)) {
+    pthread_t ids[MAX_BUILDERS];
+    int started[MAX_BUILDERS];
+    for(int i = 0; i < threads; i++) {
+        started[i] = (pthread_create(&ids[i], NULL, step, &w[i]) == 0);
+        if(!started[i]) {
+            step(&w[i]);
+        }
+    }
+    for(int i = 0; i < threads; i++) {
+        if(started[i]) {
+            pthread_join(ids[i], NULL);
+        }
+    }
+}
+
+/// Lays out the top of the trie, above the partitions, the way
+/// node_build would: a leaf where a single entry is left, a body node
+/// where more are, and the moved subtrie of a partition at the depth
+/// the partitions are picked at.
+///
+/// @param b the build
+/// @param lo the first partition under the node
+/// @param hi one past the last partition under the node
+/// @param index the bit the node observes
+/// @return the node, or NIL if no entry falls under it
+
+static nidx_t stitch_parts( struct Build_s *b, size_t lo, size_t hi,
+    int index) {
+    Trie trie = b->trie;
+    eidx_t first = b->parts[lo].final;
+    eidx_t end = b->parts[hi - 1].final + (eidx_t) b->parts[hi - 1].unique;
+    if(end == first) {
+        return NIL;
+    }
+    if(end - first == 1) {
+        count_node(trie, index, 1, 1);
+        return create_node(trie, first);
+    }
+    if(hi - lo == 1) {
+        return b->parts[lo].root - b->parts[lo].lo + b->parts[lo].moved;
+    }
+    count_node(trie, index, 0, 1);
+    nidx_t node = create_node(trie, NIL);
+    size_t mid = lo + (hi - lo) / 2;
+    nidx_t left = stitch_parts(b, lo, mid, index - 1);
+    nidx_t right = stitch_parts(b, mid, hi, index - 1);
+    NODE(trie, node)->left_child = left;
+    NODE(trie, node)->right_child = right;
+    return node;
+}
+
+/////////////////////// Functions of tries ///////////////////////////////
+
+/// Create a Trie instance that answers searches with the
+/// level-compressed engine.
+/// @return pointer to the Trie object instance or NULL on failure
+/// @post Trie is NULL on failure or initialized with a NULL trie root
+
+Trie ibt_create( void ) {
+    return ibt_create_engine(IBT_LC);
+}
+
+/// Create a Trie instance and initialize its fields.
+/// @param engine the engine ibt_search uses to answer lookups
+/// @return pointer to the Trie object instance or NULL on failure
+/// @post Trie is NULL on failure or initialized with a NULL trie root
+
+Trie ibt_create_engine( Engine engine ) {
+    Trie tmp = (Trie) malloc( sizeof(struct Trie_s) );
+    if(tmp == NULL) {
+        return NULL;
+    }
+
+    tmp->height = 0;
+    tmp->num_leaf_nodes = 0;
+    tmp->num_nodes_total = 0;
+    memset(tmp->leaves_at_depth, 0, sizeof(tmp->leaves_at_depth));
+    memset(tmp->internal_at_depth, 0, sizeof(tmp->internal_at_depth));
+    tmp->pool = NULL;
+    tmp->pool_size = 0;
+    tmp->pool_capacity = 0;
+    tmp->root = NIL;
+    tmp->entries = NULL;
+    tmp->num_entries = 1;
+    tmp->entries_capacity = 0;
+    tmp->engine = engine;
+    tmp->lc = NULL;
+    tmp->sorted = NULL;
+    tmp->lc_stale = 1;
+    tmp->mapping = NULL;
+    tmp->mapping_size = 0;
+    tmp->free_nodes = NIL;
+    tmp->free_entries = NIL;
+    tmp->shared = NULL;
+    tmp->prefix_root = NIL;
+    tmp->num_prefixes = 0;
+    tmp->direct_bits = 0;
+    tmp->direct = NULL;
+    tmp->direct_stale = 1;
+    memset(&tmp->stats, 0, sizeof(tmp->stats));
+    tmp->generation = 0;
+    if(!reserve_nodes(tmp, INSERT_NODES)) {
+        free(tmp);
+        return NULL;
+    }
+    tmp->pool_size = 1;     // slot 0 is NIL
+    return tmp;
+}
+
+/// Destroy the trie and free all storage.
+/// Uses Trie's Delete_value function to free app-specific (key and) value;
+/// If the Trie's Delete_value function is NULL,
+/// then call free() on the value in (key,value).
+/// @param trie a pointer to a Trie instance
+/// @pre trie is a valid Trie instance pointer
+/// @post the storage associated with the Trie and all data has been freed
+
+void ibt_destroy( Trie trie) {
+    struct Shared_s *shared = trie->shared;
+    if(shared != NULL) {
+        for(size_t i = 0; i < shared->num_retired; i++) {
+            struct Retired_s *r = &shared->retired[i];
+            if(r->kind == RETIRED_MEMORY || r->kind == RETIRED_INDEX ||
+                r->kind == RETIRED_SORTED) {
+                release(trie, r->kind, r->index, r->memory);
+            }
+        }
+        free(shared->retired);
+        free(shared->readers);
+        free(shared->current);
+        free(shared);
+    }
+    destroy_nodes(trie);
+    lc_destroy(trie->lc);
+    sa_destroy(trie->sorted);
+    free(trie->direct);
+    if(trie->mapping != NULL) {
+        // the locations every trie shares may still be read from the
+        // snapshot; rather than lose them, leave it mapped
+        if(entry_locations_unmap(trie->mapping, trie->mapping_size)) {
+            munmap(trie->mapping, trie->mapping_size);
+        }
+        else {
+            errno = ENOMEM;
+        }
+    }
+    free(trie);
+}
+
+
+static int upsert_entry( Trie trie, Entry e);
+
+/// Inserts an entry unless its key is present, see ibt_insert.
+
+static void insert_entry( Trie trie, Entry e) {
+    if(!reserve_nodes(trie, INSERT_NODES) || !reserve_entries(trie, 1)) {
+        return;
+    }
+    if(trie->shared == NULL) {
+        trie->root = node_insert(trie, trie->root, e, BITSPERWORD);
+        trie->lc_stale = 1;
+        trie->direct_stale = 1;
+        return;
+    }
+    eidx_t found = node_search(trie->pool, trie->entries, trie->root,
+        e->key, BITSPERWORD);
+    if(found != NIL && ENTRY(trie, found)->key == e->key) {
+        return;
+    }
+    upsert_entry(trie, e);
+}
+
+/// insert an entry into the Trie as long as the entry is not already present
 /// @param trie a pointer to a Trie instance
 /// @param e the entry to be inserted into the trie
 /// @post the trie has grown to include a new entry IFF not already present
 
-void ibt_insert( Trie trie, Entry e) {
-    *(trie->head) = node_insert(trie->head, e, BITSPERWORD);
+void ibt_insert( Trie trie, Entry e) {
+    begin_change(trie);
+    insert_entry(trie, e);
+    end_change(trie);
+}
+
+/// Inserts an entry or replaces the one with its key, see ibt_upsert.
+
+static int upsert_entry( Trie trie, Entry e) {
+    eidx_t found = node_search(trie->pool, trie->entries, trie->root,
+        e->key, BITSPERWORD);
+    int present = (found != NIL && ENTRY(trie, found)->key == e->key);
+    if(present && trie->shared == NULL) {
+        *ENTRY(trie, found) = *e;
+        return 1;
+    }
+    if(!reserve_nodes(trie, INSERT_NODES) || !reserve_entries(trie, 1)) {
+        return 0;
+    }
+    if(trie->shared == NULL) {
+        trie->root = node_insert(trie, trie->root, e, BITSPERWORD);
+        trie->lc_stale = 1;
+        trie->direct_stale = 1;
+        return 1;
+    }
+    struct Version_s *next = (struct Version_s*) malloc(
+        sizeof(struct Version_s));
+    if(next == NULL) {
+        return 0;
+    }
+    trie->root = node_insert_copy(trie, trie->root, e, BITSPERWORD);
+    trie->lc_stale = 1;
+    trie->direct_stale = 1;
+    publish(trie, next);
+    return 1;
+}
+
+/// insert an entry, or replace the one with the same key. In a trie
+/// that is not shared the entry is overwritten where it lies, so the
+/// search indexes stay valid; in a shared trie its leaf is replaced
+/// on a copied path, and readers see either the old or the new entry.
+/// @param trie a pointer to a Trie instance
+/// @param e the entry to store, copied
+/// @return 1 on success, 0 if memory ran out
+
+int ibt_upsert( Trie trie, Entry e) {
+    begin_change(trie);
+    int ok = upsert_entry(trie, e);
+    end_change(trie);
+    return ok;
+}
+
+/// Removes the entry with a key the trie holds, see ibt_delete.
+
+static int delete_entry( Trie trie, ikey_t key) {
+    if(trie->shared == NULL) {
+        trie->root = node_remove(trie, trie->root, key, BITSPERWORD);
+        trie->lc_stale = 1;
+        trie->direct_stale = 1;
+        return 1;
+    }
+    struct Version_s *next = (struct Version_s*) malloc(
+        sizeof(struct Version_s));
+    if(next == NULL || !reserve_nodes(trie, INSERT_NODES)) {
+        free(next);
+        return 0;
+    }
+    trie->root = node_delete(trie, trie->root, key, BITSPERWORD);
+    trie->lc_stale = 1;
+    trie->direct_stale = 1;
+    publish(trie, next);
+    return 1;
+}
+
+/// remove the entry with the given key from the trie. Body nodes left
+/// without a reason to exist are removed with it: in place, stopping
+/// at the first node that keeps two children, or on a copied path in a
+/// shared trie.
+/// @param trie a pointer to a Trie instance
+/// @param key the key of the entry to remove
+/// @return 1 if the entry was removed, 0 if there was none or memory
+/// ran out
+
+int ibt_delete( Trie trie, ikey_t key) {
+    eidx_t found = node_search(trie->pool, trie->entries, trie->root, key,
+        BITSPERWORD);
+    if(found == NIL || ENTRY(trie, found)->key != key) {
+        return 0;
+    }
+    begin_change(trie);
+    int ok = delete_entry(trie, key);
+    end_change(trie);
+    return ok;
+}
+
+
+/// store an entry for the prefix of length plen of key, such as a CIDR
+/// block, unless that prefix has one already. The stored copy's range
+/// is the block: key with the bits past plen cleared, to key with them
+/// set.
+/// @param trie a pointer to a Trie instance
+/// @param key the prefix; bits past plen are ignored
+/// @param plen the prefix length, 0 to 32
+/// @param e the entry whose location the prefix gets
+/// @return 1 on success, 0 if plen is too long or memory ran out
+
+int ibt_insert_prefix( Trie trie, ikey_t key, unsigned int plen, Entry e) {
+    if(plen > BITSPERWORD + 1) {
+        return 0;
+    }
+    ikey_t host = (plen == 0) ? (ikey_t) -1 :
+        ((ikey_t) 1 << (BITSPERWORD + 1 - plen)) - 1;
+    struct Entry_s block = *e;
+    block.key = key & ~host;
+    block.key_to = key | host;
+    eidx_t value = NIL;
+    return add_prefix(trie, block.key, plen, &block, &value);
+}
+
+/// store the range of an entry as the fewest prefixes that cover it
+/// exactly: the largest aligned block that starts at the next address
+/// and ends inside the range, then the next. Ranges on block
+/// boundaries take one or a few prefixes. The entry is stored once and
+/// every prefix of the range answers with that copy, whole range and
+/// all, rather than a copy per block.
+/// @param trie a pointer to a Trie instance
+/// @param e the entry whose range and location are stored
+/// @return the number of prefixes the range took, 0 if memory ran out
+
+size_t ibt_insert_range_prefixes( Trie trie, Entry e) {
+    uint64_t lo = e->key;
+    uint64_t hi = e->key_to;
+    size_t count = 0;
+    eidx_t value = NIL;
+
+    while(lo <= hi) {
+        unsigned int plen = 0;
+        // the block of 2^(32 - plen) addresses must be aligned at lo and
+        // end inside the range
+        while(plen < BITSPERWORD + 1 &&
+            ((lo & ((UINT64_C(1) << (BITSPERWORD + 1 - plen)) - 1)) != 0 ||
+            lo + (UINT64_C(1) << (BITSPERWORD + 1 - plen)) - 1 > hi)) {
+            plen++;
+        }
+        if(!add_prefix(trie, (ikey_t) lo, plen, e, &value)) {
+            return 0;
+        }
+        count++;
+        lo += UINT64_C(1) << (BITSPERWORD + 1 - plen);
+    }
+    return count;
+}
+
+/// find the entry of the longest stored prefix that key starts with,
+/// as a router picks the most specific route.
+/// @param trie a pointer to a Trie instance
+/// @param key the address to find
+/// @return the entry, or NULL if no prefix matches; it stays valid
+/// until the next change (in a shared trie, until ibt_read_unlock)
+
+Entry ibt_lpm( Trie trie, ikey_t key) {
+    eidx_t e;
+    if(trie->shared != NULL) {
+        struct Version_s *v = __atomic_load_n(&trie->shared->current,
+            __ATOMIC_SEQ_CST);
+        e = prefix_search(v->pool, v->prefix_root, key);
+        return (e == NIL) ? NULL : &v->entries[e];
+    }
+    e = prefix_search(trie->pool, trie->prefix_root, key);
+    return (e == NIL) ? NULL : ENTRY(trie, e);
+}
+
+/// get the number of prefixes stored with ibt_insert_prefix
+/// @param trie a pointer to a Trie instance
+/// @return the number of prefixes
+
+size_t ibt_prefix_count( Trie trie) {
+    return trie->num_prefixes;
+}
+
+/// Builds an empty trie from many entries at once, see ibt_build_bulk.
+
+static int build_bulk( Trie trie, const struct Entry_s *entries, size_t n) {
+    if(trie->root != NIL) {
+        return 0;
+    }
+    if(n == 0) {
+        return 1;
+    }
+    struct Version_s *next = NULL;
+    if(trie->shared != NULL) {
+        next = (struct Version_s*) malloc(sizeof(struct Version_s));
+        if(next == NULL) {
+            return 0;
+        }
+    }
+    struct Entry_s *tmp = (struct Entry_s*) malloc(
+        sizeof(struct Entry_s) * n);
+    if(tmp == NULL || !reserve_entries(trie, n) ||
+        !reserve_nodes(trie, 2 * n)) {
+        free(tmp);
+        free(next);
+        return 0;
+    }
+    nidx_t pool_mark = trie->pool_size;
+    Entry sorted = ENTRY(trie, trie->num_entries);
+    sort_entries(entries, n, sorted, tmp);
+    free(tmp);
+
+    size_t unique = 1;
+    for(size_t i = 1; i < n; i++) {
+        if(sorted[i].key != sorted[unique - 1].key) {
+            sorted[unique++] = sorted[i];
+        }
+    }
+    eidx_t first = trie->num_entries;
+    trie->num_entries += (eidx_t) unique;
+    STATS_ADD(trie, entries_copied, unique);
+
+    trie->root = node_build(trie, first, trie->num_entries, BITSPERWORD);
+    trie->lc_stale = 1;
+    trie->direct_stale = 1;
+    if(trie->root == NIL) {
+        trie->pool_size = pool_mark;
+        trie->num_entries = first;
+        trie->num_leaf_nodes = trie->num_nodes_total = 0;
+        memset(trie->leaves_at_depth, 0, sizeof(trie->leaves_at_depth));
+        memset(trie->internal_at_depth, 0, sizeof(trie->internal_at_depth));
+        free(next);
+        return 0;
+    }
+    if(next != NULL) {
+        publish(trie, next);
+    }
+    return 1;
+}
+
+/// build the trie from many entries at once: they are radix sorted
+/// straight into the entry pool and the nodes are laid out in one pass
+/// over the sorted keys, with no per-entry descent and no copying
+/// on collisions. Of entries sharing a key the first one is kept.
+/// @param trie a pointer to an empty Trie instance
+/// @param entries the entries to be inserted, left untouched
+/// @param n the number of entries
+/// @return 1 on success, 0 if the trie was not empty or memory ran out
+
+int ibt_build_bulk( Trie trie, const struct Entry_s *entries, size_t n) {
+    begin_change(trie);
+    int ok = build_bulk(trie, entries, n);
+    end_change(trie);
+    return ok;
+}
+
+/// Builds an empty trie on several threads, see ibt_build_parallel.
+
+static int build_parallel( Trie trie, const struct Entry_s *entries,
+    size_t n, int threads) {
+    threads = (threads > MAX_BUILDERS) ? MAX_BUILDERS : threads;
+    if(threads < 2 || n < (size_t) threads * BUILD_MIN_PER_THREAD) {
+        return build_bulk(trie, entries, n);
+    }
+    if(trie->root != NIL) {
+        return 0;
+    }
+    struct Build_s b;
+    struct Builder_s w[MAX_BUILDERS];
+    memset(&b, 0, sizeof(b));
+    memset(w, 0, sizeof(w));
+    b.trie = trie;
+    b.input = entries;
+    b.n = n;
+    b.threads = threads;
+    while(b.bits < MAX_PARTITION_BITS &&
+        ((size_t) 1 << b.bits) < (size_t) threads * 16) {
+        b.bits++;
+    }
+    b.num_parts = (size_t) 1 << b.bits;
+
+    struct Version_s *next = NULL;
+    if(trie->shared != NULL) {
+        next = (struct Version_s*) malloc(sizeof(struct Version_s));
+    }
+    b.parts = (struct Part_s*) calloc(b.num_parts, sizeof(struct Part_s));
+    b.offsets = (size_t*) calloc(b.num_parts * (size_t) threads,
+        sizeof(size_t));
+    int ok = (trie->shared == NULL || next != NULL) && b.parts != NULL &&
+        b.offsets != NULL && reserve_entries(trie, n);
+    for(int i = 0; ok && i < threads; i++) {
+        w[i].build = &b;
+        w[i].id = i;
+        w[i].trie = ibt_create_engine(IBT_BINARY);
+        ok = (w[i].trie != NULL);
+        if(ok) {
+            w[i].trie->entries = trie->entries;     // borrowed to read keys
+        }
+    }
+
+    nidx_t pool_mark = trie->pool_size;
+    eidx_t first = trie->num_entries;
+    if(ok) {
+        run_builders(w, threads, count_slice);
+        size_t at = first;
+        for(size_t p = 0; p < b.num_parts; p++) {
+            b.parts[p].first = (eidx_t) at;
+            for(int t = 0; t < threads; t++) {
+                size_t count = b.offsets[(size_t) t * b.num_parts + p];
+                b.offsets[(size_t) t * b.num_parts + p] = at;
+                at += count;
+            }
+            b.parts[p].total = at - b.parts[p].first;
+        }
+        run_builders(w, threads, scatter_slice);
+        run_builders(w, threads, build_parts);
+        ok = !b.failed;
+    }
+
+    // the entries close up over the dropped duplicates, and the nodes
+    // of the subtries get their places in the pool
+    size_t nodes = 0;
+    eidx_t end = first;
+    for(size_t p = 0; ok && p < b.num_parts; p++) {
+        struct Part_s *part = &b.parts[p];
+        part->final = end;
+        memmove(ENTRY(trie, end), ENTRY(trie, part->first),
+            sizeof(struct Entry_s) * part->unique);
+        end += (eidx_t) part->unique;
+        part->moved = (nidx_t) (trie->pool_size + nodes);
+        nodes += part->hi - part->lo;
+    }
+    if(ok && reserve_nodes(trie, nodes + 2 * b.num_parts)) {
+        b.next_part = 0;
+        run_builders(w, threads, move_parts);
+        trie->pool_size += (nidx_t) nodes;
+        trie->num_entries = end;
+        STATS_ADD(trie, entries_copied, end - first);
+        for(int i = 0; i < threads; i++) {
+            for(size_t d = 0; d < DEPTHS; d++) {
+                trie->leaves_at_depth[d] += w[i].trie->leaves_at_depth[d];
+                trie->internal_at_depth[d] += w[i].trie->internal_at_depth[d];
+            }
+            trie->num_leaf_nodes += w[i].trie->num_leaf_nodes;
+            trie->num_nodes_total += w[i].trie->num_nodes_total;
+        }
+        trie->root = stitch_parts(&b, 0, b.num_parts, BITSPERWORD);
+        trie->lc_stale = 1;
+        trie->direct_stale = 1;
+    }
+    else if(ok) {
+        ok = 0;
+    }
+
+    for(int i = 0; i < threads; i++) {
+        if(w[i].trie != NULL) {
+            w[i].trie->entries = NULL;
+            ibt_destroy(w[i].trie);
+        }
+        free(w[i].tmp);
+    }
+    free(b.parts);
+    free(b.offsets);
+    if(!ok) {
+        trie->pool_size = pool_mark;
+        trie->num_entries = first;
+        trie->num_leaf_nodes = trie->num_nodes_total = 0;
+        memset(trie->leaves_at_depth, 0, sizeof(trie->leaves_at_depth));
+        memset(trie->internal_at_depth, 0, sizeof(trie->internal_at_depth));
+        free(next);
+        return 0;
+    }
+    if(next != NULL) {
+        publish(trie, next);
+    }
+    return 1;
+}
+
+/// build the trie from many entries at once on several threads, with
+/// the result ibt_build_bulk gives. The entries are split by the top
+/// bits of their keys into partitions, several per thread; the threads
+/// copy their slices of the input into the partitions side by side,
+/// then each sorts the partitions it takes and builds their subtries
+/// in a node pool of its own, with no locks. The subtries are copied
+/// into the trie in parallel and joined under the few nodes above the
+/// partitions. Small inputs are built by ibt_build_bulk.
+/// @param trie a pointer to an empty Trie instance
+/// @param entries the entries to be inserted, left untouched
+/// @param n the number of entries
+/// @param threads the number of threads to build with
+/// @return 1 on success, 0 if the trie was not empty or memory ran out
+
+int ibt_build_parallel( Trie trie, const struct Entry_s *entries, size_t n,
+    int threads) {
+    begin_change(trie);
+    int ok = build_parallel(trie, entries, n, threads);
+    end_change(trie);
+    return ok;
 }
 
-/// get height of the trie
+/// get height of the trie: one more than the deepest depth any node
+/// is counted at
 /// @param trie a pointer to a Trie instance
 /// @return height of trie
 
 size_t ibt_height( Trie trie ) {
-    trie->height = get_height(*(trie->head));
-    return trie->height;
+    size_t depth = DEPTHS;
+    while(depth > 0 && trie->leaves_at_depth[depth - 1] == 0 &&
+        trie->internal_at_depth[depth - 1] == 0) {
+        depth--;
+    }
+    return depth;
 }
 
 /// get the node count of the trie: the number of internal nodes
@@ -327,7 +2386,7 @@ size_t ibt_height( Trie trie ) {
 /// @return the count of internal nodes
 
 size_t ibt_node_count( Trie trie ) {
-    return get_internal_nodes(*(trie->head));
+    return trie->num_nodes_total;
 }
 
 /// get the size of the trie or number of leaf elements
@@ -335,11 +2394,26 @@ size_t ibt_node_count( Trie trie ) {
 /// @return size of trie 
 
 size_t ibt_size( Trie trie) {
-    trie->num_leaf_nodes = get_leaf_nodes(*(trie->head));
-
     return trie->num_leaf_nodes;
 }
 
+/// get the number of leaves and of body nodes at each depth
+/// @param trie a pointer to a Trie instance
+/// @param leaves receives the leaf count of depths 0 to IBT_DEPTHS - 1,
+/// may be NULL
+/// @param internal receives the body node count of each depth, may be
+/// NULL
+
+void ibt_depth_histogram( Trie trie, size_t *leaves, size_t *internal) {
+    if(leaves != NULL) {
+        memcpy(leaves, trie->leaves_at_depth, sizeof(trie->leaves_at_depth));
+    }
+    if(internal != NULL) {
+        memcpy(internal, trie->internal_at_depth,
+            sizeof(trie->internal_at_depth));
+    }
+}
+
 /// Perform an in-order traversal to show each (key, value) in the trie.
 /// Uses Trie's Show_value function to show each leaf node's data,
 /// and if the function is NULL, output each key and value in hexadecimal.
@@ -348,7 +2422,7 @@ size_t ibt_size( Trie trie) {
 /// @param stream the stream destination of output
 
 void ibt_show( Trie trie, FILE * stream) {
-    show_nodes(*(trie->head), stream);
+    show_nodes(trie, trie->root, stream);
     return;
 }
 
@@ -361,21 +2435,912 @@ void ibt_show( Trie trie, FILE * stream) {
 
 void ibt_update( Trie trie ) {
     trie->height = ibt_height(trie);
-    trie->num_leaf_nodes = ibt_size(trie);
-    trie->num_nodes_total = ibt_node_count(trie);
     printf("height:   %ld\n", trie->height);
     printf("size:   %ld\n", trie->num_leaf_nodes);
     printf("node_count:   %ld\n", trie->num_nodes_total); 
+    if(trie->num_prefixes > 0) {
+        printf("prefixes:   %zu\n", trie->num_prefixes);
+    }
+    if(trie->engine == IBT_LC) {
+        printf("lc height:   %zu\n", ibt_engine_height(trie));
+        printf("lc node_count:   %zu\n", ibt_engine_node_count(trie));
+    }
+    if(trie->engine == IBT_SORTED) {
+        printf("sorted height:   %zu\n", ibt_engine_height(trie));
+        printf("sorted node_count:   %zu\n", ibt_engine_node_count(trie));
+    }
+}
+
+/// get the height of the structure ibt_search walks: the most nodes
+/// a single lookup visits
+/// @param trie a pointer to a Trie instance
+/// @return height of the search engine
+
+size_t ibt_engine_height( Trie trie ) {
+    if(trie->engine == IBT_LC && refresh_lc(trie) != NULL) {
+        return lc_height(trie->lc);
+    }
+    if(trie->engine == IBT_SORTED && refresh_sorted(trie) != NULL) {
+        return sa_height(trie->sorted);
+    }
+    return ibt_height(trie);
+}
+
+/// get the internal node count of the structure ibt_search walks
+/// @param trie a pointer to a Trie instance
+/// @return the count of internal nodes of the search engine
+
+size_t ibt_engine_node_count( Trie trie ) {
+    if(trie->engine == IBT_LC && refresh_lc(trie) != NULL) {
+        return lc_node_count(trie->lc);
+    }
+    if(trie->engine == IBT_SORTED && refresh_sorted(trie) != NULL) {
+        return sa_node_count(trie->sorted);
+    }
+    return ibt_node_count(trie);
+}
+
+/// get a number that is odd while the trie changes and even between
+/// changes, and that never repeats
+/// @param trie a pointer to a Trie instance
+/// @return twice the number of changes finished, plus one while a
+/// change is in progress
+
+unsigned long ibt_generation( Trie trie) {
+    return __atomic_load_n(&trie->generation, __ATOMIC_SEQ_CST);
+}
+
+/// get the trie's counters as they are now
+/// @param trie a pointer to a Trie instance
+/// @param stats receives the counters
+
+void ibt_stats( Trie trie, struct Stats_s *stats) {
+#ifdef IBT_STATS
+    stats->enabled = 1;
+#else
+    stats->enabled = 0;
+#endif
+    stats->searches = __atomic_load_n(&trie->stats.searches,
+        __ATOMIC_RELAXED);
+    stats->nodes_visited = __atomic_load_n(&trie->stats.nodes_visited,
+        __ATOMIC_RELAXED);
+    stats->backtracks = __atomic_load_n(&trie->stats.backtracks,
+        __ATOMIC_RELAXED);
+    stats->collisions = trie->stats.collisions;
+    stats->entries_copied = trie->stats.entries_copied;
+    stats->bytes_allocated = trie->stats.bytes_allocated;
+}
+
+/// set the trie's counters back to zero
+/// @param trie a pointer to a Trie instance
+
+void ibt_stats_reset( Trie trie) {
+    __atomic_store_n(&trie->stats.searches, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&trie->stats.nodes_visited, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&trie->stats.backtracks, 0, __ATOMIC_RELAXED);
+    trie->stats.collisions = 0;
+    trie->stats.entries_copied = 0;
+    trie->stats.bytes_allocated = 0;
+}
+
+/// write the counters and the size of the trie as a JSON object
+/// @param trie a pointer to a Trie instance
+/// @param buffer receives the text
+/// @param size the bytes buffer has room for
+/// @return the length of the whole text, as snprintf returns it
+
+int ibt_stats_format( Trie trie, char *buffer, size_t size) {
+    struct Stats_s stats;
+    struct Memory_s memory;
+    ibt_stats(trie, &stats);
+    ibt_memory(trie, &memory);
+    return snprintf(buffer, size, "{\"enabled\": %d, \"size\": %zu, "
+        "\"node_count\": %zu, \"height\": %zu, \"prefixes\": %zu, "
+        "\"searches\": %zu, \"nodes_visited\": %zu, \"backtracks\": %zu, "
+        "\"collisions\": %zu, \"entries_copied\": %zu, "
+        "\"bytes_allocated\": %zu, \"memory\": {\"nodes\": %zu, "
+        "\"node_free\": %zu, \"node_spare\": %zu, \"entries\": %zu, "
+        "\"entry_free\": %zu, \"entry_spare\": %zu, \"locations\": %zu, "
+        "\"location_spare\": %zu, \"index\": %zu, \"total\": %zu, "
+        "\"mapped\": %zu}}\n", stats.enabled, ibt_size(trie),
+        ibt_node_count(trie), ibt_height(trie), trie->num_prefixes,
+        stats.searches, stats.nodes_visited, stats.backtracks,
+        stats.collisions, stats.entries_copied, stats.bytes_allocated,
+        memory.nodes, memory.node_free, memory.node_spare, memory.entries,
+        memory.entry_free, memory.entry_spare, memory.locations,
+        memory.location_spare, memory.index, memory.total, memory.mapped);
+}
+
+/// print the counters and the size of the trie as a JSON object
+/// @param trie a pointer to a Trie instance
+/// @param stream the stream destination of output
+
+void ibt_stats_dump( Trie trie, FILE *stream) {
+    char buffer[1024];
+    if(ibt_stats_format(trie, buffer, sizeof(buffer)) > 0) {
+        fputs(buffer, stream);
+    }
+}
+
+/// get how many bytes the trie takes and how many of them are wasted.
+/// @param trie a pointer to a Trie instance
+/// @param memory receives the byte counts
+
+void ibt_memory( Trie trie, struct Memory_s *memory) {
+    size_t free_nodes = 0;
+    size_t free_entries = 0;
+    for(nidx_t i = trie->free_nodes; i != NIL;
+        i = NODE(trie, i)->left_child) {
+        free_nodes++;
+    }
+    for(eidx_t i = trie->free_entries; i != NIL; i = ENTRY(trie, i)->key) {
+        free_entries++;
+    }
+    // slots waiting for readers to leave are no more use than free ones
+    for(size_t i = 0; trie->shared != NULL &&
+        i < trie->shared->num_retired; i++) {
+        free_nodes += (trie->shared->retired[i].kind == RETIRED_NODE);
+        free_entries += (trie->shared->retired[i].kind == RETIRED_ENTRY);
+    }
+
+    // slot NIL is never used
+    size_t used_nodes = (trie->pool_size > 0) ?
+        trie->pool_size - 1 - free_nodes : 0;
+    size_t used_entries = (trie->num_entries > 0) ?
+        trie->num_entries - 1 - free_entries : 0;
+    memory->nodes = sizeof(struct Node_s) * used_nodes;
+    memory->node_free = sizeof(struct Node_s) * free_nodes;
+    memory->node_spare = sizeof(struct Node_s) *
+        (trie->pool_capacity - used_nodes - free_nodes);
+    memory->entries = sizeof(struct Entry_s) * used_entries;
+    memory->entry_free = sizeof(struct Entry_s) * free_entries;
+    memory->entry_spare = sizeof(struct Entry_s) *
+        (trie->entries_capacity - used_entries - free_entries);
+    entry_locations_memory(&memory->locations, &memory->location_spare);
+
+    memory->index = 0;
+    if(trie->lc != NULL) {
+        struct LCImage_s image;
+        lc_image(trie->lc, &image);
+        memory->index += image.node_size * image.num_nodes +
+            (sizeof(ikey_t) + sizeof(unsigned int)) * image.size;
+    }
+    if(trie->sorted != NULL) {
+        memory->index += sa_memory(trie->sorted);
+    }
+    if(trie->direct != NULL) {
+        memory->index += sizeof(struct Direct_s) +
+            sizeof(struct DirSlot_s) * ((size_t) 1 << trie->direct->bits);
+    }
+    memory->total = memory->nodes + memory->node_free + memory->node_spare +
+        memory->entries + memory->entry_free + memory->entry_spare +
+        memory->locations + memory->location_spare + memory->index;
+    memory->mapped = trie->mapping_size;
 }
 
-/// search for the key in the trie by finding
-/// the closest entry that matches key in the Trie.
+/// search for the entry whose range [key, key_to] contains key.
 /// @param trie a pointer to a Trie instance
 /// @param key the key to find 
 /// @return entry representing the found entry or a null entry for not found
 
 Entry ibt_search( Trie trie, ikey_t key) {
+    WALK_BEGIN();
+    if(trie->shared != NULL) {
+        Entry found = version_search(__atomic_load_n(&trie->shared->current,
+            __ATOMIC_SEQ_CST), key);
+        WALK_END(trie, 1);
+        return found;
+    }
+    eidx_t e;
+    if(trie->direct_bits != 0 && refresh_direct(trie) != NULL) {
+        e = direct_search(trie->direct, trie->pool, trie->entries, key);
+    }
+    else if(trie->engine == IBT_LC && refresh_lc(trie) != NULL) {
+        e = lc_search(trie->lc, key);
+    }
+    else if(trie->engine == IBT_SORTED && refresh_sorted(trie) != NULL) {
+        e = sa_search(trie->sorted, key);
+    }
+    else {
+        int index = BITSPERWORD;
+        e = node_search(trie->pool, trie->entries, trie->root, key, index);
+    }
+    WALK_END(trie, 1);
+    if(e == NIL || key > ENTRY(trie, e)->key_to) {
+        return NULL;
+    }
+    return ENTRY(trie, e);
+}
+
+/// search for many keys at once, writing the entry whose range contains
+/// each key, or NULL, to out. The level-compressed and sorted-array
+/// engines advance several lookups in lockstep and prefetch the node
+/// each moves to, so the memory latency of the lookups overlaps; the
+/// binary engine searches the keys one after another.
+/// @param trie a pointer to a Trie instance
+/// @param keys the keys to find
+/// @param out receives one entry (or NULL) per key
+/// @param n the number of keys
+
+void ibt_search_batch( Trie trie, const ikey_t *keys, Entry *out, size_t n) {
+    WALK_BEGIN();
+    if(trie->shared != NULL) {
+        struct Version_s *v = __atomic_load_n(&trie->shared->current,
+            __ATOMIC_SEQ_CST);
+        if(v->direct != NULL) {
+            direct_batch(v->direct, v->pool, v->entries, keys, out, n);
+        }
+        else if(v->lc != NULL) {
+            lc_batch(v->lc, v->entries, keys, out, n);
+        }
+        else if(v->sorted != NULL) {
+            sorted_batch(v->sorted, v->entries, keys, out, n);
+        }
+        else {
+            for(size_t i = 0; i < n; i++) {
+                out[i] = version_search(v, keys[i]);
+            }
+        }
+        WALK_END(trie, n);
+        return;
+    }
+    if(trie->direct_bits != 0 && refresh_direct(trie) != NULL) {
+        direct_batch(trie->direct, trie->pool, trie->entries, keys, out, n);
+        WALK_END(trie, n);
+        return;
+    }
+    if(trie->engine == IBT_LC && refresh_lc(trie) != NULL) {
+        lc_batch(trie->lc, trie->entries, keys, out, n);
+        WALK_END(trie, n);
+        return;
+    }
+    if(trie->engine == IBT_SORTED && refresh_sorted(trie) != NULL) {
+        sorted_batch(trie->sorted, trie->entries, keys, out, n);
+        WALK_END(trie, n);
+        return;
+    }
+    // each search counts itself
+    for(size_t i = 0; i < n; i++) {
+        out[i] = ibt_search(trie, keys[i]);
+    }
+}
+
+/// make the trie safe to search from many threads while one thread
+/// changes it. The writer's inserts and deletes copy the nodes they
+/// would change and publish the new root atomically; storage the
+/// readers may still be using is reused only once they are past it.
+/// @param trie a pointer to a Trie instance
+/// @return 1 on success, 0 if memory ran out
+
+int ibt_share( Trie trie) {
+    if(trie->shared != NULL) {
+        return 1;
+    }
+    struct Shared_s *shared = (struct Shared_s*) calloc(1,
+        sizeof(struct Shared_s));
+    struct Version_s *next = (struct Version_s*) malloc(
+        sizeof(struct Version_s));
+    void *readers = NULL;
+    if(shared == NULL || next == NULL || posix_memalign(&readers,
+        CACHE_LINE, sizeof(struct Reader_s) * MAX_READERS) != 0) {
+        free(shared);
+        free(next);
+        return 0;
+    }
+    memset(readers, 0, sizeof(struct Reader_s) * MAX_READERS);
+    shared->readers = (struct Reader_s*) readers;
+    shared->epoch = 1;
+    trie->shared = shared;
+    entry_locations_share();
+    publish(trie, next);
+    return 1;
+}
+
+/// rebuild the engine's index for what the trie holds now and let
+/// readers of a shared trie search with it. Changes to a shared
+/// trie leave readers on the bitwise walk until this is called.
+/// @param trie a pointer to a Trie instance
+/// @return 1 on success, 0 if memory ran out
+
+int ibt_reindex( Trie trie) {
+    struct Version_s *next = NULL;
+    if(trie->shared != NULL) {
+        next = (struct Version_s*) malloc(sizeof(struct Version_s));
+        if(next == NULL) {
+            return 0;
+        }
+    }
+    if((trie->engine == IBT_LC && refresh_lc(trie) == NULL) ||
+        (trie->engine == IBT_SORTED && refresh_sorted(trie) == NULL) ||
+        (trie->direct_bits != 0 && refresh_direct(trie) == NULL)) {
+        free(next);
+        return 0;
+    }
+    if(next != NULL) {
+        publish(trie, next);
+    }
+    return 1;
+}
+
+/// repack the trie into new pools just large enough for what it holds,
+/// nodes depth first and entries in key order, dropping the slots
+/// released by deletes and the spare room left by growth.
+/// @param trie a pointer to a Trie instance
+/// @return 1 on success, 0 if memory ran out (the trie is unchanged)
+
+int ibt_compact( Trie trie) {
+    struct Version_s *next = NULL;
+    if(trie->shared != NULL) {
+        next = (struct Version_s*) malloc(sizeof(struct Version_s));
+        if(next == NULL) {
+            return 0;
+        }
+    }
+    size_t max_nodes = MAX((size_t) trie->pool_size, 1);
+    size_t max_entries = MAX((size_t) trie->num_entries, 1);
+    struct Node_s *pool = (struct Node_s*) malloc(sizeof(struct Node_s) *
+        max_nodes);
+    struct Entry_s *entries = (struct Entry_s*) malloc(
+        sizeof(struct Entry_s) * max_entries);
+    eidx_t *remap = (eidx_t*) calloc(max_entries, sizeof(eidx_t));
+    if(pool == NULL || entries == NULL || remap == NULL) {
+        free(next);
+        free(pool);
+        free(entries);
+        free(remap);
+        return 0;
+    }
+    begin_change(trie);
+    STATS_ADD(trie, bytes_allocated, sizeof(struct Node_s) * max_nodes +
+        sizeof(struct Entry_s) * max_entries);
+
+    memset(&pool[NIL], 0, sizeof(struct Node_s));
+    memset(&entries[NIL], 0, sizeof(struct Entry_s));
+    nidx_t pool_size = 1;
+    eidx_t num_entries = 1;
+    nidx_t root = compact_subtrie(trie, trie->root, pool, &pool_size,
+        entries, &num_entries, remap);
+    nidx_t prefix_root = compact_subtrie(trie, trie->prefix_root, pool,
+        &pool_size, entries, &num_entries, remap);
+    free(remap);
+
+    // give back what the released slots took
+    struct Node_s *fit_pool = (struct Node_s*) realloc(pool,
+        sizeof(struct Node_s) * pool_size);
+    pool = (fit_pool != NULL) ? fit_pool : pool;
+    struct Entry_s *fit_entries = (struct Entry_s*) realloc(entries,
+        sizeof(struct Entry_s) * num_entries);
+    entries = (fit_entries != NULL) ? fit_entries : entries;
+
+    if(trie->shared != NULL) {
+        // slots retired from the old pools go with them
+        size_t kept = 0;
+        for(size_t i = 0; i < trie->shared->num_retired; i++) {
+            struct Retired_s *r = &trie->shared->retired[i];
+            if(r->kind != RETIRED_NODE && r->kind != RETIRED_ENTRY) {
+                trie->shared->retired[kept++] = *r;
+            }
+        }
+        trie->shared->num_retired = kept;
+    }
+    if(!IS_MAPPED(trie, trie->pool)) {
+        retire(trie, RETIRED_MEMORY, 0, trie->pool);
+    }
+    if(!IS_MAPPED(trie, trie->entries)) {
+        retire(trie, RETIRED_MEMORY, 0, trie->entries);
+    }
+    trie->pool = pool;
+    trie->pool_size = pool_size;
+    trie->pool_capacity = pool_size;
+    trie->root = root;
+    trie->prefix_root = prefix_root;
+    trie->entries = entries;
+    trie->num_entries = num_entries;
+    trie->entries_capacity = num_entries;
+    trie->free_nodes = NIL;
+    trie->free_entries = NIL;
+    trie->lc_stale = 1;
+    trie->direct_stale = 1;
+    if(next != NULL) {
+        publish(trie, next);
+    }
+    end_change(trie);
+    return 1;
+}
+
+/// put a direct table indexed by the top bits of the key in front of
+/// the trie, or take it away. The table has a slot for every value of
+/// those bits that holds either the answer or the body node the rest
+/// of the key is searched from, so most lookups cost a slot and a node
+/// or two. It is rebuilt, like the level-compressed index, on the first
+/// search after a change; readers of a shared trie get it from
+/// ibt_reindex.
+/// @param trie a pointer to a Trie instance
+/// @param bits the number of key bits, 0 for no table
+/// @return 1 on success, 0 if bits is over IBT_DIRECT_MAX_BITS
+
+int ibt_set_direct_bits( Trie trie, unsigned int bits) {
+    if(bits > IBT_DIRECT_MAX_BITS) {
+        return 0;
+    }
+    if(bits == 0 && trie->direct != NULL) {
+        retire(trie, RETIRED_MEMORY, 0, trie->direct);
+        trie->direct = NULL;
+    }
+    trie->direct_stale = trie->direct_stale || bits != trie->direct_bits;
+    trie->direct_bits = bits;
+    return 1;
+}
+
+/// claim a reader slot of a shared trie for the calling thread.
+/// @param trie a shared Trie instance
+/// @return the slot, or NULL if every slot is taken
+
+Reader ibt_reader_join( Trie trie) {
+    for(size_t i = 0; i < MAX_READERS; i++) {
+        Reader reader = &trie->shared->readers[i];
+        int expected = 0;
+        if(__atomic_compare_exchange_n(&reader->in_use, &expected, 1, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            reader->trie = trie;
+            return reader;
+        }
+    }
+    return NULL;
+}
+
+/// give a reader slot back.
+/// @param reader a slot claimed by ibt_reader_join, outside a read
+/// section
+
+void ibt_reader_leave( Reader reader) {
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&reader->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/// enter a read section: entries found until ibt_read_unlock stay
+/// valid, however the writer changes the trie meanwhile. It never
+/// waits.
+/// @param reader the calling thread's slot
+
+void ibt_read_lock( Reader reader) {
+    struct Shared_s *shared = reader->trie->shared;
+    unsigned long epoch = __atomic_load_n(&shared->epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&reader->epoch, epoch, __ATOMIC_SEQ_CST);
+}
+
+/// leave a read section.
+/// @param reader the calling thread's slot
+
+void ibt_read_unlock( Reader reader) {
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/////////////////////////// Iteration ////////////////////////////////
+
+/// Starts an in-order walk at the first entry whose key is not less
+/// than key: the walk goes down the path of key once, keeping each
+/// right sibling it passes by going left, since all of its keys are
+/// larger.
+///
+/// @param it the cursor to position
+/// @param key the smallest key the walk is to return
+
+static void iter_start(Iter it, ikey_t key) {
+    nidx_t node;
+    if(it->trie->shared != NULL) {
+        struct Version_s *v = __atomic_load_n(&it->trie->shared->current,
+            __ATOMIC_SEQ_CST);
+        it->pool = v->pool;
+        it->entries = v->entries;
+        node = v->root;
+    }
+    else {
+        it->pool = it->trie->pool;
+        it->entries = it->trie->entries;
+        node = it->trie->root;
+    }
+    it->top = 0;
     int index = BITSPERWORD;
-    Entry e = node_search(*trie->head, key, index);
-    return e;
+
+    while(node != NIL && it->pool[node].value == NIL) {
+        const struct Node_s *n = &it->pool[node];
+        if(IS_BIT_SET(key, index)) {
+            node = n->right_child;
+        }
+        else {
+            if(n->right_child != NIL) {
+                it->stack[it->top++] = n->right_child;
+            }
+            node = n->left_child;
+        }
+        index--;
+    }
+    if(node != NIL && it->entries[it->pool[node].value].key >= key) {
+        it->stack[it->top++] = node;
+    }
+}
+
+/// Takes the next leaf of an in-order walk off the cursor's stack,
+/// pushing the children of the body nodes on the way.
+///
+/// @param it the cursor
+/// @return the entry of the leaf, or NULL at the end
+
+static Entry iter_step(Iter it) {
+    while(it->top > 0) {
+        const struct Node_s *n = &it->pool[it->stack[--it->top]];
+        if(n->value != NIL) {
+            return &it->entries[n->value];
+        }
+        if(n->right_child != NIL) {
+            it->stack[it->top++] = n->right_child;
+        }
+        if(n->left_child != NIL) {
+            it->stack[it->top++] = n->left_child;
+        }
+    }
+    return NULL;
+}
+
+/// create a cursor positioned at the first entry of the trie.
+/// @param trie a pointer to a Trie instance
+/// @return the cursor, or NULL if memory ran out
+
+Iter ibt_iter_create( Trie trie) {
+    Iter it = (Iter) malloc(sizeof(struct Iter_s));
+    if(it == NULL) {
+        return NULL;
+    }
+    it->trie = trie;
+    iter_start(it, 0);
+    return it;
+}
+
+/// move the cursor to the first entry whose key is not less than key.
+/// @param it the cursor
+/// @param key the key to seek to
+
+void ibt_iter_seek( Iter it, ikey_t key) {
+    iter_start(it, key);
+}
+
+/// get the entry at the cursor and move it to the next one in key
+/// order.
+/// @param it the cursor
+/// @return the entry, or NULL once every entry has been returned
+
+Entry ibt_iter_next( Iter it) {
+    return iter_step(it);
+}
+
+/// free a cursor.
+/// @param it the cursor, may be NULL
+
+void ibt_iter_destroy( Iter it) {
+    free(it);
+}
+
+/// call visit on every entry whose key lies in [lo, hi], in key
+/// order. The walk keeps its state in a cursor on the stack and
+/// allocates nothing.
+/// @param trie a pointer to a Trie instance
+/// @param lo the smallest key to visit
+/// @param hi the largest key to visit
+/// @param visit called with each entry and arg; a non-zero return
+/// stops the scan
+/// @param arg handed to visit as is
+/// @return the number of entries visited
+
+size_t ibt_range_scan( Trie trie, ikey_t lo, ikey_t hi, Visit_entry visit,
+    void *arg) {
+    struct Iter_s it;
+    size_t count = 0;
+    Entry e;
+
+    it.trie = trie;
+    iter_start(&it, lo);
+    while((e = iter_step(&it)) != NULL && e->key <= hi) {
+        count++;
+        if(visit(e, arg) != 0) {
+            break;
+        }
+    }
+    return count;
+}
+
+/////////////////////////// Snapshots ////////////////////////////////
+
+/// Writes one section of a snapshot at the next aligned offset of the
+/// file and records where it went.
+///
+/// @param file the snapshot being written
+/// @param header the header whose section is filled in
+/// @param which the section
+/// @param data the elements
+/// @param count the number of elements
+/// @param size the bytes per element
+/// @return 1 on success, 0 on a write error
+
+static int write_section(FILE *file, struct Snapshot_s *header, int which,
+    const void *data, size_t count, size_t size) {
+    static const char zeros[SNAPSHOT_ALIGN];
+    long pos = ftell(file);
+    if(pos < 0) {
+        return 0;
+    }
+    size_t pad = (SNAPSHOT_ALIGN - (size_t) pos % SNAPSHOT_ALIGN) %
+        SNAPSHOT_ALIGN;
+    if(fwrite(zeros, 1, pad, file) != pad) {
+        return 0;
+    }
+    header->section[which].offset = (uint64_t) pos + pad;
+    header->section[which].count = count;
+    header->section[which].size = size;
+    return count == 0 || fwrite(data, size, count, file) == count;
+}
+
+/// write the trie, its level-compressed index and the location
+/// dictionary to a snapshot file that ibt_load_mapped can use in place.
+/// The file is written next to path and renamed over it, so a process
+/// that has the old snapshot mapped keeps seeing the old one.
+/// @param trie a pointer to a Trie instance
+/// @param path the file to write
+/// @return 1 on success, 0 on failure with errno set
+
+int ibt_save( Trie trie, const char *path) {
+    struct Snapshot_s header;
+    struct LCImage_s image;
+    const char *blob;
+    const size_t *records;
+    size_t blob_size;
+    size_t num_records = entry_locations_image(&blob, &blob_size, &records);
+
+    memset(&header, 0, sizeof(header));
+    memset(&image, 0, sizeof(image));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.engine = trie->engine;
+    header.root = trie->root;
+    header.prefix_root = trie->prefix_root;
+    header.free_nodes = trie->free_nodes;
+    header.free_entries = trie->free_entries;
+    header.num_prefixes = trie->num_prefixes;
+    if(trie->engine == IBT_LC && refresh_lc(trie) != NULL) {
+        lc_image(trie->lc, &image);
+    }
+    header.lc_height = image.height;
+    header.lc_internal = image.num_internal;
+    for(size_t d = 0; d < DEPTHS; d++) {
+        header.leaves_at_depth[d] = trie->leaves_at_depth[d];
+        header.internal_at_depth[d] = trie->internal_at_depth[d];
+    }
+
+    size_t len = strlen(path);
+    char *tmp_path = (char*) malloc(len + 5);
+    if(tmp_path == NULL) {
+        return 0;
+    }
+    memcpy(tmp_path, path, len);
+    memcpy(tmp_path + len, ".tmp", 5);
+    FILE *file = fopen(tmp_path, "wb");
+    if(file == NULL) {
+        free(tmp_path);
+        return 0;
+    }
+
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        write_section(file, &header, SEC_NODES, trie->pool,
+            trie->pool_size, sizeof(struct Node_s)) &&
+        write_section(file, &header, SEC_ENTRIES, trie->entries,
+            trie->num_entries, sizeof(struct Entry_s)) &&
+        write_section(file, &header, SEC_LC_NODES, image.nodes,
+            image.num_nodes, image.node_size) &&
+        write_section(file, &header, SEC_LC_KEYS, image.keys,
+            image.size, sizeof(ikey_t)) &&
+        write_section(file, &header, SEC_LC_VALUES, image.values,
+            image.size, sizeof(unsigned int)) &&
+        write_section(file, &header, SEC_LOC_RECORDS, records,
+            num_records, sizeof(size_t)) &&
+        write_section(file, &header, SEC_LOC_BLOB, blob, blob_size, 1) &&
+        fseek(file, 0, SEEK_SET) == 0 &&
+        fwrite(&header, sizeof(header), 1, file) == 1;
+
+    if(fclose(file) != 0) {
+        ok = 0;
+    }
+    if(ok && rename(tmp_path, path) != 0) {
+        ok = 0;
+    }
+    if(!ok) {
+        int saved = errno;
+        remove(tmp_path);
+        errno = saved;
+    }
+    free(tmp_path);
+    return ok;
+}
+
+/// Checks that a section lies inside the file and holds elements of
+/// the expected size.
+///
+/// @param header the snapshot header
+/// @param which the section
+/// @param size the bytes per element the section must have
+/// @param file_size the size of the file
+/// @return 1 if the section is sound, 0 if not
+
+static int check_section(const struct Snapshot_s *header, int which,
+    size_t size, size_t file_size) {
+    uint64_t offset = header->section[which].offset;
+    uint64_t count = header->section[which].count;
+    if(count == 0) {
+        return 1;
+    }
+    return header->section[which].size == size &&
+        offset % SNAPSHOT_ALIGN == 0 && offset <= file_size &&
+        count <= (file_size - offset) / size;
+}
+
+/// Gives the entries of a snapshot the ids their locations have in the
+/// dictionary of the process, which was not empty when the snapshot
+/// was loaded. The snapshot is mapped privately, so only the pages of
+/// entries that are rewritten get copied.
+///
+/// @param trie the trie loaded from the snapshot
+/// @param blob the location strings of the snapshot
+/// @param records the offset in blob of each of the snapshot's ids
+/// @param count the number of ids in records
+/// @return 1 on success, 0 if memory ran out
+
+static int remap_locations(Trie trie, const char *blob,
+    const size_t *records, size_t count) {
+    loc_t *ids = (loc_t*) calloc(count + 1, sizeof(loc_t));
+    if(ids == NULL) {
+        return 0;
+    }
+    for(size_t i = 1; i < count; i++) {
+        ids[i] = entry_locations_intern(blob + records[i]);
+        if(ids[i] == 0) {
+            free(ids);
+            return 0;
+        }
+    }
+    for(eidx_t i = 1; i < trie->num_entries; i++) {
+        loc_t loc = ENTRY(trie, i)->loc;
+        ENTRY(trie, i)->loc = (loc < count) ? ids[loc] : 0;
+    }
+    free(ids);
+    return 1;
+}
+
+/// open a snapshot written by ibt_save by mapping it into memory. The
+/// trie searches the nodes, entries and index in the file where they
+/// lie, and the location dictionary is used in place too when the
+/// process has none yet, so lookups start without parsing or copying.
+/// Several processes mapping the same snapshot share its pages. The
+/// file is trusted: only its header is checked.
+/// @param path the snapshot to open
+/// @return pointer to the Trie object instance, or NULL on failure with
+/// errno set (EINVAL if the file is not a usable snapshot)
+
+Trie ibt_load_mapped( const char *path) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t) st.st_size;
+    if(size < sizeof(struct Snapshot_s)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    // private and writable, so that remap_locations can patch entries
+    // without touching the file
+    char *base = (char*) mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        return NULL;
+    }
+
+    const struct Snapshot_s *header = (const struct Snapshot_s*) base;
+    if(memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+        header->version != SNAPSHOT_VERSION ||
+        header->byte_order != SNAPSHOT_BYTE_ORDER ||
+        header->section[SEC_NODES].count == 0 ||
+        header->section[SEC_ENTRIES].count == 0 ||
+        header->root >= header->section[SEC_NODES].count ||
+        header->prefix_root >= header->section[SEC_NODES].count ||
+        header->free_nodes >= header->section[SEC_NODES].count ||
+        header->free_entries >= header->section[SEC_ENTRIES].count ||
+        !check_section(header, SEC_NODES, sizeof(struct Node_s), size) ||
+        !check_section(header, SEC_ENTRIES, sizeof(struct Entry_s), size) ||
+        !check_section(header, SEC_LC_KEYS, sizeof(ikey_t), size) ||
+        !check_section(header, SEC_LC_VALUES, sizeof(unsigned int), size) ||
+        !check_section(header, SEC_LOC_RECORDS, sizeof(size_t), size) ||
+        !check_section(header, SEC_LOC_BLOB, 1, size) ||
+        (header->section[SEC_LC_NODES].count > 0 &&
+        !check_section(header, SEC_LC_NODES,
+            header->section[SEC_LC_NODES].size, size))) {
+        munmap(base, size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    Trie trie = (Trie) malloc(sizeof(struct Trie_s));
+    if(trie == NULL) {
+        munmap(base, size);
+        return NULL;
+    }
+    trie->height = 0;
+    trie->num_leaf_nodes = 0;
+    trie->num_nodes_total = 0;
+    for(size_t d = 0; d < DEPTHS; d++) {
+        trie->leaves_at_depth[d] = header->leaves_at_depth[d];
+        trie->internal_at_depth[d] = header->internal_at_depth[d];
+        trie->num_leaf_nodes += trie->leaves_at_depth[d];
+        trie->num_nodes_total += trie->internal_at_depth[d];
+    }
+    trie->pool = (Node) (base + header->section[SEC_NODES].offset);
+    trie->pool_size = trie->pool_capacity =
+        (nidx_t) header->section[SEC_NODES].count;
+    trie->root = header->root;
+    trie->entries = (Entry) (base + header->section[SEC_ENTRIES].offset);
+    trie->num_entries = trie->entries_capacity =
+        (eidx_t) header->section[SEC_ENTRIES].count;
+    trie->engine = (header->engine == IBT_LC ||
+        header->engine == IBT_SORTED) ? (Engine) header->engine : IBT_BINARY;
+    trie->lc = NULL;
+    trie->sorted = NULL;
+    trie->lc_stale = 1;
+    trie->direct_stale = 1;
+    trie->mapping = base;
+    trie->mapping_size = size;
+    trie->free_nodes = header->free_nodes;
+    trie->free_entries = header->free_entries;
+    trie->shared = NULL;
+    trie->prefix_root = header->prefix_root;
+    trie->num_prefixes = header->num_prefixes;
+    trie->direct_bits = 0;
+    trie->direct = NULL;
+    memset(&trie->stats, 0, sizeof(trie->stats));
+    trie->generation = 0;
+
+    if(header->section[SEC_LC_NODES].count > 0) {
+        struct LCImage_s image;
+        image.nodes = base + header->section[SEC_LC_NODES].offset;
+        image.num_nodes = header->section[SEC_LC_NODES].count;
+        image.node_size = header->section[SEC_LC_NODES].size;
+        image.keys = (const ikey_t*) (base +
+            header->section[SEC_LC_KEYS].offset);
+        image.values = (const unsigned int*) (base +
+            header->section[SEC_LC_VALUES].offset);
+        image.size = header->section[SEC_LC_KEYS].count;
+        image.height = header->lc_height;
+        image.num_internal = header->lc_internal;
+        if(header->section[SEC_LC_VALUES].count == image.size) {
+            trie->lc = lc_from_image(&image);
+            trie->lc_stale = (trie->lc == NULL);
+        }
+    }
+
+    const char *blob = base + header->section[SEC_LOC_BLOB].offset;
+    const size_t *records = (const size_t*) (base +
+        header->section[SEC_LOC_RECORDS].offset);
+    size_t count = header->section[SEC_LOC_RECORDS].count;
+    if(count > 1 && !entry_locations_map(blob,
+        header->section[SEC_LOC_BLOB].count, records, count) &&
+        !remap_locations(trie, blob, records, count)) {
+        ibt_destroy(trie);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return trie;
 }
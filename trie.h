@@ -22,9 +22,89 @@ typedef unsigned int ikey_t;
 
 typedef struct Trie_s * Trie;
 
+/// Reader is a pointer to a thread's slot in a shared trie, see
+/// ibt_share
 
+typedef struct Reader_s * Reader;
 
+/// Iter is a pointer to a cursor walking the entries in key order, see
+/// ibt_iter_create
 
+typedef struct Iter_s * Iter;
+
+/// Visit_entry is called on each entry of a scan, with the argument
+/// given to the scan; it returns non-zero to stop the scan early.
+
+typedef int (*Visit_entry)(Entry e, void *arg);
+
+
+/// Engine is the structure ibt_search walks to answer a lookup.
+/// All engines give the same answers; IBT_LC and IBT_SORTED rebuild
+/// their index on the first search after a change, and IBT_SORTED,
+/// which lays the whole index out anew, is meant for tables that are
+/// built once and then only searched.
+
+typedef enum {
+    IBT_BINARY,     ///< walk the bitwise trie, one node per key bit
+    IBT_LC,         ///< level- and path-compressed index over the leaves
+    IBT_SORTED      ///< sorted array of the leaves' keys in cache-line
+                    ///< blocks, searched with vector compares
+} Engine;
+
+
+
+
+
+/// Counters of the work a trie has done, see ibt_stats. They are only
+/// kept when the library is compiled with -DIBT_STATS, and stay zero
+/// otherwise, so a default build pays nothing for them.
+
+struct Stats_s {
+    int enabled;             ///< whether the counters are compiled in
+    size_t searches;         ///< keys looked up by ibt_search(_batch)
+    size_t nodes_visited;    ///< nodes of the bitwise trie those lookups
+                             ///< walked; the LC index walks none
+    size_t backtracks;       ///< walks that ran past the key and fell
+                             ///< back on a subtrie of smaller keys
+    size_t collisions;       ///< inserts that split a leaf in two
+    size_t entries_copied;   ///< entries copied into the entry pool
+    size_t bytes_allocated;  ///< bytes asked for to grow the node and
+                             ///< entry pools or build a direct table
+};
+
+/// Where the memory of a trie goes, see ibt_memory. Free bytes are
+/// slots deletes released that no insert has reused yet, scattered
+/// through the pools; spare bytes were allocated for growth at the end
+/// of a pool and never used.
+
+struct Memory_s {
+    size_t nodes;            ///< bytes of nodes in use
+    size_t node_free;        ///< ... of released nodes
+    size_t node_spare;       ///< ... of the node pool past its end
+    size_t entries;          ///< bytes of entries in use
+    size_t entry_free;       ///< ... of released entries
+    size_t entry_spare;      ///< ... of the entry pool past its end
+    size_t locations;        ///< bytes of the interned location strings
+                             ///< and their tables, which every trie of
+                             ///< the process shares
+    size_t location_spare;   ///< ... allocated for more locations
+    size_t index;            ///< bytes of the engine's index and the
+                             ///< direct table
+    size_t total;            ///< the sum of all the above
+    size_t mapped;           ///< bytes of the snapshot the trie was
+                             ///< loaded from, which the pools, index and
+                             ///< locations may point into
+};
+
+
+/// number of depths a node of the trie can be at, the root's included
+
+#define IBT_DEPTHS 33
+
+/// most key bits a direct table can be indexed by, see
+/// ibt_set_direct_bits; 2^24 slots take 192 MiB
+
+#define IBT_DIRECT_MAX_BITS 24
 
 // constant values for bit processing available to application
 
@@ -40,34 +120,264 @@ extern const size_t RADIX;              ///< number of possible key values
 
 Trie ibt_create( void );
 
+/// Create a Trie instance that searches with the given engine.
+/// ibt_create() is the same as ibt_create_engine(IBT_LC).
+/// @param engine the engine ibt_search uses to answer lookups
+/// @return pointer to the Trie object instance or NULL on failure
+/// @post Trie is NULL on failure or initialized with a NULL trie root
+
+Trie ibt_create_engine( Engine engine );
+
+/// put a flat table indexed by the top bits of the key in front of the
+/// trie, or take it away. Each slot holds the answer or the node to go
+/// on from, so most lookups cost one or two memory accesses instead of
+/// a walk from the root; the memory it takes doubles with each bit.
+/// It pays off once there are about as many slots as entries, so
+/// that few lookups go on to search below a slot. Searches fall back
+/// to the engine when the table cannot be built.
+/// @param trie a pointer to a Trie instance
+/// @param bits the number of key bits, 0 for no table
+/// @return 1 on success, 0 if bits is over IBT_DIRECT_MAX_BITS
+
+int ibt_set_direct_bits( Trie trie, unsigned int bits);
+
 /// Destroy the trie and free all storage.
 /// Uses Trie's Delete_value function to free app-specific (key and) value;
 /// If the Trie's Delete_value function is NULL,
 /// then call free() on the value in (key,value).
 /// @param trie a pointer to a Trie instance
 /// @pre trie is a valid Trie instance pointer
-/// @post the storage associated with the Trie and all data has been freed
+/// @post the storage associated with the Trie and all data has been freed,
+/// except that of a trie from ibt_load_mapped whose locations could not
+/// be copied out of the snapshot for lack of memory: the snapshot then
+/// stays mapped, since the other tries use those locations too, and
+/// errno is set to ENOMEM
 
 void ibt_destroy( Trie trie);
 
 /// insert an entry into the Trie as long as the entry is not already present
 /// @param trie a pointer to a Trie instance
 /// @param e the entry to be inserted into the trie
-/// @post the trie has grown to include a new entry IFF not already present
+/// @post the trie has grown to include a copy of e IFF not already present;
+/// the caller keeps ownership of e
 
 void ibt_insert( Trie trie, Entry e);
 
+/// remove the entry with the given key from the Trie. Body nodes left
+/// with a single leaf below them collapse back up, so the trie has the
+/// shape inserting the remaining entries would have given it.
+/// @param trie a pointer to a Trie instance
+/// @param key the key of the entry to remove
+/// @return 1 if the entry was removed, 0 if there was none or memory
+/// ran out
+/// @post entries found by earlier searches may no longer be valid
+
+int ibt_delete( Trie trie, ikey_t key);
+
+/// insert an entry, or replace the entry with the same key, for
+/// instance when a range changes hands
+/// @param trie a pointer to a Trie instance
+/// @param e the entry to store; the caller keeps ownership of e
+/// @return 1 on success, 0 if memory ran out
+/// @post in a trie that is not shared, entries found by earlier
+/// searches stay valid and show the new contents
+
+int ibt_upsert( Trie trie, Entry e);
+
+/// store an entry for a prefix, such as the CIDR block key/plen, in
+/// the trie of prefixes ibt_lpm searches. The trie of prefixes lives
+/// beside the ranges ibt_search finds and shares the trie's storage.
+/// A prefix that has an entry already keeps it.
+/// @param trie a pointer to a Trie instance
+/// @param key the prefix; bits past plen are ignored
+/// @param plen the prefix length, 0 (everything) to 32 (one address)
+/// @param e the entry to store; the copy's range is set to the block
+/// @return 1 on success, 0 if plen is over 32 or memory ran out
+
+int ibt_insert_prefix( Trie trie, ikey_t key, unsigned int plen, Entry e);
+
+/// store the range of an entry as the fewest prefixes covering it
+/// exactly. Ranges that start and end on block boundaries, as most
+/// allocations do, take a single prefix. The prefixes of a range share
+/// one copy of the entry, and ibt_lpm answers with its whole range.
+/// @param trie a pointer to a Trie instance
+/// @param e the entry whose range and location are stored
+/// @return the number of prefixes used, 0 if memory ran out
+
+size_t ibt_insert_range_prefixes( Trie trie, Entry e);
+
+/// find the entry of the longest stored prefix that key starts with.
+/// @param trie a pointer to a Trie instance
+/// @param key the address to find
+/// @return the entry, or NULL if no prefix matches; it belongs to the
+/// trie and stays valid until the next change (in a shared trie, until
+/// ibt_read_unlock)
+
+Entry ibt_lpm( Trie trie, ikey_t key);
+
+/// get the number of prefixes stored with ibt_insert_prefix.
+/// @param trie a pointer to a Trie instance
+/// @return the number of prefixes
+
+size_t ibt_prefix_count( Trie trie);
+
+/// build the trie from many entries at once. The entries are sorted
+/// once and the trie is laid out in a single pass over them, so the
+/// cost is close to linear in n. Of entries sharing a key the first
+/// one is kept.
+/// @param trie a pointer to an empty Trie instance
+/// @param entries the entries to be inserted, copied and left untouched
+/// @param n the number of entries
+/// @return 1 on success, 0 if the trie was not empty or memory ran out
+
+int ibt_build_bulk( Trie trie, const struct Entry_s *entries, size_t n);
+
+/// build the trie from many entries at once, as ibt_build_bulk does,
+/// on several threads. The entries are partitioned by the top bits of
+/// their keys and the subtrie of each partition is sorted and built
+/// by one thread without locks, then joined under a shared top; the
+/// time taken falls close to linearly with the threads.
+/// @param trie a pointer to an empty Trie instance
+/// @param entries the entries to be inserted, copied and left untouched
+/// @param n the number of entries
+/// @param threads the number of threads to build with
+/// @return 1 on success, 0 if the trie was not empty or memory ran out
+
+int ibt_build_parallel( Trie trie, const struct Entry_s *entries, size_t n,
+    int threads);
+
+/// write the trie, its search index and the location dictionary to a
+/// flat, versioned snapshot file. Sections are addressed by offset, so
+/// the file can be mapped anywhere and used in place.
+/// @param trie a pointer to a Trie instance
+/// @param path the file to write, replaced atomically
+/// @return 1 on success, 0 on failure with errno set
+
+int ibt_save( Trie trie, const char *path);
+
+/// open a snapshot written by ibt_save by mapping it into memory.
+/// Lookups work straight away with nothing parsed or copied; the first
+/// insert copies the pools it changes to the heap. If the process
+/// already holds locations, the snapshot's are merged into them.
+/// @param path the snapshot to open
+/// @return pointer to the Trie object instance, or NULL on failure with
+/// errno set (EINVAL if the file is not a usable snapshot)
+
+Trie ibt_load_mapped( const char *path);
+
+/// share the trie between threads. Afterwards any number of reader
+/// threads may search it, each between ibt_read_lock and
+/// ibt_read_unlock, without ever waiting, while one writer thread at a
+/// time calls ibt_insert, ibt_delete and ibt_build_bulk. The writer
+/// copies the path it changes and publishes the new root atomically;
+/// nodes and entries readers may still see are reused only once every
+/// reader has left the read section it saw them in. The functions
+/// that walk the whole trie (ibt_size, ibt_show, ibt_save, ...) are
+/// for the writer thread only. There is no way back to an unshared
+/// trie.
+/// @param trie a pointer to a Trie instance
+/// @return 1 on success, 0 if memory ran out
+
+int ibt_share( Trie trie);
+
+/// rebuild the search index for what the trie holds now. Readers of a
+/// shared trie walk the bitwise trie after a change until the writer
+/// calls this, so that a batch of changes pays for one rebuild.
+/// @param trie a pointer to a Trie instance
+/// @return 1 on success, 0 if memory ran out
+
+int ibt_reindex( Trie trie);
+
+/// claim a reader slot of a shared trie for the calling thread.
+/// @param trie a shared Trie instance
+/// @return the slot, or NULL if every slot is taken
+
+Reader ibt_reader_join( Trie trie);
 
+/// give a reader slot back.
+/// @param reader a slot claimed by ibt_reader_join, outside a read
+/// section
 
-/// search for the key in the trie by finding
-/// the closest entry that matches key in the Trie.
+void ibt_reader_leave( Reader reader);
+
+/// enter a read section of a shared trie. Entries found until
+/// ibt_read_unlock stay valid whatever the writer does meanwhile.
+/// @param reader the calling thread's slot
+
+void ibt_read_lock( Reader reader);
+
+/// leave a read section.
+/// @param reader the calling thread's slot
+
+void ibt_read_unlock( Reader reader);
+
+
+
+/// search for the entry whose range [key, key_to] contains key. The
+/// ranges in the trie are expected not to overlap; the lookup finds the
+/// entry with the largest key not greater than key in O(BITSPERWORD)
+/// steps and checks that its range reaches key.
 /// @param trie a pointer to a Trie instance
 /// @param key the key to find 
-/// @return entry representing the found entry or a null entry for not found
+/// @return entry representing the found entry or a null entry for not found;
+/// it belongs to the trie and stays valid until the next insert or
+/// delete (in a shared trie, until ibt_read_unlock)
 
 Entry ibt_search( Trie trie, ikey_t key);
 
-/// get the size of the trie or number of leaf elements
+/// search for many keys at once; out[i] receives what
+/// ibt_search(trie, keys[i]) would return. Lookups are walked in
+/// lockstep so their cache misses overlap instead of serializing.
+/// @param trie a pointer to a Trie instance
+/// @param keys the keys to find
+/// @param out receives one entry (or NULL) per key
+/// @param n the number of keys
+
+void ibt_search_batch( Trie trie, const ikey_t *keys, Entry *out, size_t n);
+
+/// create a cursor over the entries in key order, positioned at the
+/// first one. Stepping it allocates nothing. Any change to the trie
+/// invalidates it; in a shared trie a reader may walk it within a read
+/// section, and sees the trie as it was when it was positioned.
+/// @param trie a pointer to a Trie instance
+/// @return the cursor, or NULL if memory ran out
+
+Iter ibt_iter_create( Trie trie);
+
+/// move a cursor to the first entry whose key is not less than key.
+/// @param it the cursor
+/// @param key the key to seek to
+
+void ibt_iter_seek( Iter it, ikey_t key);
+
+/// get the entry at a cursor and move it on to the next one.
+/// @param it the cursor
+/// @return the entry, or NULL once there are no more
+
+Entry ibt_iter_next( Iter it);
+
+/// free a cursor.
+/// @param it the cursor, may be NULL
+
+void ibt_iter_destroy( Iter it);
+
+/// call visit on each entry whose key lies in [lo, hi], in key order,
+/// without allocating; for instance every range starting inside a
+/// CIDR block.
+/// @param trie a pointer to a Trie instance
+/// @param lo the smallest key to visit
+/// @param hi the largest key to visit
+/// @param visit called with each entry and arg, stops the scan by
+/// returning non-zero
+/// @param arg handed to visit as is
+/// @return the number of entries visited
+
+size_t ibt_range_scan( Trie trie, ikey_t lo, ikey_t hi, Visit_entry visit,
+    void *arg);
+
+/// get the size of the trie or number of leaf elements. The shape
+/// statistics are kept up to date by every change, so this,
+/// ibt_node_count and ibt_height do not walk the trie.
 /// @param trie a pointer to a Trie instance
 /// @return size of trie 
 
@@ -85,6 +395,95 @@ size_t ibt_node_count( Trie trie);
 
 size_t ibt_height( Trie trie);
 
+/// get the number of leaves and of internal nodes at each depth, the
+/// root being at depth 0
+/// @param trie a pointer to a Trie instance
+/// @param leaves receives IBT_DEPTHS leaf counts, may be NULL
+/// @param internal receives IBT_DEPTHS internal node counts, may be NULL
+
+void ibt_depth_histogram( Trie trie, size_t *leaves, size_t *internal);
+
+/// get the height of the structure ibt_search walks: the most nodes
+/// a single lookup visits. Same as ibt_height for IBT_BINARY.
+/// @param trie a pointer to a Trie instance
+/// @return height of the search engine
+
+size_t ibt_engine_height( Trie trie);
+
+/// get the internal node count of the structure ibt_search walks.
+/// Same as ibt_node_count for IBT_BINARY.
+/// @param trie a pointer to a Trie instance
+/// @return the count of internal nodes of the search engine
+
+size_t ibt_engine_node_count( Trie trie);
+
+/// get a number that turns odd when a change to the trie begins and
+/// even again once it is published, so that a cache of search results,
+/// such as a Cache, knows when the entries it holds may have changed or
+/// moved. Like a sequence lock: a search is only worth keeping if the
+/// number was even before it and had not moved after it. In a shared
+/// trie, read it within a read section: entries found while it had the
+/// same value are still valid.
+/// @param trie a pointer to a Trie instance
+/// @return twice the number of changes finished, plus one while a
+/// change is in progress
+
+unsigned long ibt_generation( Trie trie);
+
+/// get the trie's counters as they are now. Readers of a shared trie
+/// may still be adding to them.
+/// @param trie a pointer to a Trie instance
+/// @param stats receives the counters
+
+void ibt_stats( Trie trie, struct Stats_s *stats);
+
+/// set the trie's counters back to zero
+/// @param trie a pointer to a Trie instance
+
+void ibt_stats_reset( Trie trie);
+
+/// write the counters and the size of the trie as a JSON object on one
+/// line, the way snprintf writes: at most size bytes, terminated. It
+/// only reads the trie, so threads may call it alongside each other
+/// and alongside searches, but like ibt_memory not alongside a change.
+/// @param trie a pointer to a Trie instance
+/// @param buffer receives the text
+/// @param size the bytes buffer has room for
+/// @return the length of the whole text, which was cut short if it is
+/// size or more, or negative on an error
+
+int ibt_stats_format( Trie trie, char *buffer, size_t size);
+
+/// print the counters and the size of the trie as a JSON object
+/// @param trie a pointer to a Trie instance
+/// @param stream the stream destination of output
+
+void ibt_stats_dump( Trie trie, FILE *stream);
+
+/// get how many bytes the trie takes and how many of them are wasted.
+/// It only reads the trie, but walks the lists of released slots a
+/// change rewrites, so it must not run while the trie changes: in a
+/// shared trie, call it from the writer thread or while no writes run.
+/// @param trie a pointer to a Trie instance
+/// @param memory receives the byte counts
+
+void ibt_memory( Trie trie, struct Memory_s *memory);
+
+/// repack a trie that has seen many changes: every node reachable from
+/// the roots is copied into a new pool just large enough, depth first
+/// with each left subtrie before the right one, and the entries into a
+/// new entry pool in the order their leaves are met, which is key
+/// order. The released slots and spare room go away and a lookup's
+/// path ends up on neighbouring cache lines. The search index is
+/// rebuilt on the next search, or for readers of a shared trie by
+/// ibt_reindex.
+/// @param trie a pointer to a Trie instance
+/// @return 1 on success, 0 if memory ran out (the trie is unchanged)
+/// @post entries found by earlier searches are no longer valid; in a
+/// shared trie they stay valid until the reader leaves its section
+
+int ibt_compact( Trie trie);
+
 
 /// Perform an in-order traversal to show each (key, value) in the trie.
 /// Uses Trie's Show_value function to show each leaf node's data,
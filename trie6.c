@@ -0,0 +1,644 @@
+//
+// File: trie6.c
+// IPv6 range trie: a path-compressed binary trie over 128-bit keys,
+// with its nodes and entries in index pools like those of trie.c.
+// // // // // // // // // // // // // // // // // // // // // // // //
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include "entry.h"
+#include "trie6.h"
+
+/// index 0 of either pool is never handed out, so it plays the part
+/// of NULL; its node has height 0, like an empty subtrie
+#define NIL 0
+
+/// bits of an address
+#define BITS 128
+
+/// the bit of key at position bit, counted from the most significant
+#define BIT(key, bit) ((int) (((key) >> (BITS - 1 - (bit))) & 1))
+
+/// number of depths a node can be at, see IBT6_DEPTHS
+#define DEPTHS IBT6_DEPTHS
+
+#ifdef IBT_STATS
+
+/// adds n to a counter of the trie; searches count at the same time as
+/// each other
+#define STATS_ADD(trie, field, n) \
+    ((void) __atomic_fetch_add(&(trie)->stats.field, (size_t) (n), \
+    __ATOMIC_RELAXED))
+
+#else
+
+#define STATS_ADD(trie, field, n) ((void) 0)
+
+#endif
+
+/// A node of the trie: a branch node on bit, or a leaf with value.
+/// Each branch node skips the bits its whole subtrie agrees on and
+/// branches on the first bit the keys below it differ in, so a walk
+/// visits at most one node per entry it has to tell apart, however
+/// long the address. Branch nodes always have two children.
+
+struct Node6_s {
+    ip6_t key;               ///< the leaf's key, or a key below the branch
+    unsigned int left;
+    unsigned int right;
+    unsigned int value;      ///< the leaf's entry, NIL for a branch
+    unsigned short bit;      ///< the bit a branch node branches on
+    unsigned short height;   ///< most nodes on a path down from here
+};
+
+/// The trie: nodes and entries in pools addressed by index, with free
+/// lists for the slots deletes give back, as in trie.c.
+
+struct Trie6_s {
+    struct Node6_s *pool;
+    unsigned int pool_size;          ///< slots of pool in use, with NIL
+    unsigned int pool_capacity;
+    unsigned int root;
+    struct Entry6_s *entries;
+    unsigned int num_entries;        ///< slots of entries in use
+    unsigned int entries_capacity;
+    unsigned int free_nodes;         ///< released nodes, linked by left
+    unsigned int free_entries;       ///< released entries, linked by loc
+    size_t num_leaves;
+    size_t num_branches;
+    struct Stats_s stats;            ///< kept with IBT_STATS
+};
+
+
+/// Counts the leading zero bits of a non-zero address.
+///
+/// @param x the address
+/// @return the number of zero bits before the first set one
+
+static inline int clz128(ip6_t x) {
+    uint64_t high = (uint64_t) (x >> 64);
+    return high != 0 ? __builtin_clzll(high) :
+        64 + __builtin_clzll((uint64_t) x);
+}
+
+/// Finds the number of leading bits two different keys agree on.
+///
+/// @param a a key
+/// @param b another key
+/// @return the position of the first bit they differ in
+
+static unsigned int common(ip6_t a, ip6_t b) {
+    return (unsigned int) clz128(a ^ b);
+}
+
+/// Makes room for the two nodes and the entry an insert can add, so
+/// that pointers into the pools stay valid while it runs.
+///
+/// @param trie the trie
+/// @return 1 on success, 0 if memory ran out
+
+static int reserve(Trie6 trie) {
+    if(trie->pool_size + 2 > trie->pool_capacity) {
+        size_t cap = (size_t) trie->pool_capacity * 2;
+        if(cap > (unsigned int) -1) {
+            return 0;
+        }
+        STATS_ADD(trie, bytes_allocated, sizeof(struct Node6_s) * cap);
+        struct Node6_s *tmp = (struct Node6_s*) realloc(trie->pool,
+            sizeof(struct Node6_s) * cap);
+        if(tmp == NULL) {
+            return 0;
+        }
+        trie->pool = tmp;
+        trie->pool_capacity = (unsigned int) cap;
+    }
+    if(trie->num_entries + 1 > trie->entries_capacity) {
+        size_t cap = (size_t) trie->entries_capacity * 2;
+        if(cap > (unsigned int) -1) {
+            return 0;
+        }
+        STATS_ADD(trie, bytes_allocated, sizeof(struct Entry6_s) * cap);
+        struct Entry6_s *tmp = (struct Entry6_s*) realloc(trie->entries,
+            sizeof(struct Entry6_s) * cap);
+        if(tmp == NULL) {
+            return 0;
+        }
+        trie->entries = tmp;
+        trie->entries_capacity = (unsigned int) cap;
+    }
+    return 1;
+}
+
+/// Takes a node out of the pool, from the free list first.
+///
+/// @param trie the trie
+/// @return the index of the node, its fields left to the caller
+
+static unsigned int new_node(Trie6 trie) {
+    unsigned int i = trie->free_nodes;
+    if(i != NIL) {
+        trie->free_nodes = trie->pool[i].left;
+        return i;
+    }
+    return trie->pool_size++;
+}
+
+/// Copies an entry into the entry pool, from the free list first.
+///
+/// @param trie the trie
+/// @param e the entry
+/// @return the index of the copy
+
+static unsigned int store(Trie6 trie, const struct Entry6_s *e) {
+    unsigned int i = trie->free_entries;
+    if(i != NIL) {
+        trie->free_entries = trie->entries[i].loc;
+    }
+    else {
+        i = trie->num_entries++;
+    }
+    trie->entries[i] = *e;
+    STATS_ADD(trie, entries_copied, 1);
+    return i;
+}
+
+/// Works out the height of a branch node from its children's.
+///
+/// @param pool the nodes
+/// @param node the branch node
+/// @return its height
+
+static unsigned short branch_height(const struct Node6_s *pool,
+    unsigned int node) {
+    unsigned short left = pool[pool[node].left].height;
+    unsigned short right = pool[pool[node].right].height;
+    return (unsigned short) (1 + (left > right ? left : right));
+}
+
+/// Brings the heights of the branch nodes on a path up to date after
+/// the subtrie below the last of them changed, bottom up, stopping at
+/// the first one whose height stays as it was.
+///
+/// @param pool the nodes
+/// @param path the branch nodes from the root down
+/// @param depth the number of them
+
+static void fix_heights(struct Node6_s *pool, const unsigned int *path,
+    size_t depth) {
+    while(depth > 0) {
+        unsigned int node = path[--depth];
+        unsigned short height = branch_height(pool, node);
+        if(height == pool[node].height) {
+            return;
+        }
+        pool[node].height = height;
+    }
+}
+
+/// Inserts an entry unless its key is there already. The walk goes
+/// down to the leaf the key would share the most bits with, then
+/// splits the path above the first bit they differ in with a branch
+/// node.
+///
+/// @param trie the trie
+/// @param e the entry, copied
+/// @return 1 on success or if the key was there, 0 if memory ran out
+
+static int insert(Trie6 trie, const struct Entry6_s *e) {
+    if(!reserve(trie)) {
+        return 0;
+    }
+    struct Node6_s *pool = trie->pool;
+    ip6_t key = e->key;
+
+    unsigned int node = trie->root;
+    while(node != NIL && pool[node].value == NIL) {
+        node = BIT(key, pool[node].bit) ? pool[node].right :
+            pool[node].left;
+    }
+    unsigned int bit = BITS;
+    if(node != NIL) {
+        if(pool[node].key == key) {
+            return 1;
+        }
+        bit = common(key, pool[node].key);
+    }
+
+    unsigned int leaf = new_node(trie);
+    pool[leaf].key = key;
+    pool[leaf].left = pool[leaf].right = NIL;
+    pool[leaf].value = store(trie, e);
+    pool[leaf].bit = BITS;
+    pool[leaf].height = 1;
+    trie->num_leaves++;
+
+    // the new branch goes above the first node that branches on a
+    // later bit than the one the keys differ in
+    unsigned int path[DEPTHS];
+    size_t depth = 0;
+    unsigned int *link = &trie->root;
+    while(*link != NIL && pool[*link].value == NIL &&
+        pool[*link].bit < bit) {
+        path[depth++] = *link;
+        link = BIT(key, pool[*link].bit) ? &pool[*link].right :
+            &pool[*link].left;
+    }
+    if(*link == NIL) {
+        *link = leaf;
+        return 1;
+    }
+    if(pool[*link].value != NIL) {
+        STATS_ADD(trie, collisions, 1);
+    }
+    unsigned int branch = new_node(trie);
+    pool[branch].key = key;
+    pool[branch].value = NIL;
+    pool[branch].bit = (unsigned short) bit;
+    if(BIT(key, bit)) {
+        pool[branch].left = *link;
+        pool[branch].right = leaf;
+    }
+    else {
+        pool[branch].left = leaf;
+        pool[branch].right = *link;
+    }
+    pool[branch].height = branch_height(pool, branch);
+    *link = branch;
+    trie->num_branches++;
+    fix_heights(pool, path, depth);
+    return 1;
+}
+
+/// Removes the leaf of a key; its sibling takes the place of their
+/// branch node, so no chain of one-child nodes is ever left behind.
+///
+/// @param trie the trie
+/// @param key the key to remove
+/// @return 1 if it was removed, 0 if it was not there
+
+static int remove_key(Trie6 trie, ip6_t key) {
+    struct Node6_s *pool = trie->pool;
+    unsigned int path[DEPTHS];
+    size_t depth = 0;
+    unsigned int *parent_link = NULL;
+    unsigned int *link = &trie->root;
+
+    while(*link != NIL && pool[*link].value == NIL) {
+        path[depth++] = *link;
+        parent_link = link;
+        link = BIT(key, pool[*link].bit) ? &pool[*link].right :
+            &pool[*link].left;
+    }
+    unsigned int leaf = *link;
+    if(leaf == NIL || pool[leaf].key != key) {
+        return 0;
+    }
+    trie->entries[pool[leaf].value].loc = trie->free_entries;
+    trie->free_entries = pool[leaf].value;
+    pool[leaf].left = trie->free_nodes;
+    trie->free_nodes = leaf;
+    trie->num_leaves--;
+
+    if(parent_link == NULL) {
+        trie->root = NIL;
+        return 1;
+    }
+    unsigned int branch = *parent_link;
+    *parent_link = (pool[branch].left == leaf) ? pool[branch].right :
+        pool[branch].left;
+    pool[branch].left = trie->free_nodes;
+    trie->free_nodes = branch;
+    trie->num_branches--;
+    fix_heights(pool, path, depth - 1);
+    return 1;
+}
+
+/// Finds the leaf with the largest key below a node.
+///
+/// @param trie the trie, whose counters the steps are added to
+/// @param node the root of the subtrie
+/// @return the entry of the leaf, or NIL for an empty subtrie
+
+static unsigned int subtrie_max(Trie6 trie, unsigned int node) {
+    const struct Node6_s *pool = trie->pool;
+    STATS_ADD(trie, backtracks, 1);
+    while(node != NIL && pool[node].value == NIL) {
+        STATS_ADD(trie, nodes_visited, 1);
+        node = pool[node].right;
+    }
+    return (node == NIL) ? NIL : pool[node].value;
+}
+
+/// Finds the entry with the largest key not greater than key in one
+/// walk down. A branch node whose subtrie parts from key above its
+/// branch bit lies wholly above or below key; otherwise the walk
+/// follows key's bit, noting the left subtrie it passes by going
+/// right, since all of it is smaller.
+///
+/// @param trie the trie
+/// @param key the key to find
+/// @return the index of the entry, or NIL if every key is greater
+
+static unsigned int search(Trie6 trie, ip6_t key) {
+    const struct Node6_s *pool = trie->pool;
+    unsigned int smaller = NIL;
+    unsigned int node = trie->root;
+
+    STATS_ADD(trie, searches, 1);
+    while(node != NIL) {
+        const struct Node6_s *n = &pool[node];
+        STATS_ADD(trie, nodes_visited, 1);
+        if(n->value != NIL) {
+            return (n->key <= key) ? n->value : subtrie_max(trie, smaller);
+        }
+        if(n->key != key) {
+            unsigned int bit = common(key, n->key);
+            if(bit < n->bit) {
+                return BIT(key, bit) ? subtrie_max(trie, node) :
+                    subtrie_max(trie, smaller);
+            }
+        }
+        if(BIT(key, n->bit)) {
+            smaller = n->left;
+            node = n->right;
+        }
+        else {
+            node = n->left;
+        }
+    }
+    return NIL;
+}
+
+
+/// Create an empty IPv6 trie.
+/// @return pointer to the Trie6 instance or NULL on failure
+
+Trie6 ibt6_create( void ) {
+    Trie6 trie = (Trie6) calloc(1, sizeof(struct Trie6_s));
+    if(trie == NULL) {
+        return NULL;
+    }
+    trie->pool = (struct Node6_s*) malloc(sizeof(struct Node6_s) * 16);
+    trie->entries = (struct Entry6_s*) malloc(sizeof(struct Entry6_s) * 16);
+    if(trie->pool == NULL || trie->entries == NULL) {
+        free(trie->pool);
+        free(trie->entries);
+        free(trie);
+        return NULL;
+    }
+    memset(&trie->pool[NIL], 0, sizeof(struct Node6_s));
+    trie->pool_size = trie->num_entries = 1;     // slot 0 is NIL
+    trie->pool_capacity = trie->entries_capacity = 16;
+    return trie;
+}
+
+/// Destroy the trie and free all storage.
+/// @param trie a pointer to a Trie6 instance
+
+void ibt6_destroy( Trie6 trie) {
+    free(trie->pool);
+    free(trie->entries);
+    free(trie);
+}
+
+/// insert an entry into the trie as long as its key is not already
+/// present
+/// @param trie a pointer to a Trie6 instance
+/// @param e the entry to be inserted, copied
+/// @return 1 on success, 0 if memory ran out
+
+int ibt6_insert( Trie6 trie, Entry6 e) {
+    return insert(trie, e);
+}
+
+/// remove the entry with the given key
+/// @param trie a pointer to a Trie6 instance
+/// @param key the key of the entry to remove
+/// @return 1 if it was removed, 0 if there was none
+
+int ibt6_delete( Trie6 trie, ip6_t key) {
+    return remove_key(trie, key);
+}
+
+/// search for the entry whose range contains key: the predecessor of
+/// key, if its range reaches key.
+/// @param trie a pointer to a Trie6 instance
+/// @param key the address to find
+/// @return the entry, or NULL if none
+
+Entry6 ibt6_search( Trie6 trie, ip6_t key) {
+    unsigned int e = search(trie, key);
+    if(e == NIL || key > trie->entries[e].key_to) {
+        return NULL;
+    }
+    return &trie->entries[e];
+}
+
+/// get the number of entries
+/// @param trie a pointer to a Trie6 instance
+/// @return size of trie
+
+size_t ibt6_size( Trie6 trie) {
+    return trie->num_leaves;
+}
+
+/// get the number of internal (branch) nodes
+/// @param trie a pointer to a Trie6 instance
+/// @return the count of internal nodes
+
+size_t ibt6_node_count( Trie6 trie) {
+    return trie->num_branches;
+}
+
+/// get the height of the trie, which every change keeps up to date in
+/// the nodes on its path
+/// @param trie a pointer to a Trie6 instance
+/// @return height of trie
+
+size_t ibt6_height( Trie6 trie) {
+    return trie->pool[trie->root].height;
+}
+
+/// get the number of leaves and of branch nodes at each depth, walking
+/// the trie with an explicit stack
+/// @param trie a pointer to a Trie6 instance
+/// @param leaves receives the leaf count of depths 0 to IBT6_DEPTHS - 1,
+/// may be NULL
+/// @param internal receives the branch node count of each depth, may be
+/// NULL
+
+void ibt6_depth_histogram( Trie6 trie, size_t *leaves, size_t *internal) {
+    unsigned int stack[DEPTHS + 1];
+    size_t depth[DEPTHS + 1];
+    size_t top = 0;
+
+    if(leaves != NULL) {
+        memset(leaves, 0, sizeof(size_t) * DEPTHS);
+    }
+    if(internal != NULL) {
+        memset(internal, 0, sizeof(size_t) * DEPTHS);
+    }
+    if(trie->root != NIL) {
+        stack[top] = trie->root;
+        depth[top++] = 0;
+    }
+    while(top > 0) {
+        top--;
+        const struct Node6_s *n = &trie->pool[stack[top]];
+        size_t d = depth[top];
+        if(n->value != NIL) {
+            if(leaves != NULL) {
+                leaves[d]++;
+            }
+            continue;
+        }
+        if(internal != NULL) {
+            internal[d]++;
+        }
+        stack[top] = n->right;
+        depth[top++] = d + 1;
+        stack[top] = n->left;
+        depth[top++] = d + 1;
+    }
+}
+
+/// get the trie's counters as they are now
+/// @param trie a pointer to a Trie6 instance
+/// @param stats receives the counters
+
+void ibt6_stats( Trie6 trie, struct Stats_s *stats) {
+#ifdef IBT_STATS
+    stats->enabled = 1;
+#else
+    stats->enabled = 0;
+#endif
+    stats->searches = __atomic_load_n(&trie->stats.searches,
+        __ATOMIC_RELAXED);
+    stats->nodes_visited = __atomic_load_n(&trie->stats.nodes_visited,
+        __ATOMIC_RELAXED);
+    stats->backtracks = __atomic_load_n(&trie->stats.backtracks,
+        __ATOMIC_RELAXED);
+    stats->collisions = trie->stats.collisions;
+    stats->entries_copied = trie->stats.entries_copied;
+    stats->bytes_allocated = trie->stats.bytes_allocated;
+}
+
+/// set the trie's counters back to zero
+/// @param trie a pointer to a Trie6 instance
+
+void ibt6_stats_reset( Trie6 trie) {
+    __atomic_store_n(&trie->stats.searches, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&trie->stats.nodes_visited, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&trie->stats.backtracks, 0, __ATOMIC_RELAXED);
+    trie->stats.collisions = 0;
+    trie->stats.entries_copied = 0;
+    trie->stats.bytes_allocated = 0;
+}
+
+/// write the counters and the size of the trie as a JSON object
+/// @param trie a pointer to a Trie6 instance
+/// @param buffer receives the text
+/// @param size the bytes buffer has room for
+/// @return the length of the whole text, as snprintf returns it
+
+int ibt6_stats_format( Trie6 trie, char *buffer, size_t size) {
+    struct Stats_s stats;
+    ibt6_stats(trie, &stats);
+    return snprintf(buffer, size, "{\"enabled\": %d, \"size\": %zu, "
+        "\"node_count\": %zu, \"height\": %zu, "
+        "\"searches\": %zu, \"nodes_visited\": %zu, \"backtracks\": %zu, "
+        "\"collisions\": %zu, \"entries_copied\": %zu, "
+        "\"bytes_allocated\": %zu}\n", stats.enabled, ibt6_size(trie),
+        ibt6_node_count(trie), ibt6_height(trie),
+        stats.searches, stats.nodes_visited, stats.backtracks,
+        stats.collisions, stats.entries_copied, stats.bytes_allocated);
+}
+
+/// print the counters and the size of the trie as a JSON object
+/// @param trie a pointer to a Trie6 instance
+/// @param stream the stream destination of output
+
+void ibt6_stats_dump( Trie6 trie, FILE *stream) {
+    char buffer[512];
+    if(ibt6_stats_format(trie, buffer, sizeof(buffer)) > 0) {
+        fputs(buffer, stream);
+    }
+}
+
+/// Prints one entry the way entry_print does, with the range's first
+/// address in IPv6 notation.
+///
+/// @param e the entry
+/// @param stream the stream
+
+static void show_entry(const struct Entry6_s *e, FILE *stream) {
+    char address[IBT6_ADDRSTRLEN];
+    const char *cc = entry_location_of(e->loc);
+    const char *name = cc + strlen(cc) + 1;
+    const char *province = name + strlen(name) + 1;
+    const char *city = province + strlen(province) + 1;
+
+    ibt6_format_address(e->key, address);
+    fprintf(stream, "(%s, %s:  %s, %s, %s)\n", address, cc, name,
+        city, province);
+}
+
+/// print every entry in key order, one line each, walking the trie
+/// with an explicit stack
+/// @param trie a pointer to a Trie6 instance
+/// @param stream the stream destination of output
+
+void ibt6_show( Trie6 trie, FILE *stream) {
+    unsigned int stack[DEPTHS + 1];
+    size_t top = 0;
+
+    if(trie->root != NIL) {
+        stack[top++] = trie->root;
+    }
+    while(top > 0) {
+        const struct Node6_s *n = &trie->pool[stack[--top]];
+        if(n->value != NIL) {
+            show_entry(&trie->entries[n->value], stream);
+            continue;
+        }
+        stack[top++] = n->right;
+        stack[top++] = n->left;
+    }
+}
+
+/// read an address in any of the textual forms of RFC 4291
+/// @param text the address
+/// @param key receives the address
+/// @return 1 on success, 0 if text is not an IPv6 address
+
+int ibt6_parse_address( const char *text, ip6_t *key) {
+    unsigned char bytes[16];
+    if(inet_pton(AF_INET6, text, bytes) != 1) {
+        return 0;
+    }
+    ip6_t value = 0;
+    for(size_t i = 0; i < sizeof(bytes); i++) {
+        value = (value << 8) | bytes[i];
+    }
+    *key = value;
+    return 1;
+}
+
+/// write an address in the compressed form of RFC 5952
+/// @param key the address
+/// @param buffer receives the text, IBT6_ADDRSTRLEN bytes
+
+void ibt6_format_address( ip6_t key, char *buffer) {
+    unsigned char bytes[16];
+    for(size_t i = sizeof(bytes); i > 0; i--) {
+        bytes[i - 1] = (unsigned char) (key & 0xFF);
+        key >>= 8;
+    }
+    if(inet_ntop(AF_INET6, bytes, buffer, IBT6_ADDRSTRLEN) == NULL) {
+        buffer[0] = '\0';
+    }
+}
@@ -0,0 +1,151 @@
+//
+// File: trie6.h
+// Trie of IPv6 address ranges: the insert, search and statistics of
+// trie.h over 128-bit keys, on a path-compressed trie so a lookup
+// visits a node per entry it tells apart rather than one per key bit.
+// // // // // // // // // // // // // // // // // // // // // // // //
+
+#ifndef TRIE6_H
+#define TRIE6_H
+
+#include <stdio.h>
+#include "entry.h"
+#include "trie.h"
+
+
+/// an IPv6 address, most significant bit first
+__extension__ typedef unsigned __int128 ip6_t;
+
+/// room for the text of any address, see ibt6_format_address
+#define IBT6_ADDRSTRLEN 46
+
+/// number of depths a node of the trie can be at, the root's included:
+/// a branch node per bit and a leaf
+#define IBT6_DEPTHS 129
+
+/// A range of IPv6 addresses and its location.
+
+struct Entry6_s {
+    ip6_t key;               ///< first address of the range
+    ip6_t key_to;            ///< last address of the range
+    loc_t loc;               ///< interned location, see entry_location_of
+};
+
+typedef struct Entry6_s * Entry6;
+
+/// Trie6 is a pointer to the IPv6 trie ADT
+
+typedef struct Trie6_s * Trie6;
+
+
+/// Create an empty IPv6 trie.
+/// @return pointer to the Trie6 instance or NULL on failure
+
+Trie6 ibt6_create( void );
+
+/// Destroy the trie and free all storage.
+/// @param trie a pointer to a Trie6 instance
+
+void ibt6_destroy( Trie6 trie);
+
+/// insert an entry into the trie as long as its key is not already
+/// present
+/// @param trie a pointer to a Trie6 instance
+/// @param e the entry to be inserted; the caller keeps ownership
+/// @return 1 on success, 0 if memory ran out
+
+int ibt6_insert( Trie6 trie, Entry6 e);
+
+/// remove the entry with the given key
+/// @param trie a pointer to a Trie6 instance
+/// @param key the key of the entry to remove
+/// @return 1 if it was removed, 0 if there was none
+
+int ibt6_delete( Trie6 trie, ip6_t key);
+
+/// search for the entry whose range [key, key_to] contains key. The
+/// ranges are expected not to overlap.
+/// @param trie a pointer to a Trie6 instance
+/// @param key the address to find
+/// @return the entry, or NULL if none; it belongs to the trie and stays
+/// valid until the next insert or delete
+
+Entry6 ibt6_search( Trie6 trie, ip6_t key);
+
+/// get the number of entries. Like ibt_size, this, ibt6_node_count and
+/// ibt6_height do not walk the trie.
+/// @param trie a pointer to a Trie6 instance
+/// @return size of trie
+
+size_t ibt6_size( Trie6 trie);
+
+/// get the number of internal (branch) nodes
+/// @param trie a pointer to a Trie6 instance
+/// @return the count of internal nodes
+
+size_t ibt6_node_count( Trie6 trie);
+
+/// get the height of the trie: the most nodes a lookup visits
+/// @param trie a pointer to a Trie6 instance
+/// @return height of trie
+
+size_t ibt6_height( Trie6 trie);
+
+/// get the number of leaves and of branch nodes at each depth, the
+/// root being at depth 0. A split moves the whole subtrie below it a
+/// level down, so unlike ibt_depth_histogram this walks the trie.
+/// @param trie a pointer to a Trie6 instance
+/// @param leaves receives IBT6_DEPTHS leaf counts, may be NULL
+/// @param internal receives IBT6_DEPTHS branch node counts, may be NULL
+
+void ibt6_depth_histogram( Trie6 trie, size_t *leaves, size_t *internal);
+
+/// get the trie's counters as they are now, see struct Stats_s; the
+/// nodes visited are the branch nodes and leaves of the compressed trie
+/// @param trie a pointer to a Trie6 instance
+/// @param stats receives the counters
+
+void ibt6_stats( Trie6 trie, struct Stats_s *stats);
+
+/// set the trie's counters back to zero
+/// @param trie a pointer to a Trie6 instance
+
+void ibt6_stats_reset( Trie6 trie);
+
+/// write the counters and the size of the trie as a JSON object on one
+/// line, the way snprintf writes, see ibt_stats_format
+/// @param trie a pointer to a Trie6 instance
+/// @param buffer receives the text
+/// @param size the bytes buffer has room for
+/// @return the length of the whole text, which was cut short if it is
+/// size or more, or negative on an error
+
+int ibt6_stats_format( Trie6 trie, char *buffer, size_t size);
+
+/// print the counters and the size of the trie as a JSON object
+/// @param trie a pointer to a Trie6 instance
+/// @param stream the stream destination of output
+
+void ibt6_stats_dump( Trie6 trie, FILE *stream);
+
+/// print every entry in key order, one line each
+/// @param trie a pointer to a Trie6 instance
+/// @param stream the stream destination of output
+
+void ibt6_show( Trie6 trie, FILE *stream);
+
+/// read an address in any of the textual forms of RFC 4291
+/// @param text the address
+/// @param key receives the address
+/// @return 1 on success, 0 if text is not an IPv6 address
+
+int ibt6_parse_address( const char *text, ip6_t *key);
+
+/// write an address in the compressed form of RFC 5952
+/// @param key the address
+/// @param buffer receives the text, IBT6_ADDRSTRLEN bytes
+
+void ibt6_format_address( ip6_t key, char *buffer);
+
+
+#endif // TRIE6_H